@@ -77,7 +77,12 @@ struct cm_establish_value {
 struct server_config_value {
 	char server_ip_addr[128] = {0};
 	uint32_t server_cm_port = 160603;
+	// threads answering connect requests
 	uint32_t server_threads = 1;
+	// connect requests rdma_listen queues
+	int listen_backlog = 1024;
+	// warm connections with registered buffers per CQ worker for accept, 0: off
+	uint32_t qp_pool_size = 0;
 };
 
 struct client_config_value {
@@ -86,6 +91,22 @@ struct client_config_value {
 	uint64_t data_per_thread = 0x800000000;
 };
 
+struct worker_config_value {
+	// 0: one CQ worker per RNIC-local core
+	uint32_t cq_workers = 0;
+	// cpu lists like "2-5,8", empty: derived from the RNIC NUMA node
+	char worker_cpus[256] = {0};
+	char app_cpus[256] = {0};
+	// round_robin, least_loaded or peer_hash
+	char placement[32] = "least_loaded";
+	// move connections once the busiest worker exceeds the idlest by this percent, 0: off
+	uint32_t rebalance_spread = 0;
+	// RC: each worker core owns its connections, SRQ and timers, no rebalancing
+	bool thread_per_core = false;
+	// RC read callbacks on a work-stealing pool of this many threads, 0: on the CQ thread
+	uint32_t executor_threads = 0;
+};
+
 struct test_config_value {
 	uint64_t time_duration = 10000;
 };
@@ -121,6 +142,7 @@ class ConfigParameter {
 		struct cm_establish_value cm_config;
 		struct server_config_value server_config;
 		struct client_config_value client_config;
+		struct worker_config_value worker_config;
 		bool use_huge_page = false;
 		struct test_config_value test_config;
 	} configs;
@@ -245,8 +267,8 @@ class ConfigParameter {
 
 	void ParseTest(const YAML::Node& yaml_test_config);
 
-};
+	void ParseWorker(const YAML::Node& yaml_worker_config);
 
-ConfigParameter* ConfigParameter::configobj = nullptr;
+};
 
 #endif
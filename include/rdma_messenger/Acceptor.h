@@ -20,6 +20,12 @@
 
 #include <arpa/inet.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
 #include "rdma_messenger/ThreadWrapper.h"
 #include "rdma_messenger/Callback.h"
 #include "rdma_messenger/RDMAStack.h"
@@ -38,11 +44,51 @@ class AcceptThread : public ThreadWrapper {
 	RDMAStack *rdma_stack;
 };
 
+// Answers the connect requests the CM thread dispatches to it: QP and
+// buffer setup of one request runs here while the next ones are queued.
+class AcceptShard : public ThreadWrapper {
+	public:
+	AcceptShard(RDMAStack* rdma_stack) : rdma_stack(rdma_stack)
+	{}
+
+	void push(accept_request* request);
+	// let entry return once the queue is drained
+	void stop();
+
+	virtual void entry() override;
+	virtual void abort() override;
+
+	private:
+	RDMAStack* rdma_stack;
+	std::deque<accept_request*> requests;
+	std::mutex mtx;
+	std::condition_variable cond;
+	bool stopped = false;
+};
+
+// spreads connect requests round-robin over the accept shards
+class AcceptDispatch : public Callback {
+	public:
+	AcceptDispatch(std::vector<AcceptShard*>& shards) : shards(shards)
+	{}
+
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		uint64_t next = counter.fetch_add(1, std::memory_order_relaxed);
+		shards[next % shards.size()]->push(static_cast<accept_request*>(param));
+	}
+
+	private:
+	std::vector<AcceptShard*>& shards;
+	std::atomic<uint64_t> counter{0};
+};
+
 class Acceptor {
 	public:
 	Acceptor(struct sockaddr* addr) :
 		server_addr(addr)
 	{}
+	// stops and joins the accept shards, the stack has to outlive it
 	~Acceptor();
 
 	void listen();
@@ -50,10 +96,18 @@ class Acceptor {
 	void shutdown();
 	void set_network_stack(RDMAStack *rdma_stack);
 	void set_accept_callback(Callback *accept_callback);
+	// Answer connect requests on shard_nums threads, the accept callback
+	// then runs on any of them. 1 (default) answers on the CM thread.
+	void set_shards(uint32_t shard_nums);
+	// connect requests rdma_listen queues
+	void set_backlog(int backlog);
 
 	private:
 	struct sockaddr* server_addr;
 	AcceptThread *accept_thread = nullptr;
+	uint32_t shard_nums = 1;
+	std::vector<AcceptShard*> shards;
+	AcceptDispatch* dispatch = nullptr;
 	Callback *accept_callback = nullptr;
 	RDMAStack *rdma_stack;
 };
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATOMICOP_H
+#define ATOMICOP_H
+
+#include <rdma/rdma_cma.h>
+
+#include "rdma_messenger/Callback.h"
+
+// One outstanding fetch-and-add or compare-and-swap. The original remote
+// value lands in *result, a slot of a registered per-connection buffer.
+class AtomicOp {
+	public:
+	AtomicOp(struct ibv_mr *mr, uint64_t* result):
+		mr(mr), result(result)
+	{}
+
+	uint64_t get_result() const
+	{
+		return *result;
+	}
+
+	// compare-and-swap succeeded when the old value matched compare
+	bool swapped() const
+	{
+		return opcode == IBV_WR_ATOMIC_CMP_AND_SWP && *result == compare_add;
+	}
+
+	struct ibv_mr *mr;
+	uint64_t* result;
+	enum ibv_wr_opcode opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+	uint64_t remote_addr = 0;
+	uint32_t rkey = 0;
+	uint64_t compare_add = 0;
+	uint64_t swap = 0;
+	Callback* callback = nullptr;
+	uint64_t user_data = 0;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONNECTIONREGISTRY_H
+#define CONNECTIONREGISTRY_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "rdma_messenger/rdma_config.h"
+
+class RDMAConnection;
+
+// wr_id of every RC work request, resolved without any map lookup:
+// | slot 24 | generation 16 | kind 8 | index 16 |
+// slot and generation form the tag of the owning connection, index selects
+// the chunk or atomic operation inside it.
+enum wr_kind {
+	WR_RECV = 1,
+	WR_SEND,
+	WR_ATOMIC,
+	WR_FIN,
+	// receive chunk of a CoreShard SRQ, tag 0
+	WR_SHARD_RECV,
+};
+
+inline uint64_t make_wr_tag(uint32_t slot, uint16_t generation)
+{
+	return (static_cast<uint64_t>(slot) << 40) | (static_cast<uint64_t>(generation) << 24);
+}
+
+inline uint64_t make_wr_id(uint64_t tag, wr_kind kind, uint32_t index)
+{
+	return tag | (static_cast<uint64_t>(kind) << 16) | (index & 0xffffU);
+}
+
+inline uint64_t wr_tag(uint64_t wr_id)
+{
+	return wr_id & ~0xffffffULL;
+}
+
+inline uint32_t wr_slot(uint64_t wr_id)
+{
+	return wr_id >> 40;
+}
+
+inline wr_kind wr_kind_of(uint64_t wr_id)
+{
+	return static_cast<wr_kind>((wr_id >> 16) & 0xffU);
+}
+
+inline uint32_t wr_index(uint64_t wr_id)
+{
+	return wr_id & 0xffffU;
+}
+
+#define REGISTRY_OFFLINE UINT64_MAX
+
+// one per CQ thread, the global epoch seen when it woke up for a batch,
+// padded so the readers do not share a cache line
+struct registry_reader {
+	std::atomic<uint64_t> epoch{REGISTRY_OFFLINE};
+	char pad[56];
+};
+
+// Connections of a stack indexed by slot. CQ threads resolve a completion
+// through the slot of its wr_id between enter() and exit(); the control path
+// adds and retires connections under a lock. A retired connection is deleted
+// only once every CQ thread has left the batch it might have been seen in,
+// and its late completions (flushes after close) fail the tag check.
+class ConnectionRegistry {
+	public:
+	ConnectionRegistry();
+	~ConnectionRegistry();
+
+	// assigns a slot and stamps the connection with its wr_id tag
+	void add(RDMAConnection* con);
+	// unpublishes the connection, deleted once no CQ thread can still use it
+	void retire(RDMAConnection* con);
+	// frees retired connections past their grace period whose strand is
+	// idle; one with a callback still queued or running stays retired and
+	// CQ threads retry within RECLAIM_RETRY_MS
+	void reclaim();
+	// frees every retired connection at once, no CQ thread or executor may still run
+	void drain();
+	bool has_retired() const
+	{
+		return retired_nums.load(std::memory_order_relaxed) != 0;
+	}
+
+	// connection owning wr_id, nullptr once it is retired
+	RDMAConnection* lookup(uint64_t wr_id) const;
+
+	registry_reader* add_reader();
+	void enter(registry_reader* reader)
+	{
+		reader->epoch.store(global_epoch.load());
+	}
+	void exit(registry_reader* reader)
+	{
+		reader->epoch.store(REGISTRY_OFFLINE, std::memory_order_release);
+	}
+
+	private:
+	struct registry_slot {
+		std::atomic<RDMAConnection*> con{nullptr};
+		uint16_t generation = 0;
+	};
+
+	registry_slot* get_slot(uint32_t slot) const;
+
+	private:
+	// pages are allocated on demand and never freed before the registry
+	std::atomic<registry_slot*> pages[REGISTRY_PAGES];
+	// slot 0 stays empty so that tag 0 never resolves
+	uint32_t slot_nums = 1;
+	std::vector<uint32_t> free_slots;
+	std::mutex slot_mtx;
+
+	std::atomic<uint64_t> global_epoch{1};
+	std::vector<std::unique_ptr<registry_reader>> readers;
+	// retire epoch and connection
+	std::vector<std::pair<uint64_t, RDMAConnection*>> retired;
+	std::atomic<uint32_t> retired_nums{0};
+	std::mutex retire_mtx;
+};
+
+#endif
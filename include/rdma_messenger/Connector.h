@@ -20,6 +20,9 @@
 
 #include <arpa/inet.h>
 
+#include <mutex>
+#include <condition_variable>
+
 #include "rdma_messenger/ThreadWrapper.h"
 #include "rdma_messenger/Callback.h"
 #include "rdma_messenger/RDMAStack.h"
@@ -37,6 +40,26 @@ class ConnectThread : public ThreadWrapper {
 	RDMAStack* rdma_stack;
 };
 
+// Completion of a batch of async connects: hands every established
+// connection to connect_callback and lets wait() return once all are done.
+class ConnectWaiter : public Callback {
+	public:
+	ConnectWaiter(Callback* connect_callback, uint32_t con_nums) :
+		connect_callback(connect_callback), pending(con_nums)
+	{}
+
+	virtual void callback_entry(void* param, void* msg = nullptr) override;
+	// number of failed connects
+	uint32_t wait();
+
+	private:
+	Callback* connect_callback;
+	uint32_t pending;
+	uint32_t failed = 0;
+	std::mutex mtx;
+	std::condition_variable cv;
+};
+
 class Connector {
 	public:
 	Connector(struct sockaddr* addr) :
@@ -45,12 +68,17 @@ class Connector {
 	~Connector();
 
 	void connect();
+	// start one connect and return, see RDMAStack::async_connect
+	void async_connect(Callback* done, const void* private_data = nullptr, uint8_t private_data_len = 0,
+			connect_timing* timing = nullptr);
 	void join();
 	void shutdown();
 	void set_network_stack(RDMAStack* rdma_stack_);
 	void set_connect_callback(Callback* callback);
+	void set_source_addr(struct sockaddr* src_addr);
 	private:
 	struct sockaddr* connector_addr;
+	struct sockaddr* source_addr = nullptr;
 	ConnectThread* connect_thread = nullptr;
 	Callback* connect_callback = nullptr;
 	RDMAStack* rdma_stack;
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORESHARD_H
+#define CORESHARD_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include <rdma/rdma_cma.h>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Callback.h"
+#include "rdma_messenger/Chunk.h"
+#include "rdma_messenger/SPSCRing.h"
+
+class CQThread;
+class RDMAConnection;
+
+enum shard_op {
+	SHARD_CALL = 0,
+	SHARD_ADOPT,
+	SHARD_RELEASE,
+};
+
+// SHARD_CALL: callback->callback_entry(param, msg) on the receiving core.
+// SHARD_ADOPT and SHARD_RELEASE carry the RDMAConnection in param and its
+// QP number, release runs callback->callback_entry(param, msg) once the
+// connection is out of the table.
+struct shard_msg {
+	Callback* callback;
+	void* param;
+	void* msg;
+	shard_op op;
+	uint32_t qp_num;
+};
+
+struct shard_timer {
+	uint64_t deadline_ns;
+	Callback* callback;
+	void* param;
+
+	bool operator>(const shard_timer& other) const
+	{
+		return deadline_ns > other.deadline_ns;
+	}
+};
+
+// Thread-per-core mode: everything one CQ worker needs to serve its
+// connections without touching another core. The shard owns a PD, one SRQ
+// with its receive chunks shared by all of its connections, the table of
+// those connections and a timer queue; all of it is used by the owner
+// thread only. Send chunks stay per connection since any thread may send,
+// sized to SHARD_RECV_CHUNK_SIZE like the receive chunks. Other cores reach it through one SPSC ring per sending core.
+class CoreShard {
+	public:
+	CoreShard(struct ibv_context* verbs, uint32_t core_id, CQThread* cq_thread);
+	~CoreShard();
+
+	// false when the PD, SRQ or receive chunks could not be set up
+	bool ready() const;
+
+	// every shard of a device, wired before any worker starts
+	void set_peers(const std::vector<CoreShard*>& peers);
+
+	// shard of the calling worker thread, nullptr on any other thread
+	static CoreShard* current();
+	void bind();
+
+	// Run callback->callback_entry(param, msg) on core `to`. Worker threads
+	// use the SPSC ring of the pair, other threads share one ring under a
+	// lock. false when the ring is full.
+	bool send_to(uint32_t to, Callback* callback, void* param, void* msg = nullptr);
+	// callback->callback_entry(param) on this core after delay_us, owner thread only
+	void add_timer(uint64_t delay_us, Callback* callback, void* param);
+
+	// CM thread: hand over a connection created on this shard's PD, CQ and SRQ
+	void adopt(RDMAConnection* con);
+	// CM thread: the owner drops con from its table, then runs
+	// retire->callback_entry(con, arg) to retire it. Nothing runs when a QP
+	// error dropped it first.
+	void release(RDMAConnection* con, Callback* retire, void* arg);
+
+	// owner thread only
+	void poll_messages();
+	void run_timers(uint64_t now_ns);
+	// epoll_wait timeout up to the next timer, -1 without timers
+	int next_timeout_ms(uint64_t now_ns) const;
+	// false when messages are already waiting and the worker must not block
+	bool prepare_sleep();
+	void finish_sleep();
+	void handle_recv(struct ibv_wc* wc);
+	// the connection of a failed QP, forget removes it from this shard
+	RDMAConnection* find(uint32_t qp_num);
+	RDMAConnection* forget(uint32_t qp_num);
+	// give a receive chunk of a failed completion back to the SRQ
+	void repost(uint64_t wr_id);
+
+	struct ibv_pd* get_pd() const;
+	struct ibv_srq* get_srq() const;
+	uint32_t get_core_id() const;
+	size_t get_connection_nums() const;
+
+	private:
+	bool push(CoreShard* to, const shard_msg& msg);
+	void post_recv(uint32_t index);
+
+	private:
+	uint32_t core_id;
+	CQThread* cq_thread;
+	struct ibv_pd* pd = nullptr;
+	struct ibv_srq* srq = nullptr;
+	char* recv_buf = nullptr;
+	struct ibv_mr* recv_mr = nullptr;
+	std::vector<Chunk*> recv_chunks;
+
+	std::vector<CoreShard*> peers;
+	// inbound[i] is written by core i only, inbound[peers.size()] by
+	// threads outside the pool under external_mtx
+	std::vector<std::unique_ptr<SPSCRing<shard_msg>>> inbound;
+	std::mutex external_mtx;
+	std::atomic<bool> sleeping{false};
+
+	std::unordered_map<uint32_t, RDMAConnection*> connections;
+	std::priority_queue<shard_timer, std::vector<shard_timer>, std::greater<shard_timer>> timers;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Callback.h"
+#include "rdma_messenger/ThreadWrapper.h"
+
+class ExecTask {
+	public:
+	virtual ~ExecTask() {}
+	virtual void run() = 0;
+};
+
+class ExecThread;
+
+// Pool of threads running ExecTasks. Every thread has its own deque: it
+// takes from the front of its own and, once that is empty, steals from the
+// back of the others before going to sleep.
+class Executor {
+	public:
+	// cpus: pin thread i to cpus[i % size], empty leaves them unpinned
+	Executor(uint32_t thread_nums, const std::vector<int>& cpus = std::vector<int>());
+	~Executor();
+
+	// queue on the deque picked by hint, any idle thread may steal it
+	void submit(ExecTask* task, uint64_t hint);
+	uint32_t get_thread_nums() const;
+
+	// executor thread body
+	void run(uint32_t thread_id);
+
+	private:
+	struct exec_queue {
+		std::deque<ExecTask*> tasks;
+		std::mutex mtx;
+	};
+
+	ExecTask* take(uint32_t thread_id);
+
+	private:
+	std::vector<exec_queue*> queues;
+	std::vector<ExecThread*> threads;
+	std::atomic<uint64_t> pending{0};
+	std::atomic<bool> stop{false};
+	std::mutex idle_mtx;
+	std::condition_variable idle_cond;
+};
+
+class ExecThread : public ThreadWrapper {
+	public:
+	ExecThread(Executor* executor, uint32_t thread_id) : executor(executor), thread_id(thread_id)
+	{}
+
+	virtual void entry() override
+	{
+		executor->run(thread_id);
+	}
+	virtual void abort() override
+	{ }
+
+	private:
+	Executor* executor;
+	uint32_t thread_id;
+};
+
+// Serializes callbacks of one connection on an Executor: at most one
+// thread runs them at a time, in the order they were posted, whichever
+// thread ends up stealing the strand.
+class Strand : public ExecTask {
+	public:
+	void post(Executor* executor, uint64_t hint, Callback* callback, void* param, void* msg);
+	// nothing queued or running, the owner may be freed
+	bool idle();
+
+	virtual void run() override;
+
+	private:
+	struct strand_item {
+		Callback* callback;
+		void* param;
+		void* msg;
+	};
+
+	std::deque<strand_item> items;
+	std::mutex mtx;
+	bool scheduled = false;
+	Executor* executor = nullptr;
+	uint64_t hint = 0;
+};
+
+#endif
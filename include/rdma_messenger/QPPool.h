@@ -0,0 +1,91 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QPPOOL_H
+#define QPPOOL_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/ThreadWrapper.h"
+#include "rdma_messenger/RDMAConnection.h"
+
+class PoolThread;
+
+// Warm RC connections for accept: registered buffers and a QP in RESET
+// created ahead of time on every CQ a device's workers poll. Accept binds
+// one to the incoming cm_id instead of registering memory on the CM thread,
+// a background thread tops each CQ back up to depth.
+class QPPool {
+	public:
+	QPPool(uint32_t depth);
+	~QPPool();
+
+	// keep depth warm connections on each of these CQs of the device,
+	// registered on the device's shared pd
+	void add_device(struct ibv_context* verbs, struct ibv_pd* pd, const std::vector<struct ibv_cq*>& cqs);
+	// a warm connection sending and receiving on cq, nullptr when drained
+	RDMAConnection* take(struct ibv_cq* cq);
+	uint32_t get_depth() const;
+
+	// refill thread body
+	void refill();
+
+	private:
+	struct pool_slot {
+		struct ibv_context* verbs;
+		struct ibv_pd* pd;
+		struct ibv_cq* cq;
+		std::deque<RDMAConnection*> warm;
+	};
+
+	// a slot below depth, nullptr when all are full
+	pool_slot* find_low();
+
+	private:
+	uint32_t depth;
+	std::vector<pool_slot*> slots;
+	std::unordered_map<struct ibv_cq*, pool_slot*> cq_slots;
+	std::mutex pool_mtx;
+	std::condition_variable pool_cond;
+	bool stop = false;
+	PoolThread* thread = nullptr;
+};
+
+class PoolThread : public ThreadWrapper {
+	public:
+	PoolThread(QPPool* pool) : pool(pool)
+	{}
+
+	virtual void entry() override
+	{
+		pool->refill();
+	}
+	virtual void abort() override
+	{ }
+
+	private:
+	QPPool* pool;
+};
+
+#endif
@@ -21,33 +21,74 @@
 #include <iostream>
 
 #include "rdma_messenger/Connector.h"
+#include "rdma_messenger/StripedConnection.h"
 
 class RDMAClient {
 	public:
-	RDMAClient(struct sockaddr *addr, uint32_t con_nums_) : client_addr(addr), con_nums(con_nums_)
+	RDMAClient(struct sockaddr *addr, uint32_t con_nums_, ibv_qp_type qp_type = IBV_QPT_RC) :
+		client_addr(addr), con_nums(con_nums_)
 	{
-		stack = new RDMAStack(false);
+		stack = new RDMAStack(false, qp_type);
 		connector = new Connector(addr);
 		connector->set_network_stack(stack);
 	}
 
 	~RDMAClient()
 	{
-		delete stack;
 		delete connector;
-		stack = nullptr;
 		connector = nullptr;
+		delete stack;
+		stack = nullptr;
 	}
 
+	// all con_nums connects are in flight at once, returns once each is
+	// established or failed; connect_callback runs on the CM thread
 	void connect(Callback *connect_callback)
 	{
 		assert(stack);
 		connector->set_connect_callback(connect_callback);
+		ConnectWaiter waiter(connect_callback, con_nums);
+		std::cout << "connecting " << con_nums << " connections..." << std::endl;
 		for (uint32_t i = 0; i < con_nums; ++i) {
-			stack->init();
-			std::cout << "connecting..." << std::endl;
-			connector->connect();
+			connector->async_connect(&waiter);
+		}
+		uint32_t failed = waiter.wait();
+		if (failed) {
+			std::cerr << failed << " of " << con_nums << " connections failed" << std::endl;
+		}
+	}
+
+	// open `lanes` QPs to the server as one logical connection, lane i binds to
+	// src_addrs[i % size] when given so lanes can spread over local ports
+	RDMAStripedConnection* connect_striped(Callback *connect_callback, uint32_t lanes,
+			const std::vector<struct sockaddr*>& src_addrs = std::vector<struct sockaddr*>())
+	{
+		assert(stack);
+		RDMAStripedConnection* group = new RDMAStripedConnection(stripe_group_id(), lanes);
+		StripeLaneCallback lane_callback(group);
+		ConnectWaiter waiter(&lane_callback, lanes);
+		std::cout << "connecting " << lanes << " lanes..." << std::endl;
+		for (uint32_t i = 0; i < lanes; ++i) {
+			stripe_private_data pdata = group->private_data(i);
+			connector->set_source_addr(src_addrs.empty() ? nullptr : src_addrs[i % src_addrs.size()]);
+			connector->async_connect(&waiter, &pdata, sizeof(pdata));
+		}
+		waiter.wait();
+		connector->set_source_addr(nullptr);
+		connector->set_connect_callback(connect_callback);
+
+		if (!group->is_complete()) {
+			std::cerr << "striped connect established " << lanes << " lanes partially" << std::endl;
+		} else if (connect_callback) {
+			connect_callback->callback_entry(group);
 		}
+		return group;
+	}
+
+	// tune the stack, e.g. its CQ worker pool, before connect()
+	RDMAStack* get_stack() const
+	{
+		return stack;
 	}
 
 	void wait()
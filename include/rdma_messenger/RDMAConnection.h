@@ -33,6 +33,14 @@
 #include "rdma_messenger/Callback.h"
 #include "rdma_messenger/Buffer.h"
 #include "rdma_messenger/Chunk.h"
+#include "rdma_messenger/AtomicOp.h"
+#include "rdma_messenger/TransferProfile.h"
+#include "rdma_messenger/ConnectionRegistry.h"
+#include "rdma_messenger/SendQueue.h"
+#include "rdma_messenger/Executor.h"
+
+class CoreShard;
+struct cq_source;
 
 enum connection_state {
 	INACTIVE = 1,
@@ -42,14 +50,46 @@ enum connection_state {
 
 class RDMAConnection {
 	public:
-	RDMAConnection(struct ibv_pd* pd, struct ibv_cq* cq, struct rdma_cm_id* cm_id, uint64_t con_id);
+	// with shared_srq the QP receives into the SRQ owner's buffers and the
+	// connection allocates no receive chunks of its own, its send chunks are
+	// SHARD_RECV_CHUNK_SIZE; without cm_id the
+	// QP is created in RESET and waits for bind()
+	RDMAConnection(struct ibv_pd* pd, struct ibv_cq* cq, struct rdma_cm_id* cm_id, uint64_t con_id,
+			struct ibv_srq* shared_srq = nullptr);
 
 	~RDMAConnection();
 
-	void async_send(const char* raw_msg, uint32_t raw_msg_size);
+	// accept side of a connection created without cm_id: take over the
+	// incoming cm_id and bring the QP to RTS, rdma_accept then names qp_num
+	bool bind(struct rdma_cm_id* cm_id, uint64_t con_id, const struct rdma_conn_param* accept_params);
+
+	// Safe from any thread: the message is copied into a free chunk and
+	// queued without locks, the thread that finds nobody posting drains the
+	// queue for everyone. false when all SEND_WQE_PER_QP chunks are in flight.
+	bool async_send(const char* raw_msg, uint32_t raw_msg_size);
+	// header and message are copied back to back into one chunk
+	bool async_send(const char* hdr, uint32_t hdr_size, const char* raw_msg, uint32_t raw_msg_size);
 	void async_recv(const char* raw_msg, uint32_t raw_msg_size);
 
-	void async_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size);
+	bool async_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size);
+
+	// remote atomics on an 8-byte aligned word of the peer's atomic region,
+	// callback gets (RDMAConnection*, AtomicOp*) with the original value.
+	// false when ATOMIC_WQE_PER_QP operations are already outstanding.
+	bool async_fetch_add(uint64_t remote_addr, uint32_t rkey, uint64_t add, Callback* callback, uint64_t user_data = 0);
+	bool async_compare_swap(uint64_t remote_addr, uint32_t rkey, uint64_t compare, uint64_t swap,
+			Callback* callback, uint64_t user_data = 0);
+	void complete_atomic(AtomicOp* op);
+
+	// expose local memory as target of the peer's atomics, addr/rkey of the
+	// returned region have to reach the peer. Deregistered with the connection.
+	struct ibv_mr* register_atomic_region(void* addr, size_t len);
+
+	// hand a received chunk to read_callback and post it again
+	void deliver(Chunk* chk);
+	// read callbacks of this connection when they run on an executor
+	Strand& get_strand();
+	bool idle();
 
 	// post & recv rdma buffer
 	void post_recv_buffer(Chunk* chk);
@@ -62,20 +102,43 @@ class RDMAConnection {
 	void get_chunk(Chunk **chk);
 	void reap_chunk(Chunk **chk);
 
+	void get_atomic_op(AtomicOp **op);
+	void reap_atomic_op(AtomicOp **op);
+
+	// completion side: chunk or atomic operation a wr_id of this connection names
+	Chunk* wr_chunk(uint64_t wr_id) const;
+	AtomicOp* wr_atomic_op(uint64_t wr_id) const;
+	void set_wr_tag(uint64_t wr_tag, uint32_t slot);
+	uint64_t get_wr_tag() const;
+	uint32_t get_slot() const;
+
 	struct ibv_qp* get_qp () const;
 	struct ibv_cq* get_cq () const;
 	uint64_t get_con_id () const;
+	struct rdma_cm_id* get_cm_id () const;
+	// rebalancing: own CQ of the connection, put once the QP is gone
+	void set_cq_source(cq_source* source);
+	// thread-per-core: the core owning this connection, nullptr otherwise
+	void set_shard(CoreShard* shard);
+	CoreShard* get_shard() const;
 	bool is_recv_buffer(const char* buf) const;
 	bool is_send_buffer(const char* buf) const;
 
 	void set_read_callback(Callback* read_callback);
+	// on the CQ thread after each send completion, its chunk is free again;
+	// param is the connection
+	void set_send_callback(Callback* send_callback);
+	void set_transfer_profile(const TransferProfile* profile);
+	// strategy actually used for a message of this size
+	transfer_strategy pick_strategy(uint32_t size) const;
 
 	void finish();
 	void close();
 
 	public:
 	connection_state state = INACTIVE;
-	Callback *read_callback;
+	Callback *read_callback = nullptr;
+	Callback *send_callback = nullptr;
 
 	private:
 	// create QP
@@ -88,17 +151,37 @@ class RDMAConnection {
 	// setup srq
 	void create_srq();
 
-	void post_send(const char* raw_msg, uint32_t raw_msg_size);
-	void post_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size);
+	bool post_send(const char* raw_msg, uint32_t raw_msg_size);
+	bool post_send(const char* hdr, uint32_t hdr_size, const char* raw_msg, uint32_t raw_msg_size);
+	bool post_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size);
+	bool post_atomic(AtomicOp* op);
+	uint64_t chunk_wr_id(wr_kind kind, const Chunk* ck) const;
+	uint32_t send_index(const Chunk* ck) const;
+	// request of a send chunk filled with its chunk as the only SGE
+	send_request* prepare_send(Chunk* ck, wr_kind kind);
+	// post whatever is queued unless another thread is already at it
+	void flush_send_queue();
 
 	private:
 	struct ibv_pd* pd;
 	struct ibv_cq* cq;
 	struct rdma_cm_id* cm_id;
 	uint64_t con_id;
+	uint64_t wr_tag = 0;
+	uint32_t slot = 0;
+	CoreShard* shard = nullptr;
+	cq_source* source = nullptr;
+	// freed with the connection, also when rdma_cm created it on cm_id
 	struct ibv_qp* qp = nullptr;
 	struct ibv_srq* srq = nullptr;
-
+	// created here rather than by the SRQ owner, freed with the connection
+	bool own_srq = false;
+	uint32_t max_inline = 0;
+	const TransferProfile* profile = nullptr;
+
+	// SGE_MSG_SIZE, or SHARD_RECV_CHUNK_SIZE on a shard's SRQ: the peer
+	// receives into chunks that small, a larger send buffer is never used
+	uint32_t chunk_size;
 	uint32_t recv_buf_len;
 	uint32_t send_buf_len;
 	char* recv_buf = nullptr;
@@ -108,10 +191,20 @@ class RDMAConnection {
 	Chunk** recv_chunk = nullptr;
 	Chunk** send_chunk = nullptr;
 
-	std::vector<Chunk*> free_chunks;
-	std::mutex chk_mtx;
+	IndexRing free_chunks;
+	send_request* send_reqs = nullptr;
+	SendQueue send_queue;
+
+	uint64_t* atomic_buf = nullptr;
+	struct ibv_mr* atomic_mr = nullptr;
+	AtomicOp** atomic_ops = nullptr;
+	IndexRing free_atomic_ops;
+	send_request* atomic_reqs = nullptr;
+	std::vector<struct ibv_mr*> atomic_regions;
+	std::mutex atomic_mtx;
 
 	Buffer con_buf;
+	Strand strand;
 };
 
 inline void* malloc_huge_pages(size_t size);
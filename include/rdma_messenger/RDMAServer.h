@@ -27,18 +27,19 @@
 
 class RDMAServer {
 	public:
-	RDMAServer(struct sockaddr *addr) : server_addr(addr)
+	RDMAServer(struct sockaddr *addr, ibv_qp_type qp_type = IBV_QPT_RC) : server_addr(addr)
 	{
-		stack =  new RDMAStack(true);
+		stack =  new RDMAStack(true, qp_type);
 		acceptor = new Acceptor(server_addr);
 		acceptor->set_network_stack(stack);
 	}
 	~RDMAServer()
 	{
-		delete stack;
+		// accept shards call into the stack, stop and join them first
 		delete acceptor;
-		stack = nullptr;
 		acceptor = nullptr;
+		delete stack;
+		stack = nullptr;
 	}
 
 	void start(Callback *accept_callback)
@@ -47,6 +48,23 @@ class RDMAServer {
 		acceptor->listen();
     }
 
+	// server_threads: threads answering connect requests, set before start()
+	void set_accept_threads(uint32_t accept_threads)
+	{
+		acceptor->set_shards(accept_threads);
+	}
+
+	void set_listen_backlog(int backlog)
+	{
+		acceptor->set_backlog(backlog);
+	}
+
+	// tune the stack, e.g. its CQ worker pool, before start()
+	RDMAStack* get_stack() const
+	{
+		return stack;
+	}
+
 	void wait()
 	{
 		std::unique_lock<std::mutex> lk(finish_mtx);
@@ -29,17 +29,32 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <rdma/rdma_cma.h>
 
 #include <set>
+#include <map>
 #include <unordered_map>
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "rdma_messenger/Callback.h"
 #include "rdma_messenger/rdma_config.h"
 #include "rdma_messenger/ThreadWrapper.h"
+#include "rdma_messenger/RNICAffinity.h"
+#include "rdma_messenger/WorkerPlacement.h"
 #include "rdma_messenger/RDMAConnection.h"
+#include "rdma_messenger/ConnectionRegistry.h"
+#include "rdma_messenger/UDEndpoint.h"
+#include "rdma_messenger/TransferProfile.h"
+#include "rdma_messenger/Executor.h"
+#include "rdma_messenger/Reactor.h"
+#include "rdma_messenger/QPPool.h"
 
 enum cm_event_state {
 	IDLE = 1,
@@ -57,6 +72,26 @@ enum cm_event_state {
 
 class RDMAStack;
 class CQThread;
+class BalancerThread;
+class ConnectEventThread;
+class CoreShard;
+
+// A CQ watched by one CQ worker: the worker's shared CQ or, with
+// rebalancing on, the own CQ of one connection that can change workers.
+struct cq_source {
+	struct ibv_context* verbs;
+	struct ibv_comp_channel* cq_channel;
+	struct ibv_cq* cq;
+	uint64_t con_id;
+	uint32_t worker_id;
+	// set by migrate, cleared once the new worker watches the CQ
+	std::atomic<bool> moving{false};
+	LoadStats load;
+	// the watching worker and, for a connection's own CQ, the connection;
+	// the last put destroys the CQ, so it outlives the connection's QP
+	std::atomic<uint32_t> refs{1};
+	void put();
+};
 
 class RDMAConMgr {
 	public:
@@ -64,83 +99,411 @@ class RDMAConMgr {
 	~RDMAConMgr();
 
 	RDMAConnection* get_connection(uint32_t qp_num);
-	RDMAConnection* new_connection(struct rdma_cm_id *cm_id);
+	// accept_params: answering a connect request, a warm connection may serve it
+	RDMAConnection* new_connection(struct rdma_cm_id *cm_id, const struct rdma_conn_param* accept_params = nullptr);
 	void add(RDMAConnection* new_con);
-	void del(uint64_t con_id, uint32_t qp_num);
+	// forget the connection, the registry frees it after the grace period
+	void del(RDMAConnection* con);
+	// completion path: owner of an RC wr_id, lock free
+	RDMAConnection* lookup(uint64_t wr_id) const
+	{
+		return registry.lookup(wr_id);
+	}
+	ConnectionRegistry& get_registry()
+	{
+		return registry;
+	}
+
+	UDEndpoint* get_ud_endpoint(uint32_t qp_num);
+	UDEndpoint* assign_ud_endpoint(struct rdma_cm_id* cm_id);
+
+	// create every CQ worker of a device at once, no-op once it exists
+	void start_workers(struct ibv_context* verbs);
+	// take effect for devices whose workers are not started yet
+	void set_worker_nums(uint32_t worker_nums);
+	void set_worker_cpus(const std::vector<int>& worker_cpus);
+	void set_app_cpus(const std::vector<int>& app_cpus);
+	// takes ownership, least-loaded by default
+	void set_placement_policy(PlacementPolicy* placement);
+	// RC only, before workers start: every worker owns a CoreShard and the
+	// connections placed on it, no rebalancing. Messages either way are up
+	// to SHARD_RECV_CHUNK_SIZE.
+	void set_thread_per_core(bool thread_per_core);
+
+	// Connections created afterwards get their own CQ, and a balancer moves
+	// one connection per REBALANCE_INTERVAL_MS from the busiest to the idlest
+	// worker of a device while their load differs by spread_percent or more.
+	void set_rebalance(uint32_t spread_percent);
+	// move a connection with its own CQ to another worker of its device,
+	// completions queue up in the CQ meanwhile and nothing is dropped
+	bool migrate(uint64_t con_id, uint32_t worker_id);
+	// one balancing round
+	void rebalance();
+	// RC, before workers start: keep depth warm connections per CQ worker
+	// for accept, not used with rebalancing or thread-per-core
+	void set_qp_pool(uint32_t depth);
+	// CPU time of every CQ worker thread, device by device
+	std::vector<uint64_t> get_worker_cpu_ns();
+
+	private:
+	struct cq_worker {
+		cq_source* source;
+		CQThread* cq_thread;
+		int cpu;
+		WorkerLoad* load;
+		CoreShard* shard;
+	};
+
+	std::vector<cq_worker>& get_workers(struct ibv_context* verbs);
+	// PD shared by the connections of a device, freed with the manager
+	struct ibv_pd* get_pd(struct ibv_context* verbs);
+	// worker of a new connection, its connection count already taken
+	cq_worker& place_connection(struct rdma_cm_id* cm_id);
+	// worker_cpus when configured, else the RNIC-local cores not shared with app_cpus
+	std::vector<int> pick_worker_cpus(struct ibv_context* verbs) const;
+	cq_source* create_source(struct ibv_context* verbs, int cqe, uint64_t con_id, uint32_t worker_id);
+	bool migrate_locked(cq_source* source, uint32_t worker_id);
 
 	private:
-	uint64_t con_number = 0;
+	// accept shards create connections concurrently
+	std::atomic<uint64_t> con_number{0};
 	RDMAStack* rdma_stack;
 	std::unordered_map<uint32_t, RDMAConnection*> qp_con_map;
 	std::unordered_map<uint64_t, RDMAConnection*> con_map;
 	std::unordered_map<uint64_t, struct ibv_cq*> cq_map;
-	std::vector<CQThread*> cq_threads;
+	// the maps above, written by the CM thread and by CQ threads on close
+	std::mutex con_mtx;
+	ConnectionRegistry registry;
+	std::unordered_map<uint64_t, WorkerLoad*> con_load_map;
+
+	std::map<struct ibv_context*, std::vector<cq_worker>> worker_pools;
+	std::mutex worker_mtx;
+	// 0: one worker per picked CPU, at most IO_WORKER_NUMS
+	uint32_t worker_nums = 0;
+	std::vector<int> worker_cpus;
+	std::vector<int> app_cpus;
+	PlacementPolicy* placement;
+	bool thread_per_core = false;
+
+	QPPool* qp_pool = nullptr;
+
+	std::map<struct ibv_context*, struct ibv_pd*> pds;
+	std::mutex pd_mtx;
+
+	// rebalancing: connections with their own CQ and the thread moving them
+	std::unordered_map<uint64_t, cq_source*> con_source_map;
+	uint32_t rebalance_percent = 0;
+	BalancerThread* balancer = nullptr;
+	std::atomic<bool> stop_balance{false};
+
+	// UD mode: one UDEndpoint per CQ worker, shared by all peers
+	uint64_t ud_number = 0;
+	std::vector<UDEndpoint*> ud_endpoints;
+	std::unordered_map<uint32_t, UDEndpoint*> qp_ud_map;
+	std::mutex ud_mtx;
+};
+
+// a CONNECT_REQUEST copied out of its CM event
+struct accept_request {
+	struct rdma_cm_id* cm_id;
+	struct rdma_conn_param conn_param;
+	std::string private_data;
+};
+
+// steady clock nanoseconds at each step of one async_connect
+struct connect_timing {
+	uint64_t start_ns = 0;
+	uint64_t addr_resolved_ns = 0;
+	uint64_t route_resolved_ns = 0;
+	// PD, CQ, registered buffers and QP of the connection exist
+	uint64_t qp_created_ns = 0;
+	// rdma_connect returned, the request is on its way
+	uint64_t connect_sent_ns = 0;
+	uint64_t established_ns = 0;
+};
+
+// context of a cm_id opened by async_connect until it is established
+struct connect_op {
+	Callback* done;
+	std::string private_data;
+	RDMAConnection* con = nullptr;
+	UDEndpoint* endpoint = nullptr;
+	connect_timing* timing = nullptr;
 };
 
 class RDMAStack {
 	public:
-	RDMAStack(bool is_server = false) : is_server(is_server), stop(false), con_mgr(new RDMAConMgr(this))
-	{}
+	RDMAStack(bool is_server = false, ibv_qp_type qp_type = IBV_QPT_RC) :
+		is_server(is_server), qp_type(qp_type), stop(false), con_mgr(new RDMAConMgr(this))
+	{
+		load_transfer_profile();
+	}
 	~RDMAStack()
 	{
 		stop.store(true);
+		// queued callbacks still reach connections, finish them first
+		delete executor;
+		executor = nullptr;
+		for (auto fd : reactor_fds) {
+			reactor->del(fd);
+		}
+		close_connect_channel();
+		delete cm_ready;
+		delete cq_ready;
 		delete con_mgr;
 		con_mgr = nullptr;
 	}
 
 	private:
-	RDMAConnection* connection_establish(struct rdma_cm_id* cm_id);
+	RDMAConnection* connection_establish(struct rdma_cm_id* cm_id, const struct rdma_conn_param* accept_params = nullptr);
+	// first error completion of con: disconnect it and leave the release to
+	// DISCONNECTED, true when no DISCONNECTED comes and the caller retires it
+	bool fail_connection(RDMAConnection* con);
 
 	public:
 	void init();
 
 	void listen(struct sockaddr* addr);
-	void accept(struct rdma_cm_id* new_cm_id);
-	void connect(struct sockaddr* addr);
+	// accept_callback gets the connection and the peer's rdma_conn_param
+	void accept(struct rdma_cm_id* new_cm_id, struct rdma_conn_param* conn_param = nullptr);
+	void connect(struct sockaddr* addr, struct sockaddr* src_addr = nullptr);
+	// Connect a cm_id of its own and return at once: done gets the
+	// RDMAConnection (the UDPeer in UD mode) once established, nullptr on
+	// failure. Any number may be in flight, all on the connect channel.
+	// timing, when given, has to stay valid until done is called.
+	void async_connect(struct sockaddr* addr, struct sockaddr* src_addr, Callback* done,
+			const void* private_data = nullptr, uint8_t private_data_len = 0,
+			connect_timing* timing = nullptr);
+	// RC connection of async_connect or accept: start the disconnect, both
+	// sides release the connection on RDMA_CM_EVENT_DISCONNECTED
+	void disconnect(RDMAConnection* con);
+	// event channel of async_connect, created on first use together with the
+	// thread serving it unless a reactor does
+	struct rdma_event_channel* get_connect_channel();
+	// Hand CONNECT_REQUEST events to dispatch instead of answering them on the
+	// CM thread: it gets an accept_request the CM event no longer owns and has
+	// to pass it to accept_dispatched, on any thread. Set before listen,
+	// nullptr answers them on the CM thread again.
+	void set_accept_dispatch(Callback* dispatch);
+	void accept_dispatched(accept_request* request);
+	// connect requests queued by rdma_listen, set before listen
+	void set_listen_backlog(int backlog);
 	void accept_abort();
 	void connection_abort();
+	// disconnect every RC connection this stack created and still holds
 	void shutdown();
 
 	void handle_recv(struct ibv_wc* wc);
 	void handle_send(struct ibv_wc* wc);
 	void handle_err(struct ibv_wc* wc);
-	void cq_event_handler(struct ibv_comp_channel* cq_channel, struct ibv_cq* poll_cq);
+	void handle_shard_err(struct ibv_wc* wc, CoreShard* shard);
+	void handle_atomic(struct ibv_wc* wc);
+	void handle_ud_recv(struct ibv_wc* wc);
+	void handle_ud_send(struct ibv_wc* wc);
+	void cq_event_handler(CQThread* worker);
+	// one epoll round of a CQ worker, false once its loop has to end
+	bool cq_poll_once(CQThread* worker, int timeout_ms);
+	// consume the CQ event of a source, re-arm and drain its CQ
+	void poll_cq_source(cq_source* source, CQThread* worker);
+	// blocking loop of the accept/connect thread
 	void cm_event_handler();
+	// loop over the connect channel until the stack goes
+	void async_cm_event_handler();
+	// handle what is queued on a non-blocking channel and return
+	void process_cm_events(struct rdma_event_channel* channel);
+
+	// Drive the CM channels and the CQ worker of each device from the
+	// application's reactor instead of accept/connect threads and CQ
+	// threads: one worker per device and no shards. Set before the first
+	// listen/connect; a blocking connect() must not run on the reactor thread.
+	void set_reactor(Reactor* reactor);
+	Reactor* get_reactor() const;
+	// reactor mode: watch a CQ worker created by RDMAConMgr
+	void watch_cq_worker(CQThread* worker);
 
 	void set_accept_callback(Callback* accept_callback);
 	void set_connect_callback(Callback* connect_callback);
+	// sent with the next rdma_connect, must stay valid until connect() returns
+	void set_connect_private_data(const void* private_data, uint8_t private_data_len);
+
+	ibv_qp_type get_qp_type() const;
+
+	// CQ worker pool: count, CPUs to pin to and CPUs the application keeps
+	// for itself, set before the first listen/connect
+	void set_worker_nums(uint32_t worker_nums);
+	void set_worker_cpus(const std::vector<int>& worker_cpus);
+	void set_app_cpus(const std::vector<int>& app_cpus);
+	// takes ownership, least-loaded by default
+	void set_placement_policy(PlacementPolicy* placement);
+	// per-connection CQs moved between workers, 0 (default) turns it off
+	void set_rebalance(uint32_t spread_percent);
+	// one shared-nothing event loop per worker core, see RDMAConMgr
+	void set_thread_per_core(bool thread_per_core);
+	// accept binds incoming connections to one of depth pre-created QPs
+	// with registered buffers per CQ worker, 0 (default) turns it off
+	void set_qp_pool(uint32_t depth);
+	// CPU time consumed by each CQ worker thread, 0 for workers driven by a reactor
+	std::vector<uint64_t> get_worker_cpu_ns();
+	// Run RC read callbacks on a work-stealing pool of thread_nums threads
+	// instead of the CQ thread, in order per connection. Call before the
+	// first connection; not used in thread-per-core mode.
+	void set_executor(uint32_t thread_nums, const std::vector<int>& cpus = std::vector<int>());
+	const TransferProfile& get_transfer_profile() const;
+
+	private:
+	// RDMA_TRANSFER_PROFILE or TRANSFER_PROFILE_PATH, defaults when missing
+	void load_transfer_profile();
+	// acks the event, false once a client's connect thread is done
+	bool handle_cm_event(struct rdma_cm_event* cm_event);
+	// next step of an async_connect, returns the cm_id to destroy once acked
+	struct rdma_cm_id* handle_connect_event(struct rdma_cm_event* cm_event);
+	// forget the connection of a disconnected or failed id, its QP is freed on reclaim
+	void release_connection(struct rdma_cm_id* id, RDMAConnection* con);
+	// before a connection is retired, shutdown must not reach it afterwards
+	void untrack(RDMAConnection* con);
+	void watch_cm_channel(struct rdma_event_channel* channel);
+	// stop and join the connect thread, destroy the ids left on the channel and the channel
+	void close_connect_channel();
+	void ud_accept(struct rdma_cm_id* new_cm_id);
+	void ud_connect();
+	// payload bytes a successful completion accounts for
+	uint64_t completion_bytes(const struct ibv_wc* wc) const;
+	// initiator_depth/responder_resources from the device limits, clamped
+	// to what the peer offered when answering a connect request
+	void set_rd_atomic(struct ibv_context* verbs, struct rdma_conn_param* cm_params,
+			const struct rdma_conn_param* peer_params);
 
 	private:
 	sem_t sem;
 	bool is_server;
+	ibv_qp_type qp_type;
 	std::atomic<bool> stop;
 	RDMAConMgr *con_mgr;
 
 	cm_event_state state;
 	struct rdma_event_channel* cm_channel = nullptr;
 	struct rdma_cm_id* cm_id = nullptr;
+	struct rdma_event_channel* connect_channel = nullptr;
+	ConnectEventThread* connect_thread = nullptr;
+	// eventfd ending connect_thread
+	int connect_stop_fd = -1;
+	std::mutex connect_mtx;
 	Callback* accept_callback = nullptr;
 	Callback* connect_callback = nullptr;
+	const void* connect_private_data = nullptr;
+	uint8_t connect_private_len = 0;
+	int32_t max_rd_atom = -1;
+	int32_t max_init_rd_atom = -1;
+	std::mutex rd_atomic_mtx;
+	int listen_backlog = LISTEN_BACKLOG;
+	std::atomic<Callback*> accept_dispatch{nullptr};
+	// accepted RC ids and the QP number of their connection
+	std::unordered_map<struct rdma_cm_id*, uint32_t> accepted_qps;
+	std::mutex accepted_mtx;
+	// RC connections this stack created, untracked before they are retired
+	std::set<RDMAConnection*> live_connections;
+	std::mutex live_mtx;
+	TransferProfile transfer_profile;
+	Executor* executor = nullptr;
+
+	// reactor mode: fds this stack registered and their handlers
+	Reactor* reactor = nullptr;
+	std::vector<int> reactor_fds;
+	std::mutex reactor_mtx;
+	Callback* cm_ready = nullptr;
+	Callback* cq_ready = nullptr;
+
+	// UD mode: peer resolved by the last RDMA_CM_EVENT_ESTABLISHED
+	UDEndpoint* ud_endpoint = nullptr;
+	UDPeer* ud_peer = nullptr;
 };
 
+// Epoll loop over the CQ sources of one worker. Sources are attached and
+// detached through a command queue the worker runs between polls, so a
+// source is never polled by two workers.
 class CQThread : public ThreadWrapper {
 	public:
-	CQThread(RDMAStack *rdma_stack, struct ibv_comp_channel *cq_channel, struct ibv_cq *cq) : rdma_stack(rdma_stack), cq_channel(cq_channel), cq(cq)
+	CQThread(RDMAStack *rdma_stack, WorkerLoad *load);
+	virtual ~CQThread();
+
+	void attach(cq_source* source);
+	// hand the source over to `to`, or stop watching and put it when nullptr
+	void detach(cq_source* source, CQThread* to);
+
+	// worker thread only
+	void run_commands();
+
+	int get_epoll_fd() const;
+	WorkerLoad* get_load() const;
+	// interrupt epoll_wait from another thread
+	void wake();
+	void set_shard(CoreShard* shard);
+	CoreShard* get_shard() const;
+	// registry reader of whichever thread runs this worker's polls
+	registry_reader* get_reader() const;
+	void set_reader(registry_reader* reader);
+
+	virtual void entry() override
+	{
+		rdma_stack->cq_event_handler(this);
+	}
+	virtual void abort() override
+	{ }
+
+	private:
+	struct cq_command {
+		cq_source* source;
+		CQThread* to;
+		bool attach;
+	};
+	void post_command(const cq_command& command);
+
+	private:
+	RDMAStack* rdma_stack;
+	WorkerLoad* load;
+	CoreShard* shard = nullptr;
+	registry_reader* reader = nullptr;
+	int epoll_fd = -1;
+	int event_fd = -1;
+	std::vector<cq_command> commands;
+	std::mutex cmd_mtx;
+};
+
+class BalancerThread : public ThreadWrapper {
+	public:
+	BalancerThread(RDMAConMgr *con_mgr, std::atomic<bool>& stop) : con_mgr(con_mgr), stop(stop)
 	{}
-	virtual ~CQThread()
+
+	virtual void entry() override
+	{
+		while (!stop.load()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(REBALANCE_INTERVAL_MS));
+			con_mgr->rebalance();
+		}
+	}
+	virtual void abort() override
+	{ }
+
+	private:
+	RDMAConMgr* con_mgr;
+	std::atomic<bool>& stop;
+};
+
+// serves the connect channel of async_connect, owned by the stack
+class ConnectEventThread : public ThreadWrapper {
+	public:
+	ConnectEventThread(RDMAStack* rdma_stack) : rdma_stack(rdma_stack)
 	{}
 
 	virtual void entry() override
 	{
-		rdma_stack->cq_event_handler(cq_channel, cq);
+		rdma_stack->async_cm_event_handler();
 	}
 	virtual void abort() override
 	{ }
 
 	private:
 	RDMAStack* rdma_stack;
-	struct ibv_comp_channel* cq_channel;
-	struct ibv_cq* cq;
 };
 
 #endif
@@ -28,15 +28,20 @@
 #include <net/if.h>
 #include <numa.h>
 
+#include <infiniband/verbs.h>
+
 #include <iostream>
 #include <memory>
 #include <fstream>
 #include <vector>
 #include <map>
+#include <string>
 
 class RNICAffinity {
 	public:
 	RNICAffinity(const char* addr);
+	// NUMA locality of the device an ibv_context is opened on
+	RNICAffinity(struct ibv_context* verbs);
 
     void query_rnic_eth_name();
 
@@ -44,6 +49,15 @@ class RNICAffinity {
 
 	void query_rnic_ib_port();
 
+	// CPUs of the RNIC's NUMA node, empty when unknown
+	std::vector<int> get_local_cpus() const;
+
+	// keep one hardware thread per physical core of cpus and drop cores
+	// that share a hyperthread sibling with any of app_cpus
+	static std::vector<int> exclude_ht_siblings(const std::vector<int>& cpus, const std::vector<int>& app_cpus);
+	// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+	static std::vector<int> parse_cpu_list(const std::string& list);
+
 	private:
 	void scan_ib(std::vector<std::string>& ib_devs);
 	void query_rnic_numa_node();
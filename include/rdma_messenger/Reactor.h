@@ -0,0 +1,82 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "rdma_messenger/Callback.h"
+
+// One epoll set for every fd of a process: rdma_cm event channels, CQ
+// worker loops, timerfds, eventfds and whatever the application adds.
+// Handlers run on the thread calling run_once/run with param and, as msg,
+// a pointer to the uint32_t epoll events of the fd.
+class Reactor {
+	public:
+	Reactor();
+	~Reactor();
+
+	// readable whenever run_once has work, add it to another epoll/poll loop
+	// to embed the reactor there
+	int get_fd() const;
+
+	// level triggered, the handler has to consume what made the fd ready
+	void add(int fd, uint32_t events, Callback* handler, void* param);
+	// handler does not run for fd once this returns on the reactor thread
+	void del(int fd);
+
+	// timerfd firing after delay_us, then every interval_us when non-zero;
+	// the expirations are read before the handler runs, del() cancels it
+	int add_timer(uint64_t delay_us, uint64_t interval_us, Callback* handler, void* param);
+	// eventfd whose handler runs once per batch of notify() from any thread
+	int add_event(Callback* handler, void* param);
+	static void notify(int event_fd);
+
+	// dispatch ready fds, waiting up to timeout_ms (-1 forever); handlers run
+	int run_once(int timeout_ms);
+	// run_once until stop()
+	void run();
+	// any thread
+	void stop();
+
+	private:
+	enum reactor_kind {
+		REACTOR_FD = 1,
+		REACTOR_TIMER,
+		REACTOR_EVENT,
+	};
+	struct reactor_handler {
+		reactor_kind kind;
+		Callback* handler;
+		void* param;
+	};
+	int add_handler(int fd, uint32_t events, reactor_kind kind, Callback* handler, void* param);
+
+	private:
+	int epoll_fd = -1;
+	int stop_fd = -1;
+	std::atomic<bool> stopped{false};
+	std::unordered_map<int, reactor_handler> handlers;
+	std::mutex handler_mtx;
+};
+
+#endif
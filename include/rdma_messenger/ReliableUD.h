@@ -0,0 +1,237 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RELIABLEUD_H
+#define RELIABLEUD_H
+
+#include <stdint.h>
+
+#include <vector>
+#include <mutex>
+#include <queue>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Callback.h"
+#include "rdma_messenger/ThreadWrapper.h"
+#include "rdma_messenger/RDMAConnection.h"
+#include "rdma_messenger/UDEndpoint.h"
+
+enum rud_msg_type {
+	RUD_DATA = 1,
+	RUD_ACK,
+	// the sender closed the channel, only type and channel are set
+	RUD_RESET,
+};
+
+struct rud_header {
+	uint8_t type;
+	// free reorder slots of the sender of this header
+	uint8_t window;
+	uint16_t reserved;
+	uint32_t channel;
+	uint32_t seq;
+	// cumulative ack: next expected seq
+	uint32_t ack;
+	// bit i set: seq (ack + 1 + i) already received
+	uint64_t sack;
+} __attribute__((packed));
+
+struct RUDSegment {
+	RUDSegment* next;
+	uint64_t send_ts;
+	uint32_t seq;
+	uint32_t len;
+	uint16_t retries;
+	bool sacked;
+	// rud_header followed by the payload
+	char buf[RUD_SEGMENT_SIZE];
+};
+
+// Logical reliable connection over a shared UD QP.
+// Only the sequence/window state lives here, segments are borrowed from the
+// ReliableUD pool while they are in flight or waiting for reordering.
+class RUDConnection : public std::enable_shared_from_this<RUDConnection> {
+	public:
+	RUDConnection(UDPeer* peer, uint32_t channel) : peer(peer), channel(channel)
+	{}
+
+	UDPeer* peer;
+	uint32_t channel;
+	connection_state state = ACTIVE;
+	std::mutex con_mtx;
+
+	// sender
+	uint32_t next_seq = 0;
+	uint32_t una = 0;
+	uint32_t cwnd = RUD_INIT_CWND;
+	uint32_t cwnd_acc = 0;
+	uint32_t ssthresh = RUD_INIT_SSTHRESH;
+	uint32_t rto_us = RUD_MIN_RTO_US;
+	uint32_t srtt_us = 0;
+	uint32_t rttvar_us = 0;
+	uint16_t inflight_nums = 0;
+	uint8_t peer_window = RUD_WINDOW_MAX;
+	uint8_t dup_acks = 0;
+	RUDSegment* inflight_head = nullptr;
+	RUDSegment* inflight_tail = nullptr;
+	RUDSegment* pending_head = nullptr;
+	RUDSegment* pending_tail = nullptr;
+	// deadline of the one timer entry that counts, 0 when none is armed
+	uint64_t timer_deadline_us = 0;
+
+	// receiver
+	uint32_t expected_seq = 0;
+	uint16_t ack_pending = 0;
+	uint16_t ooo_nums = 0;
+	uint64_t sack = 0;
+	RUDSegment* ooo_head = nullptr;
+
+	// statistics
+	uint64_t retransmits = 0;
+};
+
+struct RUDKey {
+	UDPeer* peer;
+	uint32_t channel;
+
+	bool operator==(const RUDKey& other) const
+	{
+		return peer == other.peer && channel == other.channel;
+	}
+};
+
+struct RUDKeyHash {
+	size_t operator()(const RUDKey& key) const
+	{
+		return std::hash<UDPeer*>()(key.peer) * 31 + std::hash<uint32_t>()(key.channel);
+	}
+};
+
+// Timer heap entry. Entries whose deadline no longer matches the
+// connection's, or whose connection is gone, are dropped when they expire.
+struct RUDTimer {
+	uint64_t deadline_us;
+	std::weak_ptr<RUDConnection> con;
+
+	bool operator>(const RUDTimer& other) const
+	{
+		return deadline_us > other.deadline_us;
+	}
+};
+
+class ReliableUD;
+
+class RUDTimerThread : public ThreadWrapper {
+	public:
+	RUDTimerThread(ReliableUD* rud) : rud(rud)
+	{}
+	virtual ~RUDTimerThread()
+	{}
+
+	virtual void entry() override;
+	virtual void abort() override
+	{}
+
+	private:
+	ReliableUD* rud;
+};
+
+// Sequencing, selective ACKs, retransmission and AIMD windowing on top of
+// UDEndpoint. Install it as the read callback of the UD endpoints, the
+// application read callback then gets (RUDConnection*, Chunk*) in order.
+// Channels are allocated by the active side, one UDPeer carries many channels.
+class ReliableUD : public Callback {
+	public:
+	ReliableUD();
+	virtual ~ReliableUD();
+
+	RUDConnection* attach(UDPeer* peer);
+	// cancel the channel's timers, drop what it still has queued, in flight
+	// or out of order, reset it on the peer and free it once no receive
+	// path uses it any more; con must not be used afterwards. Late segments
+	// of the channel are answered with another reset, not a new channel.
+	// A channel the peer reset stays CLOSE until it is closed here too.
+	void close(RUDConnection* con);
+	// every channel to peer, the peer's closed channels are forgotten
+	void close(UDPeer* peer);
+	void async_send(RUDConnection* con, const char* raw_msg, uint32_t raw_msg_size);
+	uint32_t max_msg_size(RUDConnection* con) const;
+
+	// from UDEndpoint: param is the UDPeer, msg the received Chunk
+	virtual void callback_entry(void* param, void* msg = nullptr) override;
+
+	// retransmissions and delayed acks whose deadline passed
+	void timer_tick();
+	bool is_stopped() const;
+
+	void set_read_callback(Callback* read_callback);
+
+	size_t get_connection_nums();
+	size_t get_segment_nums();
+	uint64_t get_retransmits();
+
+	private:
+	// nullptr for a closed channel, create or not
+	std::shared_ptr<RUDConnection> lookup(UDPeer* peer, uint32_t channel, bool create);
+	void reset(UDPeer* peer, uint32_t channel);
+	void send_reset(UDPeer* peer, uint32_t channel);
+	// con_mtx held: make sure the connection's timer fires by deadline_us
+	void arm_timer(RUDConnection* con, uint64_t deadline_us);
+	// con_mtx held: retransmit what timed out, send a delayed ack, rearm
+	void expire(RUDConnection* con, uint64_t now);
+	void shut(RUDConnection* con);
+
+	void handle_ack(RUDConnection* con, const rud_header* hdr);
+	void handle_data(RUDConnection* con, const rud_header* hdr, const char* payload, uint32_t len,
+			std::vector<RUDSegment*>& deliver, bool& deliver_self);
+
+	void flush(RUDConnection* con);
+	void transmit(RUDConnection* con, RUDSegment* seg);
+	void send_ack(RUDConnection* con);
+	void fill_header(RUDConnection* con, rud_header* hdr, uint8_t type, uint32_t seq);
+	void update_rtt(RUDConnection* con, uint64_t sample_us);
+	void fail(RUDConnection* con);
+
+	RUDSegment* alloc_segment();
+	void free_segment(RUDSegment* seg);
+
+	private:
+	Callback* read_callback = nullptr;
+	std::atomic<bool> stop;
+	RUDTimerThread* timer_thread = nullptr;
+
+	uint32_t channel_number = 0;
+	std::unordered_map<RUDKey, std::shared_ptr<RUDConnection>, RUDKeyHash> connections;
+	// channels closed here, until their peer is closed
+	std::unordered_set<RUDKey, RUDKeyHash> closed;
+	std::mutex con_map_mtx;
+
+	// earliest deadline first, a tick only touches connections that are due
+	std::priority_queue<RUDTimer, std::vector<RUDTimer>, std::greater<RUDTimer>> timers;
+	std::mutex timer_mtx;
+
+	std::vector<RUDSegment*> free_segments;
+	size_t segment_nums = 0;
+	std::mutex seg_mtx;
+};
+
+#endif
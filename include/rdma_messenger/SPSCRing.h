@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <atomic>
+#include <memory>
+
+// Bounded single-producer single-consumer ring. Producer and consumer
+// indices are padded onto their own cache lines and each side caches the
+// other's index, so a steady stream costs no shared writes beyond the slots.
+template <typename T>
+class SPSCRing {
+	public:
+	SPSCRing(uint32_t capacity) : mask(capacity - 1), slots(new T[capacity])
+	{
+		assert((capacity & mask) == 0);
+	}
+
+	// producer only, false when full
+	bool push(const T& value)
+	{
+		uint64_t pos = tail.load(std::memory_order_relaxed);
+		if (pos - cached_head > mask) {
+			cached_head = head.load(std::memory_order_acquire);
+			if (pos - cached_head > mask)
+				return false;
+		}
+		slots[pos & mask] = value;
+		tail.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer only, false when empty
+	bool pop(T* value)
+	{
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		if (pos == cached_tail) {
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (pos == cached_tail)
+				return false;
+		}
+		*value = slots[pos & mask];
+		head.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	private:
+	const uint64_t mask;
+	std::unique_ptr<T[]> slots;
+	char pad0[48];
+	// consumer side
+	std::atomic<uint64_t> head{0};
+	uint64_t cached_tail = 0;
+	char pad1[48];
+	// producer side
+	std::atomic<uint64_t> tail{0};
+	uint64_t cached_head = 0;
+	char pad2[48];
+};
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <atomic>
+#include <memory>
+
+#include <rdma/rdma_cma.h>
+
+// Bounded lock-free multi-producer multi-consumer ring of indices, used as
+// the free list of send chunks and atomic operations: application threads
+// take, the CQ thread gives back. Capacity is a power of two.
+class IndexRing {
+	public:
+	IndexRing(uint32_t capacity) : mask(capacity - 1), cells(new ring_cell[capacity])
+	{
+		assert((capacity & mask) == 0);
+		for (uint32_t i = 0; i < capacity; ++i) {
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool push(uint32_t value)
+	{
+		uint64_t pos = tail.load(std::memory_order_relaxed);
+		ring_cell* cell = nullptr;
+		while (true) {
+			cell = &cells[pos & mask];
+			uint64_t seq = cell->seq.load(std::memory_order_acquire);
+			int64_t diff = static_cast<int64_t>(seq - pos);
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = value;
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(uint32_t* value)
+	{
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		ring_cell* cell = nullptr;
+		while (true) {
+			cell = &cells[pos & mask];
+			uint64_t seq = cell->seq.load(std::memory_order_acquire);
+			int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		*value = cell->value;
+		cell->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	private:
+	struct ring_cell {
+		std::atomic<uint64_t> seq;
+		uint32_t value;
+	};
+
+	uint64_t mask;
+	std::unique_ptr<ring_cell[]> cells;
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+};
+
+// A work request prepared by the submitting thread, one per send chunk
+// and per atomic operation of a connection.
+struct send_request {
+	send_request* next = nullptr;
+	struct ibv_send_wr wr = {};
+	struct ibv_sge sge = {};
+};
+
+// Multi-producer single-consumer submission queue of a QP. Producers push
+// with one CAS; whoever finds the queue unclaimed becomes the poster and
+// drains it with chained ibv_post_send calls until it stays empty, so only
+// one thread at a time is inside the provider for this QP.
+class SendQueue {
+	public:
+	void push(send_request* req)
+	{
+		send_request* top = head.load(std::memory_order_relaxed);
+		do {
+			req->next = top;
+		} while (!head.compare_exchange_weak(top, req));
+	}
+
+	bool empty() const
+	{
+		return head.load() == nullptr;
+	}
+
+	// true when the caller became the poster and has to call release()
+	bool claim()
+	{
+		return !posting.exchange(true);
+	}
+
+	void release()
+	{
+		posting.store(false);
+	}
+
+	// everything queued so far, oldest first
+	send_request* take_all()
+	{
+		send_request* reqs = head.exchange(nullptr, std::memory_order_acquire);
+		send_request* fifo = nullptr;
+		while (reqs) {
+			send_request* next = reqs->next;
+			reqs->next = fifo;
+			fifo = reqs;
+			reqs = next;
+		}
+		return fifo;
+	}
+
+	private:
+	std::atomic<send_request*> head{nullptr};
+	std::atomic<bool> posting{false};
+};
+
+#endif
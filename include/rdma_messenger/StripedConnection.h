@@ -0,0 +1,150 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STRIPEDCONNECTION_H
+#define STRIPEDCONNECTION_H
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Callback.h"
+#include "rdma_messenger/RDMAConnection.h"
+
+enum stripe_policy {
+	STRIPE_ROUND_ROBIN = 1,
+	STRIPE_FLOW_HASH,
+};
+
+// rdma_connect private data of every lane
+struct stripe_private_data {
+	uint32_t magic;
+	uint16_t lane;
+	uint16_t lanes;
+	uint64_t group_id;
+} __attribute__((packed));
+
+#define STRIPE_ORDERED 0x1U
+
+// prepended to every message sent on a lane
+struct stripe_header {
+	uint64_t flow_key;
+	uint32_t seq;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct stripe_flow {
+	std::mutex flow_mtx;
+	uint32_t expected_seq = 0;
+	// out of order messages waiting for expected_seq
+	std::map<uint32_t, std::string> parked;
+};
+
+// One logical connection made of several RC QPs to the same peer.
+// Messages are spread round-robin or by flow key hash; a flow sent
+// round-robin with ordering enabled is reordered on the receiving side.
+class RDMAStripedConnection : public Callback {
+	public:
+	RDMAStripedConnection(uint64_t group_id, uint32_t lane_nums);
+	virtual ~RDMAStripedConnection();
+
+	void add_lane(RDMAConnection* con, uint32_t lane);
+	bool is_complete();
+	stripe_private_data private_data(uint32_t lane) const;
+
+	void async_send(const char* raw_msg, uint32_t raw_msg_size, uint64_t flow_key = 0);
+
+	// from a lane: param is the RDMAConnection, msg the received Chunk
+	virtual void callback_entry(void* param, void* msg = nullptr) override;
+
+	void set_policy(stripe_policy policy);
+	void set_ordered(bool ordered);
+	void set_read_callback(Callback* read_callback);
+
+	uint64_t get_group_id() const;
+	uint32_t get_lane_nums() const;
+	RDMAConnection* get_lane(uint32_t lane) const;
+
+	public:
+	Callback* read_callback = nullptr;
+
+	private:
+	uint32_t pick_lane(uint64_t flow_key);
+	uint32_t next_seq(uint64_t flow_key);
+	stripe_flow* get_flow(uint64_t flow_key);
+	void deliver(const char* buf, uint32_t len);
+
+	private:
+	uint64_t group_id;
+	uint32_t lane_nums;
+	std::vector<RDMAConnection*> lanes;
+	std::atomic<uint32_t> ready_lanes;
+	stripe_policy policy = STRIPE_ROUND_ROBIN;
+	bool ordered = true;
+	std::atomic<uint64_t> rr_counter;
+
+	std::unordered_map<uint64_t, uint32_t> send_seqs;
+	std::mutex send_mtx;
+
+	std::unordered_map<uint64_t, std::unique_ptr<stripe_flow>> recv_flows;
+	std::mutex recv_mtx;
+};
+
+uint64_t stripe_group_id();
+
+// client side: hands the lanes of one striped connect to their group
+class StripeLaneCallback : public Callback {
+	public:
+	StripeLaneCallback(RDMAStripedConnection* group) : group(group)
+	{}
+
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		group->add_lane(static_cast<RDMAConnection*>(param), lane++);
+	}
+
+	private:
+	RDMAStripedConnection* group;
+	uint32_t lane = 0;
+};
+
+// server side accept callback: groups lanes by the group id of their private
+// data and calls striped_callback once all lanes of a group are accepted.
+// Connections without stripe private data go to plain_callback unchanged.
+class StripedAcceptCallback : public Callback {
+	public:
+	StripedAcceptCallback(Callback* striped_callback, Callback* plain_callback = nullptr) :
+		striped_callback(striped_callback), plain_callback(plain_callback)
+	{}
+
+	virtual void callback_entry(void* param, void* msg = nullptr) override;
+
+	private:
+	Callback* striped_callback;
+	Callback* plain_callback;
+	std::unordered_map<uint64_t, RDMAStripedConnection*> pending_groups;
+	std::mutex group_mtx;
+};
+
+#endif
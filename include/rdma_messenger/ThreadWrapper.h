@@ -18,6 +18,9 @@
 #ifndef THREADWRAPPER_H
 #define THREADWRAPPER_H
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -45,6 +48,7 @@ class ThreadWrapper {
 	void start(bool background_thread = false) {
 		thread = std::thread(&ThreadWrapper::thread_body, this);
 		t_handler = thread.native_handle();
+		started = true;
 		if (background_thread) {
 			thread.detach();
 		}
@@ -60,6 +64,15 @@ class ThreadWrapper {
 		}
 	}
 
+	// CPU time the thread consumed so far, 0 when it never started
+	uint64_t cpu_time_ns() {
+		clockid_t cid;
+		struct timespec ts;
+		if (!started || pthread_getcpuclockid(t_handler, &cid) || clock_gettime(cid, &ts))
+			return 0;
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
 	void thread_body() {
 		try {
 			entry();
@@ -90,6 +103,7 @@ class ThreadWrapper {
 
 	private:
 	bool done = false;
+	bool started = false;
 	std::thread thread;
 	pthread_t t_handler;
 	std::mutex join_mutex;
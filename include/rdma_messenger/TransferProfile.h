@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRANSFERPROFILE_H
+#define TRANSFERPROFILE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+enum transfer_strategy {
+	TRANSFER_INLINE = 1,
+	TRANSFER_COPY,
+	TRANSFER_ZERO_COPY,
+	TRANSFER_WRITE_IMM,
+	TRANSFER_READ_RENDEZVOUS,
+};
+
+const char* transfer_strategy_name(transfer_strategy strategy);
+bool transfer_strategy_parse(const std::string& name, transfer_strategy* strategy);
+
+// messages up to max_size bytes (and above the previous range) use strategy
+struct transfer_range {
+	uint32_t max_size;
+	transfer_strategy strategy;
+};
+
+// Size ranges per transfer strategy, measured by rdma_calibrate on the
+// local device and loaded by RDMAStack at startup. One line per range:
+//   <strategy> <max_size>
+// ordered by size, plus an optional "device <name>" line.
+class TransferProfile {
+	public:
+	TransferProfile();
+
+	bool load(const std::string& path);
+	bool save(const std::string& path) const;
+
+	transfer_strategy choose(uint32_t size) const;
+
+	void set_ranges(const std::vector<transfer_range>& ranges);
+	const std::vector<transfer_range>& get_ranges() const;
+
+	public:
+	std::string device;
+
+	private:
+	std::vector<transfer_range> ranges;
+};
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UDENDPOINT_H
+#define UDENDPOINT_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <rdma/rdma_cma.h>
+
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Callback.h"
+#include "rdma_messenger/Chunk.h"
+
+class UDEndpoint;
+
+// One remote UD QP reachable through an address handle of the local endpoint.
+class UDPeer {
+	public:
+	UDPeer(UDEndpoint* endpoint, struct ibv_ah* ah, uint32_t qp_num, uint32_t qkey, uint64_t peer_id) :
+		endpoint(endpoint), ah(ah), qp_num(qp_num), qkey(qkey), peer_id(peer_id)
+	{}
+
+	UDEndpoint* endpoint;
+	struct ibv_ah* ah;
+	uint32_t qp_num;
+	uint32_t qkey;
+	uint64_t peer_id;
+};
+
+struct UDPeerKey {
+	uint64_t gid_prefix;
+	uint64_t gid_guid;
+	uint32_t qp_num;
+	uint16_t lid;
+
+	bool operator==(const UDPeerKey& other) const
+	{
+		return gid_prefix == other.gid_prefix && gid_guid == other.gid_guid &&
+			qp_num == other.qp_num && lid == other.lid;
+	}
+};
+
+struct UDPeerKeyHash {
+	size_t operator()(const UDPeerKey& key) const
+	{
+		size_t h = std::hash<uint64_t>()(key.gid_prefix);
+		h = h * 31 + std::hash<uint64_t>()(key.gid_guid);
+		h = h * 31 + std::hash<uint32_t>()(key.qp_num);
+		return h * 31 + std::hash<uint16_t>()(key.lid);
+	}
+};
+
+// A single UD QP shared by every peer of one CQ worker.
+// Messages are limited to the path MTU, receive buffers reserve UD_GRH_SIZE
+// bytes in front of the payload for the GRH written by the RNIC.
+class UDEndpoint {
+	public:
+	UDEndpoint(struct ibv_context* verbs, uint8_t port_num, struct ibv_cq* cq, uint64_t endpoint_id);
+
+	~UDEndpoint();
+
+	// false when every send chunk is in flight, UD callers treat it as a drop
+	bool async_send(UDPeer* peer, const char* raw_msg, uint32_t raw_msg_size);
+
+	// post & recv rdma buffer
+	void post_recv_buffer(Chunk* chk);
+	void post_recv_buffers();
+
+	// address handle management
+	UDPeer* add_peer(struct ibv_ah_attr* ah_attr, uint32_t qp_num, uint32_t qkey);
+	UDPeer* learn_peer(struct ibv_wc* wc, Chunk* chk);
+
+	void handle_recv(struct ibv_wc* wc);
+	void handle_send(struct ibv_wc* wc);
+
+	struct ibv_qp* get_qp() const;
+	struct ibv_cq* get_cq() const;
+	uint32_t get_mtu() const;
+	uint64_t get_endpoint_id() const;
+	size_t get_peer_nums();
+
+	void set_read_callback(Callback* read_callback);
+
+	public:
+	Callback* read_callback = nullptr;
+
+	private:
+	void query_mtu();
+	void create_qp();
+	void register_mr();
+	void construct_chunks();
+
+	void get_chunk(Chunk** chk);
+	void reap_chunk(Chunk** chk);
+
+	UDPeer* insert_peer(const UDPeerKey& key, struct ibv_ah* ah, uint32_t qp_num, uint32_t qkey);
+
+	private:
+	struct ibv_context* verbs;
+	uint8_t port_num;
+	struct ibv_cq* cq;
+	uint64_t endpoint_id;
+	struct ibv_pd* pd = nullptr;
+	struct ibv_qp* qp = nullptr;
+	uint32_t mtu = 0;
+
+	uint32_t recv_buf_len = 0;
+	uint32_t send_buf_len = 0;
+	char* recv_buf = nullptr;
+	char* send_buf = nullptr;
+	struct ibv_mr* recv_mr = nullptr;
+	struct ibv_mr* send_mr = nullptr;
+	std::vector<Chunk*> recv_chunks;
+	std::vector<Chunk*> send_chunks;
+
+	std::vector<Chunk*> free_chunks;
+	std::mutex chk_mtx;
+
+	uint64_t peer_number = 0;
+	std::unordered_map<UDPeerKey, UDPeer*, UDPeerKeyHash> peers;
+	std::mutex peer_mtx;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKERPLACEMENT_H
+#define WORKERPLACEMENT_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <rdma/rdma_cma.h>
+
+#include "rdma_messenger/rdma_config.h"
+
+// Completions and payload bytes of a CQ worker or a connection. Counters
+// are bumped by the CQ thread, rates are refreshed by sample() from the
+// placement and balancing paths.
+class LoadStats {
+	public:
+	void add_completion(uint64_t bytes)
+	{
+		completions.fetch_add(1, std::memory_order_relaxed);
+		this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	// refresh the smoothed rates, at most every PLACEMENT_SAMPLE_MS
+	void sample(uint64_t now_ns);
+	// completions per second plus bytes per second in PLACEMENT_BYTES_PER_COMPLETION units
+	double score() const;
+
+	public:
+	std::atomic<uint64_t> completions{0};
+	std::atomic<uint64_t> bytes{0};
+	double completion_rate = 0;
+	double byte_rate = 0;
+
+	private:
+	uint64_t last_completions = 0;
+	uint64_t last_bytes = 0;
+	uint64_t last_sample_ns = 0;
+};
+
+class WorkerLoad : public LoadStats {
+	public:
+	WorkerLoad(uint32_t worker_id) : worker_id(worker_id)
+	{}
+
+	public:
+	const uint32_t worker_id;
+	std::atomic<uint64_t> connections{0};
+};
+
+// Picks the CQ worker of a new connection. Called with the loads of all
+// workers of the device, freshly sampled, under the connection manager lock.
+class PlacementPolicy {
+	public:
+	virtual ~PlacementPolicy()
+	{}
+	virtual uint32_t place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id) = 0;
+	virtual const char* name() const = 0;
+};
+
+class RoundRobinPlacement : public PlacementPolicy {
+	public:
+	virtual uint32_t place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id) override;
+	virtual const char* name() const override
+	{
+		return "round_robin";
+	}
+
+	private:
+	uint64_t next = 0;
+};
+
+// lowest score, near-ties broken by the connection count so an idle
+// system still spreads connections evenly
+class LeastLoadedPlacement : public PlacementPolicy {
+	public:
+	virtual uint32_t place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id) override;
+	virtual const char* name() const override
+	{
+		return "least_loaded";
+	}
+};
+
+// every connection of one peer address lands on the same worker
+class PeerHashPlacement : public PlacementPolicy {
+	public:
+	virtual uint32_t place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id) override;
+	virtual const char* name() const override
+	{
+		return "peer_hash";
+	}
+};
+
+// "round_robin", "least_loaded" or "peer_hash", nullptr otherwise
+PlacementPolicy* create_placement_policy(const std::string& name);
+
+#endif
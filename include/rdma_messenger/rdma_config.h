@@ -30,10 +30,62 @@
 #define CQE_PER_CQ 4096
 
 #define IO_WORKER_NUMS 20
+// pending connect requests rdma_listen queues
+#define LISTEN_BACKLOG 1024
 
 #define SUPPORT_SRQ 1
 #define SRQ_WQE ((RECV_WQE_PER_QP) * 64)
 
+#define UD_GRH_SIZE 40U
+#define UD_RECV_WQE_PER_QP 4096U
+#define UD_SEND_WQE_PER_QP 1024U
+
+#define RUD_SEGMENT_SIZE 4096U
+#define RUD_WINDOW_MAX 64U
+#define RUD_INIT_CWND 4U
+#define RUD_INIT_SSTHRESH 32U
+#define RUD_ACK_EVERY 8U
+#define RUD_DUP_ACK_THRESH 3U
+#define RUD_MAX_RETRIES 16U
+#define RUD_TICK_US 500U
+#define RUD_MIN_RTO_US 1000U
+#define RUD_MAX_RTO_US 1000000U
+
+#define STRIPE_MAGIC 0x53545250U
+#define STRIPE_LANES_MAX 16U
+
+#define ATOMIC_WQE_PER_QP 16U
+#define RD_ATOMIC_DEPTH_MAX 16U
+
+#define INLINE_DATA_MAX 256U
+#define TRANSFER_INLINE_DEFAULT 64U
+#define TRANSFER_PROFILE_PATH "rdma_transfer.profile"
+
+#define PLACEMENT_SAMPLE_MS 10U
+#define PLACEMENT_BYTES_PER_COMPLETION 4096U
+#define PLACEMENT_TIE_PERCENT 5U
+
+#define CQ_EPOLL_EVENTS 64
+#define REACTOR_EPOLL_EVENTS 64
+// thread-per-core mode: receive chunks of a core's SRQ and depth of each cross-core ring
+#define SHARD_RECV_WQE ((RECV_WQE_PER_QP) * 4)
+// a sharded receiver takes messages up to this size, not SGE_MSG_SIZE
+#define SHARD_RECV_CHUNK_SIZE (64 * 1024U)
+#define SHARD_RING_SIZE 1024U
+// own CQ of a connection: sends, atomics and posted receives
+#define CONNECTION_CQE ((SEND_WQE_PER_QP + ATOMIC_WQE_PER_QP + RECV_WQE_PER_QP) * 2)
+#define REBALANCE_INTERVAL_MS 1000U
+// callbacks a strand runs before yielding its executor thread
+#define EXECUTOR_STRAND_BATCH 32U
+// longest CQ worker sleep while retired connections wait for their strand
+#define RECLAIM_RETRY_MS 10
+// busiest worker below this score is left alone
+#define REBALANCE_MIN_SCORE 1000U
+
+// connection slots: REGISTRY_PAGES pages of REGISTRY_PAGE_SLOTS, 24 bits of wr_id
+#define REGISTRY_PAGE_SLOTS 4096U
+#define REGISTRY_PAGES 4096U
+
 #define FIN_WRID 0XCAFEBEEF
 #define BEACON_WRID 0XDEADBEEF
 
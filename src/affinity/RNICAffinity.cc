@@ -15,6 +15,9 @@
  * limitations under the License.
  */
 
+#include <set>
+#include <sstream>
+
 #include "rdma_messenger/RNICAffinity.h"
 
 RNICAffinity::RNICAffinity(const char* addr): rnic_addr(addr)
@@ -50,6 +53,79 @@ RNICAffinity::RNICAffinity(const char* addr): rnic_addr(addr)
 	return;
 }
 
+RNICAffinity::RNICAffinity(struct ibv_context* verbs)
+{
+	if (!verbs)
+		return;
+	rnic_ib_name = ibv_get_device_name(verbs->device);
+	if (numa_available() == -1)
+		return;
+	query_rnic_numa_node();
+	query_rnic_cpumask();
+}
+
+std::vector<int> RNICAffinity::get_local_cpus() const
+{
+	std::vector<int> cpus;
+	const size_t bits = 8 * sizeof(unsigned long long);
+	for (size_t i = 0; i < sizeof(cpu_mask) / sizeof(cpu_mask[0]) * bits; i++) {
+		if (cpu_mask[i / bits] & (1ULL << (i % bits)))
+			cpus.push_back(i);
+	}
+	return cpus;
+}
+
+std::vector<int> RNICAffinity::parse_cpu_list(const std::string& list)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (item.empty())
+			continue;
+		size_t dash = item.find('-');
+		int first = atoi(item.c_str());
+		int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+		for (int cpu = first; cpu <= last; ++cpu) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+static std::vector<int> thread_siblings(int cpu)
+{
+	std::ifstream siblings_file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+	std::string list;
+	if (siblings_file && std::getline(siblings_file, list)) {
+		std::vector<int> siblings = RNICAffinity::parse_cpu_list(list);
+		if (!siblings.empty())
+			return siblings;
+	}
+	return std::vector<int>(1, cpu);
+}
+
+std::vector<int> RNICAffinity::exclude_ht_siblings(const std::vector<int>& cpus, const std::vector<int>& app_cpus)
+{
+	std::set<int> busy;
+	for (int cpu : app_cpus) {
+		for (int sibling : thread_siblings(cpu)) {
+			busy.insert(sibling);
+		}
+	}
+
+	std::vector<int> picked;
+	for (int cpu : cpus) {
+		if (busy.count(cpu))
+			continue;
+		picked.push_back(cpu);
+		for (int sibling : thread_siblings(cpu)) {
+			busy.insert(sibling);
+		}
+	}
+	return picked;
+}
+
 void RNICAffinity::query_rnic_eth_name()
 {
 	ifaddrs* ifa = nullptr;
@@ -84,27 +160,31 @@ void RNICAffinity::query_rnic_numa_node()
 	if (numa_available() == -1) {
 		return;
 	}
-	std::ifstream numa_file(eth_path + rnic_eth_name + "/device/numa_node");
-	if(numa_file) {
-		numa_file >> bind_numa;
-		numa_file.close();
+	// the IB device and its netdev sit on the same PCI function
+	std::string dev_path = rnic_ib_name.empty() ? eth_path + rnic_eth_name : ib_path + rnic_ib_name;
+	std::ifstream numa_file(dev_path + "/device/numa_node");
+	if (numa_file) {
+		// -1 when the platform does not tell
+		int node = -1;
+		numa_file >> node;
+		bind_numa = node < 0 ? -1U : node;
 	}
 }
 
 void RNICAffinity::query_rnic_cpumask()
 {
-	if (numa_available() == -1 || bind_numa == -1) {
+	if (numa_available() == -1 || bind_numa == -1U) {
 		return;
 	}
 	struct bitmask* mask = numa_allocate_cpumask();
 	int rst = numa_node_to_cpus(bind_numa, mask);
 	if (rst < 0)
 		goto clean;
-	for (size_t i = 0; i < mask->size; i++) {
+	for (size_t i = 0; i < mask->size && i < sizeof(cpu_mask) * 8; i++) {
 		if (numa_bitmask_isbitset(mask, i)) {
 			cpu_mask[i / (8 * sizeof(unsigned long long))] =
 				cpu_mask[i / (8 * sizeof(unsigned long long))] | \
-				(1 << (i % (8 * sizeof(unsigned long long))));
+				(1ULL << (i % (8 * sizeof(unsigned long long))));
 		}
 	}
 clean:
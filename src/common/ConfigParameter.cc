@@ -15,8 +15,14 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
+#include <algorithm>
+
 #include "common/ConfigParameter.h"
 
+ConfigParameter* ConfigParameter::configobj = nullptr;
+
 ConfigParameter::ConfigParameter(const int parameter_count, const char** parameter_vec) :
 	qp_config(this, QPCONFIG), rq_config(this, RQCONFIG), sq_config(this, SQCONFIG),
 	wqe_config(this, WQECONFIG), sge_config(this, SGECONFIG)
@@ -28,9 +34,10 @@ ConfigParameter::ConfigParameter(const int parameter_count, const char** paramet
 		orig_parameters.push_back(a);
 	}
 
-	for (auto& a : parameters) {
-		if (strcmp("-c", a) == 0 || strcmp("--conf", a) == 0) {
-			yaml_config_file = std::next(a);
+	// the file name is the argument following the option
+	for (size_t i = 0; i + 1 < parameters.size(); ++i) {
+		if (strcmp("-c", parameters[i]) == 0 || strcmp("--conf", parameters[i]) == 0) {
+			yaml_config_file = parameters[i + 1];
 			break;
 		}
 	}
@@ -169,6 +176,10 @@ void ConfigParameter::ConfigParse()
 
 	const YAML::Node& yaml_test_config = yaml_config["test"];
 	ParseTest(yaml_test_config);
+
+	const YAML::Node& yaml_worker_config = yaml_config["worker"];
+	if (yaml_worker_config)
+		ParseWorker(yaml_worker_config);
 }
 
 void ConfigParameter::add_registers() {
@@ -182,6 +193,7 @@ void ConfigParameter::add_registers() {
 void ConfigParameter::ParseQP(const YAML::Node& yaml_qp_config) {
 	std::string qp_transport_mode = yaml_qp_config["qp_transport_mode"].as<std::string>();
 	configs.qp_config.qp_transport_mode = strcmp(qp_transport_mode.c_str(), "RC") == 0 ? IBV_QPT_RC :
+										strcmp(qp_transport_mode.c_str(), "UD") == 0 ? IBV_QPT_UD :
 										static_cast<ibv_qp_type>(static_cast<int>(IBV_QPT_DRIVER) + 1);
 	configs.qp_config.qp_create_method = strcmp(yaml_qp_config["qp_create_method"].as<std::string>().c_str(), "verbs") == 0 ? VERBS_QP :
 										 strcmp(yaml_qp_config["qp_create_method"].as<std::string>().c_str(), "rdma_cm") ? RDMACM_QP : UNKNOWN_CREATE_QP_METHOD;
@@ -228,6 +240,10 @@ void ConfigParameter::ParseServer(const YAML::Node& yaml_server_config) {
 	strncpy(configs.server_config.server_ip_addr, yaml_server_config["server_ip_addr"].as<std::string>().c_str(), sizeof(configs.server_config.server_ip_addr));
 	configs.server_config.server_cm_port = yaml_server_config["server_cm_port"].as<uint32_t>();
 	configs.server_config.server_threads = yaml_server_config["server_threads"].as<uint32_t>();
+	if (yaml_server_config["listen_backlog"])
+		configs.server_config.listen_backlog = yaml_server_config["listen_backlog"].as<int>();
+	if (yaml_server_config["qp_pool_size"])
+		configs.server_config.qp_pool_size = yaml_server_config["qp_pool_size"].as<uint32_t>();
 }
 
 void ConfigParameter::ParseClient(const YAML::Node& yaml_client_config) {
@@ -239,3 +255,20 @@ void ConfigParameter::ParseClient(const YAML::Node& yaml_client_config) {
 void ConfigParameter::ParseTest(const YAML::Node& yaml_test_config) {
 	configs.test_config.time_duration = yaml_test_config["time_duration"].as<uint64_t>();
 }
+
+void ConfigParameter::ParseWorker(const YAML::Node& yaml_worker_config) {
+	if (yaml_worker_config["cq_workers"])
+		configs.worker_config.cq_workers = yaml_worker_config["cq_workers"].as<uint32_t>();
+	if (yaml_worker_config["worker_cpus"])
+		strncpy(configs.worker_config.worker_cpus, yaml_worker_config["worker_cpus"].as<std::string>().c_str(), sizeof(configs.worker_config.worker_cpus) - 1);
+	if (yaml_worker_config["app_cpus"])
+		strncpy(configs.worker_config.app_cpus, yaml_worker_config["app_cpus"].as<std::string>().c_str(), sizeof(configs.worker_config.app_cpus) - 1);
+	if (yaml_worker_config["placement"])
+		strncpy(configs.worker_config.placement, yaml_worker_config["placement"].as<std::string>().c_str(), sizeof(configs.worker_config.placement) - 1);
+	if (yaml_worker_config["rebalance_spread"])
+		configs.worker_config.rebalance_spread = yaml_worker_config["rebalance_spread"].as<uint32_t>();
+	if (yaml_worker_config["thread_per_core"])
+		configs.worker_config.thread_per_core = yaml_worker_config["thread_per_core"].as<bool>();
+	if (yaml_worker_config["executor_threads"])
+		configs.worker_config.executor_threads = yaml_worker_config["executor_threads"].as<uint32_t>();
+}
@@ -27,20 +27,79 @@ void AcceptThread::abort() {
 	exit(1);
 }
 
+void AcceptShard::push(accept_request* request) {
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		requests.push_back(request);
+	}
+	cond.notify_one();
+}
+
+void AcceptShard::stop() {
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		stopped = true;
+	}
+	cond.notify_one();
+}
+
+void AcceptShard::entry() {
+	std::unique_lock<std::mutex> l(mtx);
+	while (true) {
+		while (requests.empty() && !stopped) {
+			cond.wait(l);
+		}
+		if (requests.empty())
+			return;
+		accept_request* request = requests.front();
+		requests.pop_front();
+		l.unlock();
+		rdma_stack->accept_dispatched(request);
+		l.lock();
+	}
+}
+
+void AcceptShard::abort() {
+	perror("accept shard error.");
+	exit(1);
+}
+
 Acceptor::~Acceptor() {
 	delete accept_thread;
 	accept_thread = nullptr;
+	// later connect requests are answered on the CM thread
+	if (dispatch)
+		rdma_stack->set_accept_dispatch(nullptr);
+	for (auto shard : shards) {
+		shard->stop();
+		shard->join();
+		delete shard;
+	}
+	delete dispatch;
 }
 
 void Acceptor::listen() {
 	assert(rdma_stack);
+	if (shard_nums > 1) {
+		for (uint32_t i = 0; i < shard_nums; ++i) {
+			shards.push_back(new AcceptShard(rdma_stack));
+			shards.back()->start();
+		}
+		dispatch = new AcceptDispatch(shards);
+		rdma_stack->set_accept_dispatch(dispatch);
+	}
+	// creates the CM channel the accept thread waits on
+	rdma_stack->listen(server_addr);
+	// the stack's reactor takes CM events without a thread of our own
+	if (rdma_stack->get_reactor())
+		return;
 	accept_thread = new AcceptThread(rdma_stack);
 	accept_thread->start(true);
-	rdma_stack->listen(server_addr);
 }
 
 void Acceptor::join() {
-	accept_thread->join();
+	if (accept_thread)
+		accept_thread->join();
 }
 
 void Acceptor::shutdown() {
@@ -48,6 +107,14 @@ void Acceptor::shutdown() {
 	join();
 }
 
+void Acceptor::set_shards(uint32_t shard_nums) {
+	this->shard_nums = shard_nums;
+}
+
+void Acceptor::set_backlog(int backlog) {
+	rdma_stack->set_listen_backlog(backlog);
+}
+
 void Acceptor::set_network_stack(RDMAStack *rdma_stack) {
 	this->rdma_stack = rdma_stack;
 }
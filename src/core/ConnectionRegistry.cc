@@ -0,0 +1,142 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "rdma_messenger/ConnectionRegistry.h"
+#include "rdma_messenger/RDMAConnection.h"
+
+ConnectionRegistry::ConnectionRegistry()
+{
+	for (uint32_t page = 0; page < REGISTRY_PAGES; ++page) {
+		pages[page].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+ConnectionRegistry::~ConnectionRegistry()
+{
+	drain();
+	for (uint32_t page = 0; page < REGISTRY_PAGES; ++page) {
+		delete[] pages[page].load();
+	}
+}
+
+ConnectionRegistry::registry_slot* ConnectionRegistry::get_slot(uint32_t slot) const
+{
+	if (slot >= REGISTRY_PAGES * REGISTRY_PAGE_SLOTS)
+		return nullptr;
+	registry_slot* page = pages[slot / REGISTRY_PAGE_SLOTS].load(std::memory_order_acquire);
+	if (!page)
+		return nullptr;
+	return page + slot % REGISTRY_PAGE_SLOTS;
+}
+
+void ConnectionRegistry::add(RDMAConnection* con)
+{
+	std::lock_guard<std::mutex> l(slot_mtx);
+	uint32_t slot = 0;
+	if (!free_slots.empty()) {
+		slot = free_slots.back();
+		free_slots.pop_back();
+	} else {
+		slot = slot_nums++;
+		assert(slot < REGISTRY_PAGES * REGISTRY_PAGE_SLOTS);
+		std::atomic<registry_slot*>& page = pages[slot / REGISTRY_PAGE_SLOTS];
+		if (!page.load(std::memory_order_relaxed))
+			page.store(new registry_slot[REGISTRY_PAGE_SLOTS], std::memory_order_release);
+	}
+	registry_slot* s = get_slot(slot);
+	con->set_wr_tag(make_wr_tag(slot, s->generation), slot);
+	s->con.store(con, std::memory_order_release);
+}
+
+void ConnectionRegistry::retire(RDMAConnection* con)
+{
+	{
+		std::lock_guard<std::mutex> l(slot_mtx);
+		registry_slot* s = get_slot(con->get_slot());
+		if (!s || s->con.load(std::memory_order_relaxed) != con)
+			return;
+		s->con.store(nullptr);
+		// a reused slot gets a new tag, completions of the old owner miss it
+		s->generation++;
+		free_slots.push_back(con->get_slot());
+	}
+	std::lock_guard<std::mutex> l(retire_mtx);
+	retired.push_back(std::make_pair(global_epoch.fetch_add(1) + 1, con));
+	retired_nums.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ConnectionRegistry::reclaim()
+{
+	std::vector<RDMAConnection*> expired;
+	{
+		std::unique_lock<std::mutex> l(retire_mtx, std::try_to_lock);
+		if (!l.owns_lock())
+			return;
+		// oldest epoch a CQ thread may still be working in
+		uint64_t safe_epoch = REGISTRY_OFFLINE;
+		for (auto& reader : readers) {
+			safe_epoch = std::min(safe_epoch, reader->epoch.load());
+		}
+		auto it = retired.begin();
+		while (it != retired.end()) {
+			// callbacks still queued on an executor hold on to the connection
+			if (it->first <= safe_epoch && it->second->idle()) {
+				expired.push_back(it->second);
+				it = retired.erase(it);
+			} else {
+				++it;
+			}
+		}
+		retired_nums.store(retired.size(), std::memory_order_relaxed);
+	}
+	for (auto con : expired) {
+		delete con;
+	}
+}
+
+void ConnectionRegistry::drain()
+{
+	std::lock_guard<std::mutex> l(retire_mtx);
+	for (auto& r : retired) {
+		delete r.second;
+	}
+	retired.clear();
+	retired_nums.store(0, std::memory_order_relaxed);
+}
+
+RDMAConnection* ConnectionRegistry::lookup(uint64_t wr_id) const
+{
+	registry_slot* s = get_slot(wr_slot(wr_id));
+	if (!s)
+		return nullptr;
+	RDMAConnection* con = s->con.load();
+	// the slot may already belong to a newer connection
+	if (!con || con->get_wr_tag() != wr_tag(wr_id))
+		return nullptr;
+	return con;
+}
+
+registry_reader* ConnectionRegistry::add_reader()
+{
+	std::lock_guard<std::mutex> l(retire_mtx);
+	readers.emplace_back(new registry_reader());
+	return readers.back().get();
+}
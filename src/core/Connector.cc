@@ -33,13 +33,24 @@ Connector::~Connector() {
 
 void Connector::connect() {
 	assert(rdma_stack);
-	connect_thread = new ConnectThread(rdma_stack);
-	connect_thread->start(true);
-	rdma_stack->connect(connector_addr);
+	// the stack's reactor takes CM events without a thread of our own
+	if (!rdma_stack->get_reactor()) {
+		connect_thread = new ConnectThread(rdma_stack);
+		connect_thread->start(true);
+	}
+	rdma_stack->connect(connector_addr, source_addr);
+}
+
+void Connector::async_connect(Callback* done, const void* private_data, uint8_t private_data_len,
+		connect_timing* timing) {
+	assert(rdma_stack);
+	// the stack's own thread serves every async connect
+	rdma_stack->async_connect(connector_addr, source_addr, done, private_data, private_data_len, timing);
 }
 
 void Connector::join() {
-	connect_thread->join();
+	if (connect_thread)
+		connect_thread->join();
 }
 
 void Connector::shutdown() {
@@ -51,7 +62,29 @@ void Connector::set_network_stack(RDMAStack* rdma_stack) {
 	this->rdma_stack = rdma_stack;
 }
 
+void Connector::set_source_addr(struct sockaddr* src_addr) {
+	this->source_addr = src_addr;
+}
+
 void Connector::set_connect_callback(Callback* connect_callback) {
 	this->connect_callback = connect_callback;
 	rdma_stack->set_connect_callback(this->connect_callback);
 }
+
+void ConnectWaiter::callback_entry(void* param, void* msg) {
+	if (param && connect_callback)
+		connect_callback->callback_entry(param, msg);
+	std::lock_guard<std::mutex> l(mtx);
+	if (!param)
+		failed++;
+	if (--pending == 0)
+		cv.notify_all();
+}
+
+uint32_t ConnectWaiter::wait() {
+	std::unique_lock<std::mutex> l(mtx);
+	while (pending) {
+		cv.wait(l);
+	}
+	return failed;
+}
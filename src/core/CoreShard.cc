@@ -0,0 +1,306 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <malloc.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "rdma_messenger/CoreShard.h"
+#include "rdma_messenger/RDMAStack.h"
+
+static thread_local CoreShard* current_shard = nullptr;
+
+static uint64_t shard_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CoreShard::CoreShard(struct ibv_context* verbs, uint32_t core_id, CQThread* cq_thread) :
+	core_id(core_id), cq_thread(cq_thread)
+{
+	pd = ibv_alloc_pd(verbs);
+	if (!pd) {
+		std::cerr << __func__ << " failed to alloc pd of core " << core_id << std::endl;
+		return;
+	}
+	ibv_srq_init_attr sia = {};
+	sia.attr.max_wr = SHARD_RECV_WQE;
+	sia.attr.max_sge = 1;
+	srq = ibv_create_srq(pd, &sia);
+	if (!srq) {
+		std::cerr << __func__ << " failed to create srq of core " << core_id << std::endl;
+		return;
+	}
+
+	uint64_t recv_buf_len = (uint64_t)SHARD_RECV_WQE * SHARD_RECV_CHUNK_SIZE;
+	recv_buf = static_cast<char*>(memalign(4096, recv_buf_len));
+	if (!recv_buf) {
+		std::cerr << __func__ << " failed to allocate " << recv_buf_len << " bytes of core " << core_id << std::endl;
+		return;
+	}
+	recv_mr = ibv_reg_mr(pd, recv_buf, recv_buf_len, IBV_ACCESS_LOCAL_WRITE);
+	if (!recv_mr) {
+		std::cerr << __func__ << " failed to register recv buffer of core " << core_id << std::endl;
+		return;
+	}
+	for (uint32_t index = 0; index < SHARD_RECV_WQE; ++index) {
+		recv_chunks.push_back(new Chunk(recv_mr, recv_buf + (uint64_t)index * SHARD_RECV_CHUNK_SIZE,
+					SHARD_RECV_CHUNK_SIZE));
+		post_recv(index);
+	}
+}
+
+CoreShard::~CoreShard()
+{
+	for (auto ck : recv_chunks) {
+		delete ck;
+	}
+	if (srq)
+		ibv_destroy_srq(srq);
+	if (recv_mr)
+		ibv_dereg_mr(recv_mr);
+	free(recv_buf);
+	if (pd)
+		ibv_dealloc_pd(pd);
+}
+
+bool CoreShard::ready() const
+{
+	return recv_mr != nullptr;
+}
+
+void CoreShard::set_peers(const std::vector<CoreShard*>& peers)
+{
+	this->peers = peers;
+	inbound.clear();
+	for (uint32_t from = 0; from <= peers.size(); ++from) {
+		inbound.emplace_back(new SPSCRing<shard_msg>(SHARD_RING_SIZE));
+	}
+}
+
+CoreShard* CoreShard::current()
+{
+	return current_shard;
+}
+
+void CoreShard::bind()
+{
+	current_shard = this;
+}
+
+bool CoreShard::push(CoreShard* to, const shard_msg& msg)
+{
+	CoreShard* from = current_shard;
+	bool pushed = false;
+	if (from && from->core_id < to->peers.size() && to->peers[from->core_id] == from) {
+		pushed = to->inbound[from->core_id]->push(msg);
+	} else {
+		std::lock_guard<std::mutex> l(to->external_mtx);
+		pushed = to->inbound[to->peers.size()]->push(msg);
+	}
+	if (!pushed)
+		return false;
+	// pairs with the fence in prepare_sleep: either the owner sees the
+	// message before blocking or we see it asleep and wake it
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (to->sleeping.load(std::memory_order_relaxed))
+		to->cq_thread->wake();
+	return true;
+}
+
+bool CoreShard::send_to(uint32_t to, Callback* callback, void* param, void* msg)
+{
+	assert(to < peers.size());
+	assert(callback);
+	shard_msg m = {callback, param, msg, SHARD_CALL, 0};
+	return push(peers[to], m);
+}
+
+void CoreShard::adopt(RDMAConnection* con)
+{
+	con->set_shard(this);
+	shard_msg m = {nullptr, con, nullptr, SHARD_ADOPT, con->get_qp()->qp_num};
+	// the CM thread cannot drop a connection, wait for the owner to catch up
+	while (!push(this, m)) {
+		std::this_thread::yield();
+	}
+}
+
+void CoreShard::release(RDMAConnection* con, Callback* retire, void* arg)
+{
+	// the QP number is taken now, the owner may have freed con on an error
+	shard_msg m = {retire, con, arg, SHARD_RELEASE, con->get_qp()->qp_num};
+	while (!push(this, m)) {
+		std::this_thread::yield();
+	}
+}
+
+void CoreShard::add_timer(uint64_t delay_us, Callback* callback, void* param)
+{
+	assert(current_shard == this);
+	shard_timer timer = {shard_now_ns() + delay_us * 1000, callback, param};
+	timers.push(timer);
+}
+
+void CoreShard::poll_messages()
+{
+	shard_msg m;
+	for (auto& ring : inbound) {
+		while (ring->pop(&m)) {
+			if (m.op == SHARD_CALL) {
+				m.callback->callback_entry(m.param, m.msg);
+				continue;
+			}
+			RDMAConnection* con = static_cast<RDMAConnection*>(m.param);
+			if (m.op == SHARD_ADOPT) {
+				connections[m.qp_num] = con;
+				continue;
+			}
+			auto it = connections.find(m.qp_num);
+			if (it == connections.end() || it->second != con)
+				continue;
+			connections.erase(it);
+			m.callback->callback_entry(con, m.msg);
+		}
+	}
+}
+
+void CoreShard::run_timers(uint64_t now_ns)
+{
+	while (!timers.empty() && timers.top().deadline_ns <= now_ns) {
+		shard_timer timer = timers.top();
+		timers.pop();
+		timer.callback->callback_entry(timer.param);
+	}
+}
+
+int CoreShard::next_timeout_ms(uint64_t now_ns) const
+{
+	if (timers.empty())
+		return -1;
+	uint64_t deadline_ns = timers.top().deadline_ns;
+	if (deadline_ns <= now_ns)
+		return 0;
+	return (deadline_ns - now_ns + 999999) / 1000000;
+}
+
+bool CoreShard::prepare_sleep()
+{
+	sleeping.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	for (auto& ring : inbound) {
+		if (!ring->empty()) {
+			sleeping.store(false, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	return true;
+}
+
+void CoreShard::finish_sleep()
+{
+	sleeping.store(false, std::memory_order_relaxed);
+}
+
+void CoreShard::handle_recv(struct ibv_wc* wc)
+{
+	uint32_t index = wr_index(wc->wr_id);
+	if (index >= recv_chunks.size())
+		return;
+	Chunk* ck = recv_chunks[index];
+	ck->chk_size = wc->byte_len;
+
+	auto it = connections.find(wc->qp_num);
+	if (it == connections.end()) {
+		// accepted and already talking before its hand-over was read
+		poll_messages();
+		it = connections.find(wc->qp_num);
+	}
+	if (it != connections.end()) {
+		RDMAConnection* con = it->second;
+		if (con->read_callback)
+			con->read_callback->callback_entry(con, ck);
+	}
+	post_recv(index);
+}
+
+RDMAConnection* CoreShard::find(uint32_t qp_num)
+{
+	poll_messages();
+	auto it = connections.find(qp_num);
+	return it == connections.end() ? nullptr : it->second;
+}
+
+RDMAConnection* CoreShard::forget(uint32_t qp_num)
+{
+	poll_messages();
+	auto it = connections.find(qp_num);
+	if (it == connections.end())
+		return nullptr;
+	RDMAConnection* con = it->second;
+	connections.erase(it);
+	return con;
+}
+
+void CoreShard::repost(uint64_t wr_id)
+{
+	if (wr_index(wr_id) < recv_chunks.size())
+		post_recv(wr_index(wr_id));
+}
+
+void CoreShard::post_recv(uint32_t index)
+{
+	Chunk* ck = recv_chunks[index];
+	struct ibv_recv_wr* bad_wr = nullptr;
+	struct ibv_sge recv_sge = {};
+	struct ibv_recv_wr recv_wr = {};
+
+	recv_sge.addr = (uintptr_t) ck->chk_buf;
+	recv_sge.length = SHARD_RECV_CHUNK_SIZE;
+	recv_sge.lkey = ck->mr->lkey;
+
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+	recv_wr.next = nullptr;
+	// tag 0 never names a registered connection
+	recv_wr.wr_id = make_wr_id(0, WR_SHARD_RECV, index);
+	if (ibv_post_srq_recv(srq, &recv_wr, &bad_wr)) {
+		std::cerr << __func__ << " failed to post recv wr " << std::endl;
+	}
+}
+
+struct ibv_pd* CoreShard::get_pd() const
+{
+	return pd;
+}
+
+struct ibv_srq* CoreShard::get_srq() const
+{
+	return srq;
+}
+
+uint32_t CoreShard::get_core_id() const
+{
+	return core_id;
+}
+
+size_t CoreShard::get_connection_nums() const
+{
+	return connections.size();
+}
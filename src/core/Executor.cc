@@ -0,0 +1,150 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rdma_messenger/Executor.h"
+
+Executor::Executor(uint32_t thread_nums, const std::vector<int>& cpus)
+{
+	assert(thread_nums > 0);
+	for (uint32_t thread_id = 0; thread_id < thread_nums; ++thread_id) {
+		queues.push_back(new exec_queue());
+	}
+	for (uint32_t thread_id = 0; thread_id < thread_nums; ++thread_id) {
+		ExecThread* thread = new ExecThread(this, thread_id);
+		thread->start();
+		if (!cpus.empty())
+			thread->set_affinity(cpus[thread_id % cpus.size()]);
+		threads.push_back(thread);
+	}
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> l(idle_mtx);
+		stop.store(true);
+	}
+	idle_cond.notify_all();
+	for (auto thread : threads) {
+		thread->join();
+		delete thread;
+	}
+	for (auto queue : queues) {
+		delete queue;
+	}
+}
+
+void Executor::submit(ExecTask* task, uint64_t hint)
+{
+	exec_queue* queue = queues[hint % queues.size()];
+	{
+		std::lock_guard<std::mutex> l(queue->mtx);
+		queue->tasks.push_back(task);
+	}
+	pending.fetch_add(1);
+	// sleepers check pending under idle_mtx, taking it closes the gap
+	{
+		std::lock_guard<std::mutex> l(idle_mtx);
+	}
+	idle_cond.notify_one();
+}
+
+uint32_t Executor::get_thread_nums() const
+{
+	return threads.size();
+}
+
+ExecTask* Executor::take(uint32_t thread_id)
+{
+	uint32_t nums = queues.size();
+	for (uint32_t i = 0; i < nums; ++i) {
+		exec_queue* queue = queues[(thread_id + i) % nums];
+		std::lock_guard<std::mutex> l(queue->mtx);
+		if (queue->tasks.empty())
+			continue;
+		ExecTask* task = nullptr;
+		if (i == 0) {
+			task = queue->tasks.front();
+			queue->tasks.pop_front();
+		} else {
+			// steal the task its owner would get to last
+			task = queue->tasks.back();
+			queue->tasks.pop_back();
+		}
+		pending.fetch_sub(1);
+		return task;
+	}
+	return nullptr;
+}
+
+void Executor::run(uint32_t thread_id)
+{
+	while (true) {
+		ExecTask* task = take(thread_id);
+		if (task) {
+			task->run();
+			continue;
+		}
+		std::unique_lock<std::mutex> l(idle_mtx);
+		while (pending.load() == 0 && !stop.load()) {
+			idle_cond.wait(l);
+		}
+		if (stop.load() && pending.load() == 0)
+			return;
+	}
+}
+
+void Strand::post(Executor* executor, uint64_t hint, Callback* callback, void* param, void* msg)
+{
+	strand_item item = {callback, param, msg};
+	std::lock_guard<std::mutex> l(mtx);
+	items.push_back(item);
+	if (scheduled)
+		return;
+	scheduled = true;
+	this->executor = executor;
+	this->hint = hint;
+	executor->submit(this, hint);
+}
+
+bool Strand::idle()
+{
+	std::lock_guard<std::mutex> l(mtx);
+	return !scheduled;
+}
+
+void Strand::run()
+{
+	for (uint32_t done = 0; ; ++done) {
+		strand_item item;
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			if (items.empty()) {
+				scheduled = false;
+				return;
+			}
+			if (done == EXECUTOR_STRAND_BATCH) {
+				// let other strands of this thread run, stay scheduled
+				executor->submit(this, hint);
+				return;
+			}
+			item = items.front();
+			items.pop_front();
+		}
+		item.callback->callback_entry(item.param, item.msg);
+	}
+}
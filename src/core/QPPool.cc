@@ -0,0 +1,116 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include "rdma_messenger/QPPool.h"
+
+QPPool::QPPool(uint32_t depth) : depth(depth)
+{
+	thread = new PoolThread(this);
+	thread->start();
+}
+
+QPPool::~QPPool()
+{
+	{
+		std::lock_guard<std::mutex> l(pool_mtx);
+		stop = true;
+	}
+	pool_cond.notify_all();
+	thread->join();
+	delete thread;
+
+	for (auto slot : slots) {
+		for (auto con : slot->warm) {
+			delete con;
+		}
+		delete slot;
+	}
+}
+
+void QPPool::add_device(struct ibv_context* verbs, struct ibv_pd* pd, const std::vector<struct ibv_cq*>& cqs)
+{
+	{
+		std::lock_guard<std::mutex> l(pool_mtx);
+		for (auto cq : cqs) {
+			pool_slot* slot = new pool_slot();
+			slot->verbs = verbs;
+			slot->pd = pd;
+			slot->cq = cq;
+			slots.push_back(slot);
+			cq_slots[cq] = slot;
+		}
+	}
+	pool_cond.notify_all();
+}
+
+RDMAConnection* QPPool::take(struct ibv_cq* cq)
+{
+	RDMAConnection* con = nullptr;
+	{
+		std::lock_guard<std::mutex> l(pool_mtx);
+		auto it = cq_slots.find(cq);
+		if (it == cq_slots.end() || it->second->warm.empty())
+			return nullptr;
+		con = it->second->warm.front();
+		it->second->warm.pop_front();
+	}
+	pool_cond.notify_all();
+	return con;
+}
+
+uint32_t QPPool::get_depth() const
+{
+	return depth;
+}
+
+QPPool::pool_slot* QPPool::find_low()
+{
+	for (auto slot : slots) {
+		if (slot->warm.size() < depth)
+			return slot;
+	}
+	return nullptr;
+}
+
+void QPPool::refill()
+{
+	std::unique_lock<std::mutex> l(pool_mtx);
+	while (true) {
+		pool_slot* slot = nullptr;
+		while (!stop && !(slot = find_low())) {
+			pool_cond.wait(l);
+		}
+		if (stop)
+			return;
+
+		// registration takes long, accepts keep taking meanwhile
+		l.unlock();
+		RDMAConnection* con = slot->pd ? new RDMAConnection(slot->pd, slot->cq, nullptr, 0) : nullptr;
+		l.lock();
+		if (!con || !con->get_qp()) {
+			std::cerr << __func__ << " failed to create a warm connection, pool stays at "
+				<< slot->warm.size() << std::endl;
+			delete con;
+			// retried on the next take
+			pool_cond.wait(l);
+			continue;
+		}
+		slot->warm.push_back(con);
+	}
+}
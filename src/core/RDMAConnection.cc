@@ -17,10 +17,16 @@
 
 #include <iostream>
 #include "rdma_messenger/RDMAConnection.h"
+#include "rdma_messenger/RDMAStack.h"
 
-RDMAConnection::RDMAConnection(struct ibv_pd *pd, struct ibv_cq *cq, struct rdma_cm_id *cm_id, uint64_t con_id) : pd(pd), cq(cq), cm_id(cm_id), con_id(con_id), recv_buf_len(RECV_WQE_PER_QP * SGE_MSG_SIZE), send_buf_len(SEND_WQE_PER_QP * SGE_MSG_SIZE)
+RDMAConnection::RDMAConnection(struct ibv_pd *pd, struct ibv_cq *cq, struct rdma_cm_id *cm_id, uint64_t con_id,
+		struct ibv_srq *shared_srq) : pd(pd), cq(cq), cm_id(cm_id), con_id(con_id), srq(shared_srq),
+	chunk_size(shared_srq ? SHARD_RECV_CHUNK_SIZE : SGE_MSG_SIZE),
+	recv_buf_len(shared_srq ? 0 : RECV_WQE_PER_QP * chunk_size), send_buf_len(SEND_WQE_PER_QP * chunk_size),
+	free_chunks(SEND_WQE_PER_QP), free_atomic_ops(ATOMIC_WQE_PER_QP)
 {
-	recv_buf = static_cast<char*>(memalign(4096, recv_buf_len));
+	if (recv_buf_len)
+		recv_buf = static_cast<char*>(memalign(4096, recv_buf_len));
 	send_buf = static_cast<char*>(memalign(4096, send_buf_len));
 	register_mr();
 
@@ -28,10 +34,27 @@ RDMAConnection::RDMAConnection(struct ibv_pd *pd, struct ibv_cq *cq, struct rdma
 	send_chunk = static_cast<Chunk**>(std::calloc(SEND_WQE_PER_QP, sizeof(Chunk*)));
     construct_chunks(recv_chunk, recv_buf, recv_buf_len, recv_mr);
     construct_chunks(send_chunk, send_buf, send_buf_len, send_mr);
-	//* free_chunks??
+	send_reqs = new send_request[SEND_WQE_PER_QP];
+	for (uint32_t ck_id = 0; ck_id < SEND_WQE_PER_QP; ++ck_id) {
+		free_chunks.push(ck_id);
+	}
+
+	// fetched values of outstanding atomics, one word per operation
+	atomic_buf = static_cast<uint64_t*>(memalign(64, ATOMIC_WQE_PER_QP * sizeof(uint64_t)));
+	atomic_mr = ibv_reg_mr(pd, atomic_buf, ATOMIC_WQE_PER_QP * sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE);
+	atomic_ops = static_cast<AtomicOp**>(std::calloc(ATOMIC_WQE_PER_QP, sizeof(AtomicOp*)));
+	for (uint32_t op_id = 0; op_id < ATOMIC_WQE_PER_QP; ++op_id) {
+		atomic_ops[op_id] = new AtomicOp(atomic_mr, atomic_buf + op_id);
+	}
+	atomic_reqs = new send_request[ATOMIC_WQE_PER_QP];
+	for (uint32_t op_id = 0; op_id < ATOMIC_WQE_PER_QP; ++op_id) {
+		free_atomic_ops.push(op_id);
+	}
 
-	if (SUPPORT_SRQ)
+	if (SUPPORT_SRQ && !srq) {
 		create_srq();
+		own_srq = true;
+	}
 	create_qp();
 	state = ACTIVE;
 }
@@ -47,18 +70,154 @@ RDMAConnection::~RDMAConnection()
 		delete *(send_chunk + ck_id);
 	}
 	free(send_chunk);
+	delete[] send_reqs;
+
+	for (uint32_t op_id = 0; op_id < ATOMIC_WQE_PER_QP; ++op_id) {
+		delete atomic_ops[op_id];
+	}
+	free(atomic_ops);
+	delete[] atomic_reqs;
+	for (auto mr : atomic_regions) {
+		ibv_dereg_mr(mr);
+	}
+	if (atomic_mr)
+		ibv_dereg_mr(atomic_mr);
+	free(atomic_buf);
+
+	// rdma_cm's QP too, its cm_id let go of it on release and may be gone
+	if (qp)
+		ibv_destroy_qp(qp);
+	if (source)
+		source->put();
+	if (own_srq && srq)
+		ibv_destroy_srq(srq);
+	if (recv_mr)
+		ibv_dereg_mr(recv_mr);
+	if (send_mr)
+		ibv_dereg_mr(send_mr);
+	free(recv_buf);
+	free(send_buf);
+}
+
+bool RDMAConnection::async_send(const char *raw_msg, uint32_t raw_msg_size)
+{
+	return post_send(raw_msg, raw_msg_size);
+}
+
+bool RDMAConnection::async_send(const char *hdr, uint32_t hdr_size, const char *raw_msg, uint32_t raw_msg_size)
+{
+	return post_send(hdr, hdr_size, raw_msg, raw_msg_size);
+}
+
+bool RDMAConnection::async_send_iov(std::vector<const char*> &raw_msg, std::vector<uint32_t> &raw_msg_size)
+{
+	return post_send_iov(raw_msg, raw_msg_size);
+}
 
-	//what's about send_buf/recv_buf & registered memory region
+bool RDMAConnection::async_fetch_add(uint64_t remote_addr, uint32_t rkey, uint64_t add, Callback* callback, uint64_t user_data)
+{
+	AtomicOp *op = nullptr;
+	get_atomic_op(&op);
+	if (!op)
+		return false;
+	op->opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+	op->remote_addr = remote_addr;
+	op->rkey = rkey;
+	op->compare_add = add;
+	op->swap = 0;
+	op->callback = callback;
+	op->user_data = user_data;
+	return post_atomic(op);
 }
 
-void RDMAConnection::async_send(const char *raw_msg, uint32_t raw_msg_size)
+bool RDMAConnection::async_compare_swap(uint64_t remote_addr, uint32_t rkey, uint64_t compare, uint64_t swap,
+		Callback* callback, uint64_t user_data)
 {
-	post_send(raw_msg, raw_msg_size);
+	AtomicOp *op = nullptr;
+	get_atomic_op(&op);
+	if (!op)
+		return false;
+	op->opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+	op->remote_addr = remote_addr;
+	op->rkey = rkey;
+	op->compare_add = compare;
+	op->swap = swap;
+	op->callback = callback;
+	op->user_data = user_data;
+	return post_atomic(op);
 }
 
-void RDMAConnection::async_send_iov(std::vector<const char*> &raw_msg, std::vector<uint32_t> &raw_msg_size)
+void RDMAConnection::complete_atomic(AtomicOp *op)
 {
-	post_send_iov(raw_msg, raw_msg_size);
+	// the result slot stays valid until the op is reaped
+	if (op->callback)
+		op->callback->callback_entry(this, op);
+	reap_atomic_op(&op);
+}
+
+struct ibv_mr* RDMAConnection::register_atomic_region(void *addr, size_t len)
+{
+	assert(reinterpret_cast<uintptr_t>(addr) % sizeof(uint64_t) == 0);
+	struct ibv_mr *mr = ibv_reg_mr(pd, addr, len, IBV_ACCESS_LOCAL_WRITE | \
+			                                      IBV_ACCESS_REMOTE_READ | \
+			                                      IBV_ACCESS_REMOTE_WRITE | \
+			                                      IBV_ACCESS_REMOTE_ATOMIC);
+	if (!mr) {
+		std::cerr << __func__ << " failed to register atomic region" << std::endl;
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> l(atomic_mtx);
+	atomic_regions.push_back(mr);
+	return mr;
+}
+
+Chunk* RDMAConnection::wr_chunk(uint64_t wr_id) const
+{
+	uint32_t index = wr_index(wr_id);
+	switch (wr_kind_of(wr_id)) {
+	case WR_RECV:
+		return index < RECV_WQE_PER_QP ? recv_chunk[index] : nullptr;
+	case WR_SEND:
+	case WR_FIN:
+		return index < SEND_WQE_PER_QP ? send_chunk[index] : nullptr;
+	default:
+		return nullptr;
+	}
+}
+
+AtomicOp* RDMAConnection::wr_atomic_op(uint64_t wr_id) const
+{
+	uint32_t index = wr_index(wr_id);
+	if (wr_kind_of(wr_id) != WR_ATOMIC || index >= ATOMIC_WQE_PER_QP)
+		return nullptr;
+	return atomic_ops[index];
+}
+
+void RDMAConnection::set_wr_tag(uint64_t wr_tag, uint32_t slot)
+{
+	this->wr_tag = wr_tag;
+	this->slot = slot;
+}
+
+uint64_t RDMAConnection::get_wr_tag() const
+{
+	return wr_tag;
+}
+
+uint32_t RDMAConnection::get_slot() const
+{
+	return slot;
+}
+
+uint32_t RDMAConnection::send_index(const Chunk* ck) const
+{
+	return (ck->chk_buf - send_buf) / chunk_size;
+}
+
+uint64_t RDMAConnection::chunk_wr_id(wr_kind kind, const Chunk* ck) const
+{
+	const char* base = kind == WR_RECV ? recv_buf : send_buf;
+	return make_wr_id(wr_tag, kind, (ck->chk_buf - base) / chunk_size);
 }
 
 struct ibv_qp* RDMAConnection::get_qp() const
@@ -76,6 +235,26 @@ uint64_t RDMAConnection::get_con_id() const
 	return con_id;
 }
 
+struct rdma_cm_id* RDMAConnection::get_cm_id() const
+{
+	return cm_id;
+}
+
+void RDMAConnection::set_cq_source(cq_source* source)
+{
+	this->source = source;
+}
+
+void RDMAConnection::set_shard(CoreShard* shard)
+{
+	this->shard = shard;
+}
+
+CoreShard* RDMAConnection::get_shard() const
+{
+	return shard;
+}
+
 bool RDMAConnection::is_recv_buffer(const char *buf) const
 {
 	if (buf >= recv_buf && buf <= recv_buf+recv_buf_len-1)
@@ -105,20 +284,63 @@ uint32_t RDMAConnection::read_buffer(char *raw_msg, uint32_t raw_msg_size)
 	return 0;
 }
 
+void RDMAConnection::deliver(Chunk *ck)
+{
+	if (read_callback) {
+		read_callback->callback_entry(this, ck);
+	}
+	post_recv_buffer(ck);
+}
+
+Strand& RDMAConnection::get_strand()
+{
+	return strand;
+}
+
+bool RDMAConnection::idle()
+{
+	return strand.idle();
+}
+
 void RDMAConnection::set_read_callback(Callback *read_callback) {
 	this->read_callback = read_callback;
 }
 
+void RDMAConnection::set_send_callback(Callback *send_callback) {
+	this->send_callback = send_callback;
+}
+
+void RDMAConnection::set_transfer_profile(const TransferProfile *profile)
+{
+	this->profile = profile;
+}
+
+transfer_strategy RDMAConnection::pick_strategy(uint32_t size) const
+{
+	if (!profile)
+		return TRANSFER_COPY;
+	switch (profile->choose(size)) {
+	case TRANSFER_INLINE:
+		return size <= max_inline ? TRANSFER_INLINE : TRANSFER_COPY;
+	default:
+		// zero-copy and the one-sided strategies need registered, caller
+		// owned buffers and a receiver protocol; async_send copies for now
+		return TRANSFER_COPY;
+	}
+}
+
 void RDMAConnection::close()
 {
-	printf("close connection.\n");
+	// freed by the connection registry once no CQ thread can reach it
 	std::cout << "close connection." << std::endl;
-	delete this;
+	state = CLOSE;
 }
 
 void RDMAConnection::post_recv_buffers()
 {
 	int32_t ret = 0;
+	if (!recv_buf)
+		return;
 
 	struct ibv_recv_wr* bad_wr = nullptr;
 	struct ibv_sge recv_sge = {};
@@ -126,13 +348,13 @@ void RDMAConnection::post_recv_buffers()
 	for (uint32_t ck_id = 0; ck_id < RECV_WQE_PER_QP; ++ck_id) {
 		Chunk* chk = recv_chunk[ck_id];
 		recv_sge.addr = (uintptr_t) chk->chk_buf;
-		recv_sge.length = SGE_MSG_SIZE;
+		recv_sge.length = chunk_size;
 		recv_sge.lkey = chk->mr->lkey;
 
 		recv_wr.sg_list = &recv_sge;
 		recv_wr.num_sge = 1;
 		recv_wr.next = NULL;
-		recv_wr.wr_id = (uint64_t)chk;
+		recv_wr.wr_id = chunk_wr_id(WR_RECV, chk);
 		if (SUPPORT_SRQ) {
 			ret = ibv_post_srq_recv(srq, &recv_wr, &bad_wr);
 		} else {
@@ -151,13 +373,13 @@ void RDMAConnection::post_recv_buffer(Chunk *ck) {
 	struct ibv_recv_wr recv_wr = {};
 
 	recv_sge.addr = (uintptr_t) (ck->chk_buf);
-	recv_sge.length = SGE_MSG_SIZE;
+	recv_sge.length = chunk_size;
 	recv_sge.lkey = ck->mr->lkey;
 
 	recv_wr.sg_list = &recv_sge;
 	recv_wr.num_sge = 1;
 	recv_wr.next = nullptr;
-	recv_wr.wr_id = reinterpret_cast<uint64_t>(ck);
+	recv_wr.wr_id = chunk_wr_id(WR_RECV, ck);
 
 	int32_t ret = 0;
 	if (SUPPORT_SRQ) {
@@ -170,115 +392,206 @@ void RDMAConnection::post_recv_buffer(Chunk *ck) {
 	}
 }
 
-void RDMAConnection::post_send(const char *raw_msg, uint32_t raw_msg_size) {
-	struct ibv_send_wr *bad_wr = nullptr;
-	struct ibv_sge send_sge = {};
-	struct ibv_send_wr send_wr = {};
+bool RDMAConnection::post_send(const char *raw_msg, uint32_t raw_msg_size) {
+	return post_send(nullptr, 0, raw_msg, raw_msg_size);
+}
+
+send_request* RDMAConnection::prepare_send(Chunk *ck, wr_kind kind)
+{
+	send_request *req = &send_reqs[send_index(ck)];
+	req->sge.addr = (uintptr_t) ck->chk_buf;
+	req->sge.length = ck->chk_size;
+	req->sge.lkey = ck->mr->lkey;
+
+	req->wr.opcode = IBV_WR_SEND;
+	req->wr.send_flags = IBV_SEND_SIGNALED;
+	req->wr.sg_list = &req->sge;
+	req->wr.num_sge = 1;
+	req->wr.wr_id = chunk_wr_id(kind, ck);
+	req->wr.next = nullptr;
+	return req;
+}
+
+bool RDMAConnection::post_send(const char *hdr, uint32_t hdr_size, const char *raw_msg, uint32_t raw_msg_size) {
+	assert(hdr_size + raw_msg_size <= chunk_size);
 	Chunk *ck = nullptr;
 	get_chunk(&ck);
-	assert(ck);
-	assert(raw_msg_size <= SGE_MSG_SIZE);
-	memcpy(ck->chk_buf, (char*)raw_msg, raw_msg_size);
-	ck->chk_size = raw_msg_size;
-
-	send_sge.addr = (uintptr_t) ck->chk_buf;
-	send_sge.length = raw_msg_size;
-	send_sge.lkey = ck->mr->lkey;
-
-	send_wr.opcode = IBV_WR_SEND;
-	send_wr.send_flags = IBV_SEND_SIGNALED;
-	send_wr.sg_list = &send_sge;
-	send_wr.num_sge = 1;
-	send_wr.wr_id = reinterpret_cast<uint64_t>(ck);
-	send_wr.next = NULL;
-	int ret = ibv_post_send(qp, &send_wr, &bad_wr);
-	if (ret) {
-		std::cerr << __func__ << " failed to post send wrs " << std::endl;
+	if (!ck) {
+		std::cerr << __func__ << " no free send chunk" << std::endl;
+		return false;
 	}
+	// the poster may run after the caller returned, so the payload is
+	// always copied; small messages still skip the DMA read via inline
+	ck->chk_size = hdr_size + raw_msg_size;
+	if (hdr_size)
+		memcpy(ck->chk_buf, hdr, hdr_size);
+	memcpy(ck->chk_buf + hdr_size, (char*)raw_msg, raw_msg_size);
+
+	send_request *req = prepare_send(ck, WR_SEND);
+	if (pick_strategy(ck->chk_size) == TRANSFER_INLINE)
+		req->wr.send_flags |= IBV_SEND_INLINE;
+	send_queue.push(req);
+	flush_send_queue();
+	return true;
 }
 
-void RDMAConnection::post_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size)
+bool RDMAConnection::post_send_iov(std::vector<const char*> &raw_msg_iov, std::vector<uint32_t> &raw_msg_size)
 {
-	uint32_t sge_index = 0;
-	int chunk_size = raw_msg_iov.size();
-	struct ibv_sge send_sge[chunk_size] = {};
-	struct ibv_send_wr send_wr[chunk_size] = {};
-	ibv_send_wr* pre_wr = nullptr;
-	for (uint32_t base = 0; base < chunk_size; ++base) {
-		assert(raw_msg_size[base] <= SGE_MSG_SIZE);
+	bool queued = true;
+	for (uint32_t base = 0; base < raw_msg_iov.size(); ++base) {
+		assert(raw_msg_size[base] <= chunk_size);
 
 		Chunk *ck = nullptr;
 		get_chunk(&ck);
-		assert(ck);
+		if (!ck) {
+			std::cerr << __func__ << " no free send chunk" << std::endl;
+			queued = false;
+			break;
+		}
 
 		memcpy(ck->chk_buf, raw_msg_iov[base], raw_msg_size[base]);
 		ck->chk_size = raw_msg_size[base];
-
-		send_sge[sge_index].addr = (uintptr_t) ck->chk_buf;
-		send_sge[sge_index].length = raw_msg_size[base];
-		send_sge[sge_index].lkey = ck->mr->lkey;
-
-		send_wr[sge_index].opcode = IBV_WR_SEND;
-		send_wr[sge_index].send_flags = IBV_SEND_SIGNALED;
-		send_wr[sge_index].sg_list = &send_sge[sge_index];
-		send_wr[sge_index].num_sge = 1;
-		send_wr[sge_index].wr_id = reinterpret_cast<uint64_t>(ck);
-		send_wr[sge_index].next = NULL;
-		if (pre_wr)
-			pre_wr->next = &send_wr[sge_index];
-		pre_wr = &send_wr[sge_index];
-		sge_index++;
+		send_queue.push(prepare_send(ck, WR_SEND));
 	}
+	flush_send_queue();
+	return queued;
+}
 
-	struct ibv_send_wr *bad_wr = nullptr;
-	int ret = ibv_post_send(qp, send_wr, &bad_wr);
-	if (ret) {
-		std::cerr << __func__ << " failed to post send wrs " << std::endl;
+bool RDMAConnection::post_atomic(AtomicOp *op)
+{
+	assert(op->remote_addr % sizeof(uint64_t) == 0);
+	uint32_t op_id = op->result - atomic_buf;
+	send_request *req = &atomic_reqs[op_id];
+
+	req->sge.addr = (uintptr_t) op->result;
+	req->sge.length = sizeof(uint64_t);
+	req->sge.lkey = op->mr->lkey;
+
+	req->wr.opcode = op->opcode;
+	req->wr.send_flags = IBV_SEND_SIGNALED;
+	req->wr.sg_list = &req->sge;
+	req->wr.num_sge = 1;
+	req->wr.wr_id = make_wr_id(wr_tag, WR_ATOMIC, op_id);
+	req->wr.wr.atomic.remote_addr = op->remote_addr;
+	req->wr.wr.atomic.rkey = op->rkey;
+	req->wr.wr.atomic.compare_add = op->compare_add;
+	req->wr.wr.atomic.swap = op->swap;
+	req->wr.next = nullptr;
+	send_queue.push(req);
+	flush_send_queue();
+	return true;
+}
+
+void RDMAConnection::flush_send_queue()
+{
+	// a producer that loses the claim is covered: the poster re-checks the
+	// queue after giving up the claim
+	while (!send_queue.empty()) {
+		if (!send_queue.claim())
+			return;
+		send_request *reqs = send_queue.take_all();
+		for (send_request *req = reqs; req && req->next; req = req->next) {
+			req->wr.next = &req->next->wr;
+		}
+		if (reqs) {
+			struct ibv_send_wr *bad_wr = nullptr;
+			int ret = ibv_post_send(qp, &reqs->wr, &bad_wr);
+			if (ret) {
+				std::cerr << __func__ << " failed to post send wrs " << std::endl;
+				// nothing from bad_wr on reached the QP, hand the resources back
+				while (bad_wr) {
+					uint64_t wr_id = bad_wr->wr_id;
+					bad_wr = bad_wr->next;
+					if (wr_kind_of(wr_id) == WR_ATOMIC) {
+						AtomicOp *op = wr_atomic_op(wr_id);
+						reap_atomic_op(&op);
+					} else {
+						Chunk *ck = wr_chunk(wr_id);
+						reap_chunk(&ck);
+					}
+				}
+			}
+		}
+		send_queue.release();
 	}
 }
 
 void RDMAConnection::finish()
 {
-	struct ibv_send_wr send_wr = {};
-	struct ibv_sge send_sge = {};
-	struct ibv_send_wr *bad_wr = nullptr;
-	memset(&send_wr, 0, sizeof(send_wr));
-
 	Chunk *ck = NULL;
 	get_chunk(&ck);
-	assert(ck);
-
-	send_sge.addr = (uintptr_t) ck->chk_buf;
-	send_sge.length = 0;
-	send_sge.lkey = ck->mr->lkey;
-
-	send_wr.wr_id = FIN_WRID;
-	send_wr.sg_list = &send_sge;
-	send_wr.num_sge = 1;
-	send_wr.opcode = IBV_WR_SEND;
-	send_wr.send_flags = IBV_SEND_SIGNALED;
-	send_wr.next = NULL;
-	int ret = ibv_post_send(qp, &send_wr, &bad_wr);
-	if (ret) {
-		std::cerr<< __func__ << " ibv send error " << std::endl;
+	if (!ck) {
+		std::cerr << __func__ << " no free send chunk" << std::endl;
+		return;
 	}
+
+	// the completion hands the chunk back like any other send
+	ck->chk_size = 0;
+	send_queue.push(prepare_send(ck, WR_FIN));
+	flush_send_queue();
 }
 
 void RDMAConnection::create_qp() {
 	struct ibv_qp_init_attr init_attr;
 	memset(&init_attr, 0, sizeof(init_attr));
-	init_attr.cap.max_send_wr = SEND_WQE_PER_QP;
+	init_attr.cap.max_send_wr = SEND_WQE_PER_QP + ATOMIC_WQE_PER_QP;
 	init_attr.cap.max_recv_wr = RECV_WQE_PER_QP;
 	init_attr.cap.max_recv_sge = 1;
-	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_send_sge = 2;
+	init_attr.cap.max_inline_data = INLINE_DATA_MAX;
 	init_attr.qp_type = IBV_QPT_RC;
 	init_attr.send_cq = cq;
 	init_attr.recv_cq = cq;
-	if (SUPPORT_SRQ)
+	if (srq)
 		init_attr.srq = srq;
 
-	rdma_create_qp(cm_id, pd, &init_attr);
+	if (!cm_id) {
+		// warm pool: a QP of our own, bound to a cm_id by accept
+		qp = ibv_create_qp(pd, &init_attr);
+		if (!qp) {
+			init_attr.cap.max_inline_data = 0;
+			qp = ibv_create_qp(pd, &init_attr);
+		}
+		max_inline = init_attr.cap.max_inline_data;
+		return;
+	}
+
+	if (rdma_create_qp(cm_id, pd, &init_attr)) {
+		// device without inline support
+		init_attr.cap.max_inline_data = 0;
+		rdma_create_qp(cm_id, pd, &init_attr);
+	}
 	qp = cm_id->qp;
+	max_inline = init_attr.cap.max_inline_data;
+}
+
+bool RDMAConnection::bind(struct rdma_cm_id* cm_id, uint64_t con_id, const struct rdma_conn_param* accept_params)
+{
+	assert(!this->cm_id && qp);
+	this->cm_id = cm_id;
+	this->con_id = con_id;
+
+	// what rdma_accept does to a QP created on the cm_id, with the
+	// negotiated read/atomic depths of the reply
+	enum ibv_qp_state states[] = {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS};
+	for (auto qp_state : states) {
+		struct ibv_qp_attr attr = {};
+		int mask = 0;
+		attr.qp_state = qp_state;
+		if (rdma_init_qp_attr(cm_id, &attr, &mask)) {
+			std::cerr << __func__ << " failed to get attributes of QP state " << qp_state << std::endl;
+			return false;
+		}
+		if (qp_state == IBV_QPS_RTR)
+			attr.max_dest_rd_atomic = accept_params->responder_resources;
+		if (qp_state == IBV_QPS_RTS)
+			attr.max_rd_atomic = accept_params->initiator_depth;
+		if (ibv_modify_qp(qp, &attr, mask)) {
+			std::cerr << __func__ << " failed to move QP to state " << qp_state << std::endl;
+			return false;
+		}
+	}
+	return true;
 }
 
 void RDMAConnection::create_srq()
@@ -291,7 +604,8 @@ void RDMAConnection::create_srq()
 
 void RDMAConnection::register_mr()
 {
-	recv_mr = ibv_reg_mr(pd, recv_buf, recv_buf_len, IBV_ACCESS_LOCAL_WRITE | \
+	if (recv_buf)
+		recv_mr = ibv_reg_mr(pd, recv_buf, recv_buf_len, IBV_ACCESS_LOCAL_WRITE | \
 			                                         IBV_ACCESS_REMOTE_READ | \
 			                                         IBV_ACCESS_REMOTE_WRITE);
 
@@ -303,29 +617,39 @@ void RDMAConnection::register_mr()
 void RDMAConnection::construct_chunks(Chunk** chunks, char* buf, uint32_t buf_len, ibv_mr* mr)
 {
 	uint32_t ck_id = 0;
-	for (uint32_t offset = 0; offset < buf_len; offset += SGE_MSG_SIZE) {
-		Chunk* ck = new Chunk(mr, buf + offset, SGE_MSG_SIZE);
+	for (uint32_t offset = 0; offset < buf_len; offset += chunk_size) {
+		Chunk* ck = new Chunk(mr, buf + offset, chunk_size);
 		*(chunks + ck_id) = ck;
 		ck_id++;
 	}
 }
 
 void RDMAConnection::get_chunk(Chunk **ck) {
-	std::lock_guard<std::mutex> l(chk_mtx);
-	if (free_chunks.size() == 0)
+	uint32_t ck_id = 0;
+	if (!free_chunks.pop(&ck_id))
 		return;
-	*ck = free_chunks.back();
-	assert(*ck);
-	free_chunks.pop_back();
+	*ck = send_chunk[ck_id];
 }
 
 void RDMAConnection::reap_chunk(Chunk **ck)
 {
-	std::lock_guard<std::mutex> l(chk_mtx);
 	assert(*ck);
-	free_chunks.push_back(*ck);
+	free_chunks.push(send_index(*ck));
 }
 
+void RDMAConnection::get_atomic_op(AtomicOp **op)
+{
+	uint32_t op_id = 0;
+	if (!free_atomic_ops.pop(&op_id))
+		return;
+	*op = atomic_ops[op_id];
+}
+
+void RDMAConnection::reap_atomic_op(AtomicOp **op)
+{
+	assert(*op);
+	free_atomic_ops.push((*op)->result - atomic_buf);
+}
 
 void *malloc_huge_pages(size_t size)
 {
@@ -16,108 +16,581 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 
 #include "rdma_messenger/RDMAStack.h"
+#include "rdma_messenger/CoreShard.h"
 
-RDMAConMgr::RDMAConMgr(RDMAStack* rdma_stack) : rdma_stack(rdma_stack)
+// runs a received chunk through its connection on an executor thread
+class DeliverCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		static_cast<RDMAConnection*>(param)->deliver(static_cast<Chunk*>(msg));
+	}
+};
+
+static DeliverCallback deliver_callback;
+
+// owner core of a sharded connection, out of its table: retire it, msg is the RDMAConMgr
+class ShardRetireCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		RDMAConnection* con = static_cast<RDMAConnection*>(param);
+		static_cast<RDMAConMgr*>(msg)->del(con);
+		con->close();
+	}
+};
+
+static ShardRetireCallback shard_retire_callback;
+
+// context of async_connect ids once established, only DISCONNECTED matters then
+static connect_op connected_op;
+
+// reactor mode: a CM event channel became readable, param is the channel
+class CMReadyCallback : public Callback {
+	public:
+	CMReadyCallback(RDMAStack* rdma_stack) : rdma_stack(rdma_stack)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		rdma_stack->process_cm_events(static_cast<struct rdma_event_channel*>(param));
+	}
+	private:
+	RDMAStack* rdma_stack;
+};
+
+// reactor mode: the epoll set of a CQ worker became readable
+class CQReadyCallback : public Callback {
+	public:
+	CQReadyCallback(RDMAStack* rdma_stack) : rdma_stack(rdma_stack)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		rdma_stack->cq_poll_once(static_cast<CQThread*>(param), 0);
+	}
+	private:
+	RDMAStack* rdma_stack;
+};
+
+static uint64_t now_ns()
 {
-	cq_threads.reserve(IO_WORKER_NUMS);
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+RDMAConMgr::RDMAConMgr(RDMAStack* rdma_stack) : rdma_stack(rdma_stack), placement(new LeastLoadedPlacement())
+{}
+
 RDMAConMgr::~RDMAConMgr()
 {
+	if (balancer) {
+		stop_balance.store(true);
+		balancer->join();
+		delete balancer;
+	}
+	delete qp_pool;
 	for (auto m : qp_con_map) {
 		delete m.second;
 	}
+	// retired connections still hold MRs and QPs on the shared PDs
+	registry.drain();
+	for (auto pd : pds) {
+		if (pd.second && ibv_dealloc_pd(pd.second))
+			std::cerr << __func__ << " failed to free the PD of "
+				<< ibv_get_device_name(pd.first->device) << std::endl;
+	}
+	for (auto ep : ud_endpoints) {
+		delete ep;
+	}
+	delete placement;
 }
 
 RDMAConnection* RDMAConMgr::get_connection(uint32_t qp_num)
 {
-	if (qp_con_map.count(qp_num) != 0) {
-		return qp_con_map[qp_num];
+	std::lock_guard<std::mutex> l(con_mtx);
+	auto it = qp_con_map.find(qp_num);
+	if (it != qp_con_map.end()) {
+		return it->second;
 	} else {
 		return nullptr;
 	}
 }
 
-RDMAConnection* RDMAConMgr::new_connection(struct rdma_cm_id* cm_id)
+RDMAConnection* RDMAConMgr::new_connection(struct rdma_cm_id* cm_id, const struct rdma_conn_param* accept_params)
 {
-	struct ibv_pd* pd = ibv_alloc_pd(cm_id->verbs);
-	struct ibv_cq* cq = nullptr;
-	uint64_t con_id = con_number;
-	if (con_id < IO_WORKER_NUMS) {
-		struct ibv_comp_channel *cq_channel = ibv_create_comp_channel(cm_id->verbs);
-		cq = ibv_create_cq(cm_id->verbs, CQE_PER_CQ * 2, nullptr, cq_channel, 0);
-		ibv_req_notify_cq(cq, 0);
+	uint64_t con_id = con_number.fetch_add(1);
+	cq_worker& worker = place_connection(cm_id);
+	if (worker.shard) {
+		// sharded at accept: the core's PD, CQ and SRQ, owned by that core from now on
+		RDMAConnection *new_con = new RDMAConnection(worker.shard->get_pd(), worker.source->cq, cm_id, con_id,
+				worker.shard->get_srq());
+		new_con->set_transfer_profile(&rdma_stack->get_transfer_profile());
+		add(new_con);
+		{
+			std::lock_guard<std::mutex> l(worker_mtx);
+			con_load_map[con_id] = worker.load;
+		}
+		worker.shard->adopt(new_con);
+		return new_con;
+	}
 
-		CQThread *cq_thread = new CQThread(rdma_stack, cq_channel, cq);
-		cq_thread->start();
-		cq_thread->set_affinity(con_id + 20);
-		cq_threads.push_back(cq_thread);
-	} else {
-		cq = cq_map[con_id % IO_WORKER_NUMS];
+	RDMAConnection* warm_con = nullptr;
+	if (qp_pool && accept_params && !rebalance_percent)
+		warm_con = qp_pool->take(worker.source->cq);
+	if (warm_con) {
+		if (warm_con->bind(cm_id, con_id, accept_params)) {
+			warm_con->set_transfer_profile(&rdma_stack->get_transfer_profile());
+			add(warm_con);
+			{
+				std::lock_guard<std::mutex> l(worker_mtx);
+				con_load_map[con_id] = worker.load;
+			}
+			warm_con->post_recv_buffers();
+			return warm_con;
+		}
+		delete warm_con;
+	}
+
+	struct ibv_pd* pd = get_pd(cm_id->verbs);
+	struct ibv_cq* cq = worker.source->cq;
+	cq_source* source = nullptr;
+	if (rebalance_percent) {
+		source = create_source(cm_id->verbs, CONNECTION_CQE, con_id, worker.load->worker_id);
+		cq = source->cq;
 	}
 	RDMAConnection *new_con = new RDMAConnection(pd, cq, cm_id, con_id);
+	if (source) {
+		source->refs.fetch_add(1);
+		new_con->set_cq_source(source);
+	}
+	new_con->set_transfer_profile(&rdma_stack->get_transfer_profile());
 	add(new_con);
+	{
+		std::lock_guard<std::mutex> l(worker_mtx);
+		con_load_map[con_id] = worker.load;
+		if (source)
+			con_source_map[con_id] = source;
+	}
+	if (source)
+		worker.cq_thread->attach(source);
 	new_con->post_recv_buffers();
 	return new_con;
 }
 
 void RDMAConMgr::add(RDMAConnection* new_con)
 {
-	uint64_t con_id = con_number;
+	// stamp the wr_id tag before anything is posted on the QP
+	registry.add(new_con);
+	std::lock_guard<std::mutex> l(con_mtx);
+	uint64_t con_id = new_con->get_con_id();
 	uint32_t qp_num = new_con->get_qp()->qp_num;
 	struct ibv_cq* cq = new_con->get_cq();
 	qp_con_map.insert(std::pair<uint32_t, RDMAConnection*>(qp_num, new_con));
 	con_map.insert(std::pair<uint64_t, RDMAConnection*>(con_id, new_con));
 	cq_map.insert(std::pair<uint64_t, struct ibv_cq*>(con_id, cq));
-	con_number++;
 }
 
-void RDMAConMgr::del(uint64_t con_id, uint32_t qp_num) {
-	con_map.erase(con_id);
-	qp_con_map.erase(qp_num);
-	if (con_id >= IO_WORKER_NUMS)
+void RDMAConMgr::del(RDMAConnection* con) {
+	uint64_t con_id = con->get_con_id();
+	{
+		std::lock_guard<std::mutex> l(con_mtx);
+		if (!con_map.erase(con_id))
+			return;
+		qp_con_map.erase(con->get_qp()->qp_num);
 		cq_map.erase(con_id);
+	}
+	registry.retire(con);
+
+	std::lock_guard<std::mutex> l(worker_mtx);
+	auto it = con_load_map.find(con_id);
+	if (it != con_load_map.end()) {
+		it->second->connections.fetch_sub(1);
+		con_load_map.erase(it);
+	}
+	auto src = con_source_map.find(con_id);
+	if (src != con_source_map.end()) {
+		cq_source* source = src->second;
+		worker_pools[source->verbs][source->worker_id].cq_thread->detach(source, nullptr);
+		con_source_map.erase(src);
+	}
+}
+
+UDEndpoint* RDMAConMgr::get_ud_endpoint(uint32_t qp_num)
+{
+	std::lock_guard<std::mutex> l(ud_mtx);
+	auto it = qp_ud_map.find(qp_num);
+	if (it != qp_ud_map.end()) {
+		return it->second;
+	}
+	return nullptr;
+}
+
+UDEndpoint* RDMAConMgr::assign_ud_endpoint(struct rdma_cm_id* cm_id)
+{
+	std::vector<cq_worker>& workers = get_workers(cm_id->verbs);
+	std::lock_guard<std::mutex> l(ud_mtx);
+	uint64_t worker_id = ud_number++ % workers.size();
+	if (worker_id < ud_endpoints.size()) {
+		return ud_endpoints[worker_id];
+	}
+
+	UDEndpoint* endpoint = new UDEndpoint(cm_id->verbs, cm_id->port_num, workers[worker_id].source->cq, worker_id);
+	ud_endpoints.push_back(endpoint);
+	qp_ud_map.insert(std::pair<uint32_t, UDEndpoint*>(endpoint->get_qp()->qp_num, endpoint));
+	endpoint->post_recv_buffers();
+	return endpoint;
+}
+
+void RDMAConMgr::set_worker_nums(uint32_t worker_nums)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	this->worker_nums = worker_nums;
+}
+
+void RDMAConMgr::set_worker_cpus(const std::vector<int>& worker_cpus)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	this->worker_cpus = worker_cpus;
+}
+
+void RDMAConMgr::set_app_cpus(const std::vector<int>& app_cpus)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	this->app_cpus = app_cpus;
+}
+
+void RDMAConMgr::set_thread_per_core(bool thread_per_core)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	this->thread_per_core = thread_per_core;
+}
+
+void RDMAConMgr::set_placement_policy(PlacementPolicy* placement)
+{
+	assert(placement);
+	std::lock_guard<std::mutex> l(worker_mtx);
+	delete this->placement;
+	this->placement = placement;
+}
+
+RDMAConMgr::cq_worker& RDMAConMgr::place_connection(struct rdma_cm_id* cm_id)
+{
+	std::vector<cq_worker>& workers = get_workers(cm_id->verbs);
+	std::vector<WorkerLoad*> loads;
+	loads.reserve(workers.size());
+	uint64_t now = now_ns();
+
+	std::lock_guard<std::mutex> l(worker_mtx);
+	for (auto& worker : workers) {
+		worker.load->sample(now);
+		loads.push_back(worker.load);
+	}
+	cq_worker& worker = workers[placement->place(loads, cm_id) % workers.size()];
+	worker.load->connections.fetch_add(1);
+	return worker;
+}
+
+std::vector<int> RDMAConMgr::pick_worker_cpus(struct ibv_context* verbs) const
+{
+	if (!worker_cpus.empty())
+		return worker_cpus;
+
+	std::vector<int> cpus = RNICAffinity(verbs).get_local_cpus();
+	if (cpus.empty()) {
+		// no NUMA information, any online CPU
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long cpu = 0; cpu < online; ++cpu) {
+			cpus.push_back(cpu);
+		}
+	}
+	std::vector<int> picked = RNICAffinity::exclude_ht_siblings(cpus, app_cpus);
+	return picked.empty() ? cpus : picked;
+}
+
+void RDMAConMgr::start_workers(struct ibv_context* verbs)
+{
+	if (verbs)
+		get_workers(verbs);
+}
+
+std::vector<RDMAConMgr::cq_worker>& RDMAConMgr::get_workers(struct ibv_context* verbs)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	auto it = worker_pools.find(verbs);
+	if (it != worker_pools.end())
+		return it->second;
+
+	std::vector<int> cpus = pick_worker_cpus(verbs);
+	uint32_t nums = worker_nums ? worker_nums : std::min<uint32_t>(cpus.size(), IO_WORKER_NUMS);
+	nums = std::max<uint32_t>(nums, 1);
+	// the reactor thread is the only CQ worker
+	Reactor* reactor = rdma_stack->get_reactor();
+	if (reactor)
+		nums = 1;
+
+	std::vector<cq_worker>& workers = worker_pools[verbs];
+	workers.reserve(nums);
+	bool sharded = thread_per_core && rdma_stack->get_qp_type() == IBV_QPT_RC && !reactor;
+	std::vector<CoreShard*> shards;
+	for (uint32_t worker_id = 0; worker_id < nums; ++worker_id) {
+		cq_worker worker = {};
+		worker.source = create_source(verbs, CQE_PER_CQ * 2, UINT64_MAX, worker_id);
+		worker.load = new WorkerLoad(worker_id);
+		worker.cq_thread = new CQThread(rdma_stack, worker.load);
+		worker.cq_thread->attach(worker.source);
+		if (sharded) {
+			worker.shard = new CoreShard(verbs, worker_id, worker.cq_thread);
+			worker.cq_thread->set_shard(worker.shard);
+			shards.push_back(worker.shard);
+		}
+		// more workers than CPUs share them round-robin
+		worker.cpu = cpus[worker_id % cpus.size()];
+		workers.push_back(worker);
+	}
+	for (auto shard : shards) {
+		if (!shard->ready()) {
+			sharded = false;
+			break;
+		}
+	}
+	if (!sharded && !shards.empty()) {
+		std::cerr << "thread-per-core unavailable on " << ibv_get_device_name(verbs->device)
+			<< ", workers share the device PD" << std::endl;
+		for (auto& worker : workers) {
+			worker.cq_thread->set_shard(nullptr);
+			delete worker.shard;
+			worker.shard = nullptr;
+		}
+		shards.clear();
+	}
+	// shards talk to each other from the first event on
+	for (auto shard : shards) {
+		shard->set_peers(shards);
+	}
+	if (qp_pool && !sharded && rdma_stack->get_qp_type() == IBV_QPT_RC) {
+		std::vector<struct ibv_cq*> cqs;
+		for (auto& worker : workers) {
+			cqs.push_back(worker.source->cq);
+		}
+		qp_pool->add_device(verbs, get_pd(verbs), cqs);
+	}
+	if (reactor) {
+		rdma_stack->watch_cq_worker(workers[0].cq_thread);
+		std::cout << "watching the CQ worker of " << ibv_get_device_name(verbs->device) << " from the reactor" << std::endl;
+		return workers;
+	}
+	for (auto& worker : workers) {
+		worker.cq_thread->start();
+		worker.cq_thread->set_affinity(worker.cpu);
+	}
+	std::cout << "started " << nums << " CQ workers on " << ibv_get_device_name(verbs->device) << ", cpus";
+	for (auto& worker : workers) {
+		std::cout << " " << worker.cpu;
+	}
+	std::cout << std::endl;
+	return workers;
+}
+
+struct ibv_pd* RDMAConMgr::get_pd(struct ibv_context* verbs)
+{
+	std::lock_guard<std::mutex> l(pd_mtx);
+	struct ibv_pd*& pd = pds[verbs];
+	if (!pd)
+		pd = ibv_alloc_pd(verbs);
+	return pd;
+}
+
+void cq_source::put()
+{
+	if (refs.fetch_sub(1) != 1)
+		return;
+	if (ibv_destroy_cq(cq))
+		std::cerr << __func__ << " failed to destroy cq: " << strerror(errno) << std::endl;
+	else
+		ibv_destroy_comp_channel(cq_channel);
+	delete this;
+}
+
+cq_source* RDMAConMgr::create_source(struct ibv_context* verbs, int cqe, uint64_t con_id, uint32_t worker_id)
+{
+	cq_source* source = new cq_source();
+	source->verbs = verbs;
+	source->con_id = con_id;
+	source->worker_id = worker_id;
+	source->cq_channel = ibv_create_comp_channel(verbs);
+	// polled from epoll, ibv_get_cq_event must not block on a spurious wakeup
+	int flags = fcntl(source->cq_channel->fd, F_GETFL);
+	fcntl(source->cq_channel->fd, F_SETFL, flags | O_NONBLOCK);
+	source->cq = ibv_create_cq(verbs, cqe, nullptr, source->cq_channel, 0);
+	ibv_req_notify_cq(source->cq, 0);
+	return source;
+}
+
+void RDMAConMgr::set_qp_pool(uint32_t depth)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	if (depth && !qp_pool)
+		qp_pool = new QPPool(depth);
+}
+
+std::vector<uint64_t> RDMAConMgr::get_worker_cpu_ns()
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	std::vector<uint64_t> cpu_ns;
+	for (auto& pool : worker_pools) {
+		for (auto& worker : pool.second) {
+			cpu_ns.push_back(worker.cq_thread->cpu_time_ns());
+		}
+	}
+	return cpu_ns;
+}
+
+void RDMAConMgr::set_rebalance(uint32_t spread_percent)
+{
+	rebalance_percent = spread_percent;
+	if (spread_percent && !balancer) {
+		balancer = new BalancerThread(this, stop_balance);
+		balancer->start();
+	}
+}
+
+bool RDMAConMgr::migrate(uint64_t con_id, uint32_t worker_id)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	auto it = con_source_map.find(con_id);
+	if (it == con_source_map.end())
+		return false;
+	return migrate_locked(it->second, worker_id);
+}
+
+bool RDMAConMgr::migrate_locked(cq_source* source, uint32_t worker_id)
+{
+	std::vector<cq_worker>& workers = worker_pools[source->verbs];
+	uint32_t from = source->worker_id;
+	if (worker_id >= workers.size() || worker_id == from || source->moving.load())
+		return false;
+
+	source->moving.store(true);
+	workers[from].load->connections.fetch_sub(1);
+	workers[worker_id].load->connections.fetch_add(1);
+	con_load_map[source->con_id] = workers[worker_id].load;
+	source->worker_id = worker_id;
+	workers[from].cq_thread->detach(source, workers[worker_id].cq_thread);
+	std::cout << "move connection " << source->con_id << " from CQ worker " << from
+		<< " to " << worker_id << std::endl;
+	return true;
+}
+
+void RDMAConMgr::rebalance()
+{
+	uint64_t now = now_ns();
+	std::lock_guard<std::mutex> l(worker_mtx);
+	for (auto& con_source : con_source_map) {
+		con_source.second->load.sample(now);
+	}
+
+	for (auto& pool : worker_pools) {
+		std::vector<cq_worker>& workers = pool.second;
+		uint32_t busiest = 0, idlest = 0;
+		for (uint32_t i = 0; i < workers.size(); ++i) {
+			workers[i].load->sample(now);
+			if (workers[i].load->score() > workers[busiest].load->score())
+				busiest = i;
+			if (workers[i].load->score() < workers[idlest].load->score())
+				idlest = i;
+		}
+		double high = workers[busiest].load->score();
+		double low = workers[idlest].load->score();
+		if (busiest == idlest || high < REBALANCE_MIN_SCORE || (high - low) * 100 < high * rebalance_percent)
+			continue;
+
+		// the connection that closes the gap the most without overshooting it
+		cq_source* candidate = nullptr;
+		double half_gap = (high - low) / 2;
+		for (auto& con_source : con_source_map) {
+			cq_source* source = con_source.second;
+			if (source->verbs != pool.first || source->worker_id != busiest || source->moving.load())
+				continue;
+			double score = source->load.score();
+			if (score > 0 && score <= half_gap && (!candidate || score > candidate->load.score()))
+				candidate = source;
+		}
+		if (candidate)
+			migrate_locked(candidate, idlest);
+	}
 }
 
 void RDMAStack::init()
 {
 	sem_init(&sem, 0, 0);
 	cm_channel = rdma_create_event_channel();
-	rdma_create_id(cm_channel, &cm_id, NULL, RDMA_PS_TCP);
+	rdma_create_id(cm_channel, &cm_id, NULL, qp_type == IBV_QPT_UD ? RDMA_PS_UDP : RDMA_PS_TCP);
+	if (reactor)
+		watch_cm_channel(cm_channel);
 }
 
 void RDMAStack::listen(struct sockaddr* addr)
 {
+  if (!cm_id)
+    init();
   rdma_bind_addr(cm_id, addr);
-  rdma_listen(cm_id, 1);
+  rdma_listen(cm_id, listen_backlog);
+  // bound to a device address: no worker start on the first connect request
+  con_mgr->start_workers(cm_id->verbs);
 }
 
-void RDMAStack::accept(struct rdma_cm_id* new_cm_id)
+void RDMAStack::accept(struct rdma_cm_id* new_cm_id, struct rdma_conn_param* conn_param)
 {
-  struct rdma_event_channel* event_channel = nullptr;
-  event_channel = rdma_create_event_channel();
-  rdma_migrate_id(new_cm_id, event_channel);
-  RDMAConnection *con = connection_establish(new_cm_id);
-  rdma_accept(new_cm_id, NULL);
+  if (qp_type == IBV_QPT_UD) {
+    ud_accept(new_cm_id);
+    return;
+  }
+  // the id stays on the listen channel, its DISCONNECTED releases the connection
+  struct rdma_conn_param cm_params = {};
+  cm_params.rnr_retry_count = 7;
+  set_rd_atomic(new_cm_id->verbs, &cm_params, conn_param);
+  RDMAConnection *con = connection_establish(new_cm_id, &cm_params);
+  // a warm connection's QP is not the cm_id's, name it in the reply
+  if (!new_cm_id->qp) {
+    cm_params.qp_num = con->get_qp()->qp_num;
+    cm_params.srq = con->get_qp()->srq ? 1 : 0;
+  }
+  {
+    std::lock_guard<std::mutex> l(accepted_mtx);
+    accepted_qps[new_cm_id] = con->get_qp()->qp_num;
+  }
+  // let the application install its read callback before the peer can send
   if (accept_callback) {
-    accept_callback->callback_entry(con);
+    accept_callback->callback_entry(con, conn_param);
   }
+  rdma_accept(new_cm_id, &cm_params);
 }
 
-void RDMAStack::connect(struct sockaddr *addr)
+void RDMAStack::connect(struct sockaddr *addr, struct sockaddr *src_addr)
 {
-	rdma_resolve_addr(cm_id, NULL, addr, 5000);
+	rdma_resolve_addr(cm_id, src_addr, addr, 5000);
 	sem_wait(&sem);
+	con_mgr->start_workers(cm_id->verbs);
+
+	if (qp_type == IBV_QPT_UD) {
+		ud_connect();
+		return;
+	}
 
 	RDMAConnection *con = connection_establish(cm_id);
 
 	struct rdma_conn_param cm_params = {};
-	cm_params.responder_resources = 1;
 	cm_params.retry_count = 7;
+	set_rd_atomic(cm_id->verbs, &cm_params, nullptr);
+	cm_params.private_data = connect_private_data;
+	cm_params.private_data_len = connect_private_len;
 	rdma_connect(cm_id, &cm_params);
 	sem_wait(&sem);
 
@@ -126,166 +599,764 @@ void RDMAStack::connect(struct sockaddr *addr)
 	}
 }
 
-void RDMAStack::shutdown()
+struct rdma_event_channel* RDMAStack::get_connect_channel()
 {
-	rdma_disconnect(cm_id);
-	assert(this);
+	std::lock_guard<std::mutex> l(connect_mtx);
+	if (!connect_channel) {
+		connect_channel = rdma_create_event_channel();
+		if (!connect_channel) {
+			std::cerr << __func__ << " failed to create event channel: " << strerror(errno) << std::endl;
+			return nullptr;
+		}
+		if (reactor) {
+			watch_cm_channel(connect_channel);
+		} else {
+			// polled next to connect_stop_fd, reads must not block
+			int flags = fcntl(connect_channel->fd, F_GETFL);
+			fcntl(connect_channel->fd, F_SETFL, flags | O_NONBLOCK);
+			connect_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			connect_thread = new ConnectEventThread(this);
+			connect_thread->start();
+		}
+	}
+	return connect_channel;
 }
 
-void RDMAStack::handle_recv(struct ibv_wc* wc)
+void RDMAStack::close_connect_channel()
 {
-	RDMAConnection* con = con_mgr->get_connection(wc->qp_num);
-	if (wc->wr_id == 0) {
-		if (con) {
-			con_mgr->del(con->get_con_id(), wc->qp_num);
-			con->close();
-			con = nullptr;
+	if (connect_thread) {
+		uint64_t one = 1;
+		if (write(connect_stop_fd, &one, sizeof(one)) != sizeof(one))
+			std::cerr << __func__ << " failed to stop the connect thread" << std::endl;
+		connect_thread->join();
+		delete connect_thread;
+		connect_thread = nullptr;
+		::close(connect_stop_fd);
+	}
+	if (!connect_channel)
+		return;
+	{
+		// ids of connections still up, their QPs go with the connections
+		std::lock_guard<std::mutex> l(live_mtx);
+		for (auto con : live_connections) {
+			struct rdma_cm_id* id = con->get_cm_id();
+			if (id && id->channel == connect_channel) {
+				id->qp = nullptr;
+				rdma_destroy_id(id);
+			}
 		}
-	} else {
-		Chunk* ck = reinterpret_cast<Chunk*>(wc->wr_id);
-		ck->chk_size = wc->byte_len;
+	}
+	rdma_destroy_event_channel(connect_channel);
+	connect_channel = nullptr;
+}
 
-		if (!con || !con->is_recv_buffer(ck->chk_buf))
-			return;
+void RDMAStack::async_connect(struct sockaddr* addr, struct sockaddr* src_addr, Callback* done,
+		const void* private_data, uint8_t private_data_len, connect_timing* timing)
+{
+	assert(done);
+	connect_op* op = new connect_op();
+	op->done = done;
+	op->timing = timing;
+	if (timing)
+		timing->start_ns = now_ns();
+	if (private_data)
+		op->private_data.assign(static_cast<const char*>(private_data), private_data_len);
+
+	struct rdma_cm_id* id = nullptr;
+	if (rdma_create_id(get_connect_channel(), &id, op, qp_type == IBV_QPT_UD ? RDMA_PS_UDP : RDMA_PS_TCP)) {
+		std::cerr << __func__ << " failed to create cm id: " << strerror(errno) << std::endl;
+		delete op;
+		done->callback_entry(nullptr);
+		return;
+	}
+	if (rdma_resolve_addr(id, src_addr, addr, 5000)) {
+		std::cerr << __func__ << " failed to resolve addr: " << strerror(errno) << std::endl;
+		rdma_destroy_id(id);
+		delete op;
+		done->callback_entry(nullptr);
+	}
+}
 
-		if (con->read_callback) {
-			con->read_callback->callback_entry(con, ck);
+void RDMAStack::disconnect(RDMAConnection* con)
+{
+	if (rdma_disconnect(con->get_cm_id()))
+		std::cerr << __func__ << " failed to disconnect connection " << con->get_con_id()
+			<< ": " << strerror(errno) << std::endl;
+}
+
+void RDMAStack::release_connection(struct rdma_cm_id* id, RDMAConnection* con)
+{
+	if (con)
+		untrack(con);
+	// del reads the QP number, the QP goes afterwards
+	if (con && con->get_shard()) {
+		// the owner core takes it out of its table before it is retired
+		con->get_shard()->release(con, &shard_retire_callback, con_mgr);
+	} else if (con) {
+		con_mgr->del(con);
+		con->close();
+	}
+	// the QP goes with the connection once it is reclaimed, the id is
+	// destroyed right after this and must not name it any more
+	id->qp = nullptr;
+}
+
+void RDMAStack::set_accept_dispatch(Callback* dispatch)
+{
+	accept_dispatch = dispatch;
+}
+
+void RDMAStack::accept_dispatched(accept_request* request)
+{
+	accept(request->cm_id, &request->conn_param);
+	// a SIDR id holds no state once the reply is sent
+	if (qp_type == IBV_QPT_UD)
+		rdma_destroy_id(request->cm_id);
+	delete request;
+}
+
+void RDMAStack::set_listen_backlog(int backlog)
+{
+	listen_backlog = backlog;
+}
+
+void RDMAStack::set_rd_atomic(struct ibv_context* verbs, struct rdma_conn_param* cm_params,
+		const struct rdma_conn_param* peer_params)
+{
+	// outstanding RDMA read/atomic depth: max_rd_atomic and max_dest_rd_atomic
+	// of the QP are taken from these by rdma_cm
+	std::unique_lock<std::mutex> l(rd_atomic_mtx);
+	if (max_rd_atom < 0) {
+		struct ibv_device_attr dev_attr = {};
+		if (ibv_query_device(verbs, &dev_attr) == 0) {
+			max_rd_atom = std::min<int32_t>(dev_attr.max_qp_rd_atom, RD_ATOMIC_DEPTH_MAX);
+			max_init_rd_atom = std::min<int32_t>(dev_attr.max_qp_init_rd_atom, RD_ATOMIC_DEPTH_MAX);
+		} else {
+			std::cerr << __func__ << " failed to query device, rd atomic depth 1" << std::endl;
+			max_rd_atom = 1;
+			max_init_rd_atom = 1;
 		}
-		con->post_recv_buffer(ck);
 	}
+	int32_t responder = max_rd_atom;
+	int32_t initiator = max_init_rd_atom;
+	l.unlock();
+	if (peer_params) {
+		// never accept more than the peer is able to issue or answer
+		responder = std::min<int32_t>(responder, peer_params->initiator_depth);
+		initiator = std::min<int32_t>(initiator, peer_params->responder_resources);
+	}
+	cm_params->responder_resources = responder;
+	cm_params->initiator_depth = initiator;
+}
+
+void RDMAStack::ud_accept(struct rdma_cm_id* new_cm_id)
+{
+	// answer the SIDR request with the worker's shared QP, no per-peer QP
+	UDEndpoint* endpoint = con_mgr->assign_ud_endpoint(new_cm_id);
+	struct rdma_conn_param cm_params = {};
+	cm_params.qp_num = endpoint->get_qp()->qp_num;
+	rdma_accept(new_cm_id, &cm_params);
+	if (accept_callback) {
+		accept_callback->callback_entry(endpoint);
+	}
+}
+
+void RDMAStack::ud_connect()
+{
+	ud_peer = nullptr;
+	ud_endpoint = con_mgr->assign_ud_endpoint(cm_id);
+
+	struct rdma_conn_param cm_params = {};
+	cm_params.qp_num = ud_endpoint->get_qp()->qp_num;
+	rdma_connect(cm_id, &cm_params);
+	sem_wait(&sem);
+
+	if (ud_peer && connect_callback) {
+		connect_callback->callback_entry(ud_peer);
+	}
+}
+
+void RDMAStack::untrack(RDMAConnection* con)
+{
+	std::lock_guard<std::mutex> l(live_mtx);
+	live_connections.erase(con);
+}
+
+void RDMAStack::shutdown()
+{
+	// every path retiring a connection untracks it under the lock first
+	std::lock_guard<std::mutex> l(live_mtx);
+	for (auto con : live_connections) {
+		disconnect(con);
+	}
+}
+
+void RDMAStack::handle_recv(struct ibv_wc* wc)
+{
+	RDMAConnection* con = con_mgr->lookup(wc->wr_id);
+	Chunk* ck = con ? con->wr_chunk(wc->wr_id) : nullptr;
+	if (!ck)
+		return;
+	ck->chk_size = wc->byte_len;
+
+	if (executor) {
+		// the chunk is posted again once the callback ran
+		con->get_strand().post(executor, con->get_con_id(), &deliver_callback, con, ck);
+		return;
+	}
+	con->deliver(ck);
 }
 
 void RDMAStack::handle_send(struct ibv_wc* wc)
 {
-	RDMAConnection* con = con_mgr->get_connection(wc->qp_num);
-	if (wc->wr_id == 0) {
-		if (con) {
-			con_mgr->del(con->get_con_id(), wc->qp_num);
-			con->close();
-			con = nullptr;
-		}
-	} else {
-		Chunk* ck = reinterpret_cast<Chunk*>(wc->wr_id);
+	RDMAConnection* con = con_mgr->lookup(wc->wr_id);
+	Chunk* ck = con ? con->wr_chunk(wc->wr_id) : nullptr;
+	if (!ck)
+		return;
+	con->reap_chunk(&ck);
+	if (con->send_callback)
+		con->send_callback->callback_entry(con);
+}
 
-		if (!con || !con->is_send_buffer(ck->chk_buf))
-			return;
-		con->reap_chunk(&ck);
+void RDMAStack::handle_atomic(struct ibv_wc* wc)
+{
+	RDMAConnection* con = con_mgr->lookup(wc->wr_id);
+	AtomicOp* op = con ? con->wr_atomic_op(wc->wr_id) : nullptr;
+	if (!op)
+		return;
+	con->complete_atomic(op);
+}
+
+bool RDMAStack::fail_connection(RDMAConnection* con)
+{
+	// flushed completions after the first error find it failed already
+	if (con->state == CLOSE)
+		return false;
+	con->state = CLOSE;
+	struct rdma_cm_id* id = con->get_cm_id();
+	if (id && id != cm_id) {
+		// retiring it here would free the QP its cm_id still names and leave
+		// its number in accepted_qps, DISCONNECTED releases it on both ends.
+		// A disconnect already under way makes it fail, its DISCONNECTED comes.
+		rdma_disconnect(id);
+		return false;
 	}
+	// the stack's own id sees no DISCONNECTED once connected
+	if (id && id->qp == con->get_qp())
+		id->qp = nullptr;
+	return true;
 }
 
 void RDMAStack::handle_err(struct ibv_wc* wc)
 {
-	RDMAConnection* con = con_mgr->get_connection(wc->qp_num);
-	if (con) {
-		con_mgr->del(con->get_con_id(), wc->qp_num);
+	RDMAConnection* con = con_mgr->lookup(wc->wr_id);
+	if (con && fail_connection(con)) {
+		untrack(con);
+		con_mgr->del(con);
 		con->close();
 	}
 }
 
-void RDMAStack::cq_event_handler(struct ibv_comp_channel* cq_channel, struct ibv_cq* poll_cq)
+void RDMAStack::handle_shard_err(struct ibv_wc* wc, CoreShard* shard)
 {
-	struct ibv_cq* cq_triggered = nullptr;
-	void* cq_ctx = nullptr;
-	while (true) {
-		if (cq_channel = nullptr) {
+	// every connection of a core is in its shard, whatever work request failed
+	RDMAConnection* con = shard->find(wc->qp_num);
+	if (wr_kind_of(wc->wr_id) == WR_SHARD_RECV)
+		shard->repost(wc->wr_id);
+	if (con && fail_connection(con)) {
+		shard->forget(wc->qp_num);
+		untrack(con);
+		con_mgr->del(con);
+		con->close();
+	}
+}
+
+void RDMAStack::handle_ud_recv(struct ibv_wc* wc)
+{
+	UDEndpoint* endpoint = con_mgr->get_ud_endpoint(wc->qp_num);
+	if (endpoint) {
+		endpoint->handle_recv(wc);
+	}
+}
+
+void RDMAStack::handle_ud_send(struct ibv_wc* wc)
+{
+	UDEndpoint* endpoint = con_mgr->get_ud_endpoint(wc->qp_num);
+	if (endpoint) {
+		endpoint->handle_send(wc);
+	}
+}
+
+uint64_t RDMAStack::completion_bytes(const struct ibv_wc* wc) const
+{
+	switch (wc->opcode) {
+	case IBV_WC_RECV:
+		return wc->byte_len;
+	case IBV_WC_SEND: {
+		if (qp_type == IBV_QPT_UD) {
+			if (wc->wr_id == 0 || wc->wr_id == FIN_WRID || wc->wr_id == BEACON_WRID)
+				return 0;
+			return reinterpret_cast<Chunk*>(wc->wr_id)->chk_size;
+		}
+		RDMAConnection* con = con_mgr->lookup(wc->wr_id);
+		Chunk* ck = con ? con->wr_chunk(wc->wr_id) : nullptr;
+		return ck ? ck->chk_size : 0;
+	}
+	case IBV_WC_FETCH_ADD:
+	case IBV_WC_COMP_SWAP:
+		return sizeof(uint64_t);
+	default:
+		return 0;
+	}
+}
+
+void RDMAStack::cq_event_handler(CQThread* worker)
+{
+	CoreShard* shard = worker->get_shard();
+	if (shard)
+		shard->bind();
+	while (cq_poll_once(worker, -1))
+		;
+}
+
+bool RDMAStack::cq_poll_once(CQThread* worker, int timeout_ms)
+{
+	struct epoll_event events[CQ_EPOLL_EVENTS];
+	ConnectionRegistry& registry = con_mgr->get_registry();
+	registry_reader* reader = worker->get_reader();
+	if (!reader) {
+		reader = registry.add_reader();
+		worker->set_reader(reader);
+	}
+	CoreShard* shard = worker->get_shard();
+	if (shard) {
+		// its timers and inbound rings bound the wait
+		timeout_ms = shard->next_timeout_ms(now_ns());
+		if (!shard->prepare_sleep())
+			timeout_ms = 0;
+	}
+	// a retired connection whose strand still runs is freed on a later pass
+	if (registry.has_retired() && (timeout_ms < 0 || timeout_ms > RECLAIM_RETRY_MS))
+		timeout_ms = RECLAIM_RETRY_MS;
+	int n = epoll_wait(worker->get_epoll_fd(), events, CQ_EPOLL_EVENTS, timeout_ms);
+	if (shard)
+		shard->finish_sleep();
+	if (n < 0) {
+		if (errno == EINTR)
+			return true;
+		std::cerr << __func__ << " epoll_wait failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+	// connections looked up in this batch stay allocated until exit
+	registry.enter(reader);
+	// commands may release sources, run them once this batch is done
+	bool has_commands = false;
+	for (int i = 0; i < n; ++i) {
+		if (events[i].data.ptr == nullptr) {
+			has_commands = true;
 			continue;
 		}
-		ibv_get_cq_event(cq_channel, &cq_triggered, &cq_ctx);
-		ibv_ack_cq_events(cq_triggered, 1);
-		ibv_req_notify_cq(cq_triggered, 0);
+		poll_cq_source(static_cast<cq_source*>(events[i].data.ptr), worker);
+	}
+	if (has_commands)
+		worker->run_commands();
+	if (shard) {
+		shard->poll_messages();
+		shard->run_timers(now_ns());
+	}
+	registry.exit(reader);
+	if (registry.has_retired())
+		registry.reclaim();
+	return true;
+}
 
-		assert(poll_cq == cq_triggered);
+void RDMAStack::poll_cq_source(cq_source* source, CQThread* worker)
+{
+	WorkerLoad* load = worker->get_load();
+	CoreShard* shard = worker->get_shard();
+	struct ibv_cq* cq_triggered = nullptr;
+	void* cq_ctx = nullptr;
+	if (ibv_get_cq_event(source->cq_channel, &cq_triggered, &cq_ctx) == 0) {
+		ibv_ack_cq_events(cq_triggered, 1);
+	}
+	ibv_req_notify_cq(source->cq, 0);
 
-		struct ibv_wc wc;
-		while (ibv_poll_cq(poll_cq, 1, &wc) == 1) {
-			if (wc.status) {
-				std::cerr << "connection error: " << ibv_wc_status_str(wc.status)
-					<< std::endl;
+	struct ibv_wc wc;
+	while (ibv_poll_cq(source->cq, 1, &wc) == 1) {
+		if (wc.status) {
+			std::cerr << "connection error: " << ibv_wc_status_str(wc.status)
+				<< std::endl;
+			if (shard)
+				handle_shard_err(&wc, shard);
+			else
 				handle_err(&wc);
-				continue;
-			}
+			continue;
+		}
+		uint64_t bytes = completion_bytes(&wc);
+		load->add_completion(bytes);
+		source->load.add_completion(bytes);
 
-			switch (wc.opcode) {
-			case IBV_WC_SEND:
+		switch (wc.opcode) {
+		case IBV_WC_SEND:
+			if (qp_type == IBV_QPT_UD)
+				handle_ud_send(&wc);
+			else
 				handle_send(&wc);
-				break;
-			case IBV_WC_RECV:
+			break;
+		case IBV_WC_RECV:
+			if (qp_type == IBV_QPT_UD)
+				handle_ud_recv(&wc);
+			else if (shard)
+				shard->handle_recv(&wc);
+			else
 				handle_recv(&wc);
-				break;
-			default:
-				assert(0 == "bug");
-			}
+			break;
+		case IBV_WC_FETCH_ADD:
+		case IBV_WC_COMP_SWAP:
+			handle_atomic(&wc);
+			break;
+		default:
+			assert(0 == "bug");
 		}
 	}
-	return;
 }
 
 void RDMAStack::cm_event_handler()
 {
 	pthread_testcancel();
-	int rst = 0;
 	struct rdma_cm_event *cm_event = nullptr;
 	while (rdma_get_cm_event(cm_channel, &cm_event) == 0) {
-		std::cout << "got cm event: " << rdma_event_str(cm_event->event) << std::endl;
-		switch (cm_event->event) {
-		case RDMA_CM_EVENT_ADDR_RESOLVED: {
-			rst = rdma_resolve_route(cm_id, 2000);
-			if (rst) {
-				sem_post(&sem);
-			}
-			break;
+		if (!handle_cm_event(cm_event))
+			return;
+	}
+}
+
+void RDMAStack::async_cm_event_handler()
+{
+	struct rdma_event_channel* channel = get_connect_channel();
+	struct pollfd fds[2] = {};
+	fds[0].fd = channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = connect_stop_fd;
+	fds[1].events = POLLIN;
+	while (true) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << __func__ << " poll failed: " << strerror(errno) << std::endl;
+			return;
 		}
+		if (fds[1].revents)
+			return;
+		if (fds[0].revents)
+			process_cm_events(channel);
+	}
+}
+
+void RDMAStack::process_cm_events(struct rdma_event_channel* channel)
+{
+	struct rdma_cm_event *cm_event = nullptr;
+	// the channel is non-blocking, EAGAIN ends the batch
+	while (rdma_get_cm_event(channel, &cm_event) == 0) {
+		handle_cm_event(cm_event);
+	}
+}
 
-		case RDMA_CM_EVENT_ROUTE_RESOLVED:
+bool RDMAStack::handle_cm_event(struct rdma_cm_event* cm_event)
+{
+	if (cm_event->id->context) {
+		struct rdma_cm_id* done_cm_id = handle_connect_event(cm_event);
+		rdma_ack_cm_event(cm_event);
+		if (done_cm_id)
+			rdma_destroy_id(done_cm_id);
+		return true;
+	}
+
+	int rst = 0;
+	bool keep_going = true;
+	struct rdma_cm_id* sidr_cm_id = nullptr;
+	struct rdma_cm_id* closed_cm_id = nullptr;
+	std::cout << "got cm event: " << rdma_event_str(cm_event->event) << std::endl;
+	switch (cm_event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED: {
+		rst = rdma_resolve_route(cm_event->id, 2000);
+		if (rst) {
 			sem_post(&sem);
-			break;
+		}
+		break;
+	}
 
-		case RDMA_CM_EVENT_CONNECT_REQUEST: {
-			struct rdma_cm_id* event_cm_id = cm_event->id;
-			accept(event_cm_id);
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		sem_post(&sem);
+		break;
+
+	case RDMA_CM_EVENT_CONNECT_REQUEST: {
+		struct rdma_cm_id* event_cm_id = cm_event->id;
+		Callback* dispatch = accept_dispatch.load();
+		if (dispatch) {
+			// private data dies with the event, the request keeps a copy
+			accept_request* request = new accept_request();
+			request->cm_id = event_cm_id;
+			request->conn_param = cm_event->param.conn;
+			if (cm_event->param.conn.private_data)
+				request->private_data.assign(static_cast<const char*>(cm_event->param.conn.private_data),
+						cm_event->param.conn.private_data_len);
+			request->conn_param.private_data = request->private_data.data();
+			dispatch->callback_entry(request);
 			break;
 		}
+		accept(event_cm_id, &cm_event->param.conn);
+		if (qp_type == IBV_QPT_UD)
+			sidr_cm_id = event_cm_id;
+		break;
+	}
 
-		case RDMA_CM_EVENT_ESTABLISHED:
-			sem_post(&sem);
-			if (!is_server)
-				return;
-			break;
-		case RDMA_CM_EVENT_ADDR_ERROR:
-		case RDMA_CM_EVENT_ROUTE_ERROR:
-		case RDMA_CM_EVENT_CONNECT_ERROR:
-		case RDMA_CM_EVENT_UNREACHABLE:
-		case RDMA_CM_EVENT_REJECTED: {
-			std::cerr << "cma event: " << rdma_event_str(cm_event->event)
-				<< "error: " << cm_event->status << std::endl;
-			sem_post(&sem);
-			rst = -1;
-			break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		if (qp_type == IBV_QPT_UD && ud_endpoint) {
+			struct rdma_ud_param* ud_param = &cm_event->param.ud;
+			ud_peer = ud_endpoint->add_peer(&ud_param->ah_attr, ud_param->qp_num, ud_param->qkey);
 		}
+		sem_post(&sem);
+		if (!is_server)
+			keep_going = false;
+		break;
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED: {
+		std::cerr << "cma event: " << rdma_event_str(cm_event->event)
+			<< "error: " << cm_event->status << std::endl;
+		sem_post(&sem);
+		rst = -1;
+		break;
+	}
 
-		case RDMA_CM_EVENT_DISCONNECTED:
-			sem_post(&sem);
-			break;
+	case RDMA_CM_EVENT_DISCONNECTED: {
+		uint32_t qp_num = 0;
+		{
+			std::lock_guard<std::mutex> l(accepted_mtx);
+			auto it = accepted_qps.find(cm_event->id);
+			if (it != accepted_qps.end()) {
+				qp_num = it->second;
+				closed_cm_id = cm_event->id;
+				accepted_qps.erase(it);
+			}
+		}
+		if (closed_cm_id)
+			release_connection(closed_cm_id, con_mgr->get_connection(qp_num));
+		sem_post(&sem);
+		break;
+	}
 
-		case RDMA_CM_EVENT_DEVICE_REMOVAL: {
-			std::cout << "cma detect device remove" << std::endl;
-			sem_post(&sem);
-			rst = -1;
-			break;
+	case RDMA_CM_EVENT_DEVICE_REMOVAL: {
+		std::cout << "cma detect device remove" << std::endl;
+		sem_post(&sem);
+		rst = -1;
+		break;
+	}
+
+	default:
+		std::cerr << "ignore unknown event: " << rdma_event_str(cm_event->event) << std::endl;
+		break;
+	}
+	rdma_ack_cm_event(cm_event);
+
+	// a SIDR id holds no state once the reply is sent
+	if (sidr_cm_id) {
+		rdma_destroy_id(sidr_cm_id);
+	}
+	if (closed_cm_id) {
+		rdma_destroy_id(closed_cm_id);
+	}
+	return keep_going;
+}
+
+struct rdma_cm_id* RDMAStack::handle_connect_event(struct rdma_cm_event* cm_event)
+{
+	struct rdma_cm_id* id = cm_event->id;
+	connect_op* op = static_cast<connect_op*>(id->context);
+	if (op == &connected_op) {
+		if (cm_event->event != RDMA_CM_EVENT_DISCONNECTED)
+			return nullptr;
+		// either side hung up, the id goes with the connection
+		release_connection(id, id->qp ? con_mgr->get_connection(id->qp->qp_num) : nullptr);
+		return id;
+	}
+
+	switch (cm_event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		if (op->timing)
+			op->timing->addr_resolved_ns = now_ns();
+		if (rdma_resolve_route(id, 2000) == 0)
+			return nullptr;
+		break;
+
+	case RDMA_CM_EVENT_ROUTE_RESOLVED: {
+		if (op->timing)
+			op->timing->route_resolved_ns = now_ns();
+		con_mgr->start_workers(id->verbs);
+		struct rdma_conn_param cm_params = {};
+		if (qp_type == IBV_QPT_UD) {
+			op->endpoint = con_mgr->assign_ud_endpoint(id);
+			cm_params.qp_num = op->endpoint->get_qp()->qp_num;
+		} else {
+			op->con = connection_establish(id);
+			cm_params.retry_count = 7;
+			set_rd_atomic(id->verbs, &cm_params, nullptr);
+			cm_params.private_data = op->private_data.empty() ? nullptr : op->private_data.data();
+			cm_params.private_data_len = op->private_data.size();
+		}
+		if (op->timing)
+			op->timing->qp_created_ns = now_ns();
+		if (rdma_connect(id, &cm_params) == 0) {
+			if (op->timing)
+				op->timing->connect_sent_ns = now_ns();
+			return nullptr;
 		}
+		break;
+	}
 
-		default:
-			std::cerr << "ignore unknown event: " << rdma_event_str(cm_event->event) << std::endl;
-			break;
+	case RDMA_CM_EVENT_ESTABLISHED: {
+		void* result = op->con;
+		if (qp_type == IBV_QPT_UD) {
+			struct rdma_ud_param* ud_param = &cm_event->param.ud;
+			result = op->endpoint->add_peer(&ud_param->ah_attr, ud_param->qp_num, ud_param->qkey);
 		}
-		rdma_ack_cm_event(cm_event);
-		cm_event = nullptr;
+		id->context = &connected_op;
+		if (op->timing)
+			op->timing->established_ns = now_ns();
+		op->done->callback_entry(result);
+		delete op;
+		// a SIDR id holds no state once resolved
+		return qp_type == IBV_QPT_UD ? id : nullptr;
+	}
+
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		break;
+
+	default:
+		std::cerr << "ignore connecting event: " << rdma_event_str(cm_event->event) << std::endl;
+		return nullptr;
+	}
+
+	std::cerr << "async connect failed on " << rdma_event_str(cm_event->event)
+		<< ", status " << cm_event->status << std::endl;
+	release_connection(id, op->con);
+	op->done->callback_entry(nullptr);
+	delete op;
+	return id;
+}
+
+void RDMAStack::set_reactor(Reactor* reactor)
+{
+	assert(!this->reactor && reactor);
+	this->reactor = reactor;
+	cm_ready = new CMReadyCallback(this);
+	cq_ready = new CQReadyCallback(this);
+	// a server listening before the reactor was set
+	if (cm_channel)
+		watch_cm_channel(cm_channel);
+}
+
+Reactor* RDMAStack::get_reactor() const
+{
+	return reactor;
+}
+
+void RDMAStack::watch_cm_channel(struct rdma_event_channel* channel)
+{
+	int flags = fcntl(channel->fd, F_GETFL);
+	fcntl(channel->fd, F_SETFL, flags | O_NONBLOCK);
+	std::lock_guard<std::mutex> l(reactor_mtx);
+	reactor->add(channel->fd, EPOLLIN, cm_ready, channel);
+	reactor_fds.push_back(channel->fd);
+}
+
+void RDMAStack::watch_cq_worker(CQThread* worker)
+{
+	std::lock_guard<std::mutex> l(reactor_mtx);
+	reactor->add(worker->get_epoll_fd(), EPOLLIN, cq_ready, worker);
+	reactor_fds.push_back(worker->get_epoll_fd());
+	// no CQ event may follow the strand of a retired connection going idle
+	if (executor)
+		reactor_fds.push_back(reactor->add_timer(RECLAIM_RETRY_MS * 1000, RECLAIM_RETRY_MS * 1000, cq_ready, worker));
+}
+
+RDMAConnection* RDMAStack::connection_establish(struct rdma_cm_id* cm_id, const struct rdma_conn_param* accept_params)
+{
+  RDMAConnection* con = con_mgr->new_connection(cm_id, accept_params);
+  if (con) {
+    std::lock_guard<std::mutex> l(live_mtx);
+    live_connections.insert(con);
+  }
+  return con;
+}
+
+void RDMAStack::load_transfer_profile()
+{
+	const char* path = getenv("RDMA_TRANSFER_PROFILE");
+	if (!path)
+		path = TRANSFER_PROFILE_PATH;
+	if (transfer_profile.load(path)) {
+		std::cout << "transfer profile " << path << " loaded" << std::endl;
 	}
 }
 
-RDMAConnection* RDMAStack::connection_establish(struct rdma_cm_id* cm_id)
+void RDMAStack::set_worker_nums(uint32_t worker_nums)
+{
+	con_mgr->set_worker_nums(worker_nums);
+}
+
+void RDMAStack::set_worker_cpus(const std::vector<int>& worker_cpus)
+{
+	con_mgr->set_worker_cpus(worker_cpus);
+}
+
+void RDMAStack::set_app_cpus(const std::vector<int>& app_cpus)
 {
-  return con_mgr->new_connection(cm_id);
+	con_mgr->set_app_cpus(app_cpus);
+}
+
+void RDMAStack::set_placement_policy(PlacementPolicy* placement)
+{
+	con_mgr->set_placement_policy(placement);
+}
+
+void RDMAStack::set_rebalance(uint32_t spread_percent)
+{
+	con_mgr->set_rebalance(spread_percent);
+}
+
+void RDMAStack::set_thread_per_core(bool thread_per_core)
+{
+	con_mgr->set_thread_per_core(thread_per_core);
+}
+
+void RDMAStack::set_qp_pool(uint32_t depth)
+{
+	con_mgr->set_qp_pool(depth);
+}
+
+std::vector<uint64_t> RDMAStack::get_worker_cpu_ns()
+{
+	return con_mgr->get_worker_cpu_ns();
+}
+
+void RDMAStack::set_executor(uint32_t thread_nums, const std::vector<int>& cpus)
+{
+	assert(!executor);
+	if (thread_nums)
+		executor = new Executor(thread_nums, cpus);
+}
+
+const TransferProfile& RDMAStack::get_transfer_profile() const
+{
+	return transfer_profile;
 }
 
 void RDMAStack::set_accept_callback(Callback *accept_callback)
@@ -293,7 +1364,128 @@ void RDMAStack::set_accept_callback(Callback *accept_callback)
 	this->accept_callback = accept_callback;
 }
 
-void RDMAStack::set_connect_callback(Callback *connect_callback_)
+void RDMAStack::set_connect_private_data(const void* private_data, uint8_t private_data_len)
+{
+	connect_private_data = private_data;
+	connect_private_len = private_data_len;
+}
+
+void RDMAStack::set_connect_callback(Callback *connect_callback)
 {
 	this->connect_callback = connect_callback;
 }
+
+ibv_qp_type RDMAStack::get_qp_type() const
+{
+	return qp_type;
+}
+
+CQThread::CQThread(RDMAStack *rdma_stack, WorkerLoad *load) : rdma_stack(rdma_stack), load(load)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+}
+
+CQThread::~CQThread()
+{
+	::close(event_fd);
+	::close(epoll_fd);
+}
+
+void CQThread::attach(cq_source* source)
+{
+	post_command({source, nullptr, true});
+}
+
+void CQThread::detach(cq_source* source, CQThread* to)
+{
+	post_command({source, to, false});
+}
+
+void CQThread::post_command(const cq_command& command)
+{
+	{
+		std::lock_guard<std::mutex> l(cmd_mtx);
+		commands.push_back(command);
+	}
+	wake();
+}
+
+void CQThread::wake()
+{
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+		std::cerr << __func__ << " failed to wake CQ worker" << std::endl;
+	}
+}
+
+void CQThread::set_shard(CoreShard* shard)
+{
+	this->shard = shard;
+}
+
+CoreShard* CQThread::get_shard() const
+{
+	return shard;
+}
+
+registry_reader* CQThread::get_reader() const
+{
+	return reader;
+}
+
+void CQThread::set_reader(registry_reader* reader)
+{
+	this->reader = reader;
+}
+
+void CQThread::run_commands()
+{
+	uint64_t value = 0;
+	if (read(event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		std::cerr << __func__ << " failed to read eventfd" << std::endl;
+	}
+	std::vector<cq_command> batch;
+	{
+		std::lock_guard<std::mutex> l(cmd_mtx);
+		batch.swap(commands);
+	}
+
+	for (auto& command : batch) {
+		cq_source* source = command.source;
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.ptr = source;
+		if (command.attach) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->cq_channel->fd, &ev);
+			// completions that arrived while nobody watched the CQ
+			rdma_stack->poll_cq_source(source, this);
+			source->moving.store(false);
+			continue;
+		}
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->cq_channel->fd, &ev) && errno == ENOENT && source->moving.load()) {
+			// released while its move to this worker is still in flight
+			post_command(command);
+			continue;
+		}
+		if (command.to)
+			command.to->attach(source);
+		else
+			source->put();
+	}
+}
+
+int CQThread::get_epoll_fd() const
+{
+	return epoll_fd;
+}
+
+WorkerLoad* CQThread::get_load() const
+{
+	return load;
+}
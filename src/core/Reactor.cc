@@ -0,0 +1,181 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <iostream>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/Reactor.h"
+
+Reactor::Reactor()
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = stop_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+}
+
+Reactor::~Reactor()
+{
+	for (auto& it : handlers) {
+		if (it.second.kind != REACTOR_FD)
+			::close(it.first);
+	}
+	::close(stop_fd);
+	::close(epoll_fd);
+}
+
+int Reactor::get_fd() const
+{
+	return epoll_fd;
+}
+
+int Reactor::add_handler(int fd, uint32_t events, reactor_kind kind, Callback* handler, void* param)
+{
+	{
+		std::lock_guard<std::mutex> l(handler_mtx);
+		handlers[fd] = {kind, handler, param};
+	}
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		std::cerr << __func__ << " failed to watch fd " << fd << ": " << strerror(errno) << std::endl;
+		std::lock_guard<std::mutex> l(handler_mtx);
+		handlers.erase(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void Reactor::add(int fd, uint32_t events, Callback* handler, void* param)
+{
+	add_handler(fd, events, REACTOR_FD, handler, param);
+}
+
+void Reactor::del(int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	std::lock_guard<std::mutex> l(handler_mtx);
+	auto it = handlers.find(fd);
+	if (it == handlers.end())
+		return;
+	// timers and events are ours to close
+	if (it->second.kind != REACTOR_FD)
+		::close(fd);
+	handlers.erase(it);
+}
+
+int Reactor::add_timer(uint64_t delay_us, uint64_t interval_us, Callback* handler, void* param)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	// an all-zero it_value disarms the timer, fire right away instead
+	delay_us = delay_us ? delay_us : 1;
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = delay_us / 1000000;
+	spec.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+	spec.it_interval.tv_sec = interval_us / 1000000;
+	spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+	timerfd_settime(fd, 0, &spec, nullptr);
+	if (add_handler(fd, EPOLLIN, REACTOR_TIMER, handler, param) < 0) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int Reactor::add_event(Callback* handler, void* param)
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (add_handler(fd, EPOLLIN, REACTOR_EVENT, handler, param) < 0) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void Reactor::notify(int event_fd)
+{
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+		std::cerr << __func__ << " failed to notify reactor" << std::endl;
+	}
+}
+
+int Reactor::run_once(int timeout_ms)
+{
+	struct epoll_event events[REACTOR_EPOLL_EVENTS];
+	int n = epoll_wait(epoll_fd, events, REACTOR_EPOLL_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (errno != EINTR)
+			std::cerr << __func__ << " epoll_wait failed: " << strerror(errno) << std::endl;
+		return 0;
+	}
+
+	int handled = 0;
+	for (int i = 0; i < n; ++i) {
+		int fd = events[i].data.fd;
+		if (fd == stop_fd) {
+			uint64_t count = 0;
+			if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				std::cerr << __func__ << " failed to read eventfd" << std::endl;
+			continue;
+		}
+		reactor_handler entry;
+		{
+			// an earlier handler of this batch may have removed it
+			std::lock_guard<std::mutex> l(handler_mtx);
+			auto it = handlers.find(fd);
+			if (it == handlers.end())
+				continue;
+			entry = it->second;
+		}
+		if (entry.kind != REACTOR_FD) {
+			uint64_t count = 0;
+			if (read(fd, &count, sizeof(count)) != sizeof(count))
+				continue;
+		}
+		uint32_t ready = events[i].events;
+		entry.handler->callback_entry(entry.param, &ready);
+		handled++;
+	}
+	return handled;
+}
+
+void Reactor::run()
+{
+	while (!stopped.load())
+		run_once(-1);
+}
+
+void Reactor::stop()
+{
+	stopped.store(true);
+	notify(stop_fd);
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "rdma_messenger/ReliableUD.h"
+
+static uint64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// wrap-around safe "a is before b"
+static inline bool seq_before(uint32_t a, uint32_t b)
+{
+	return static_cast<int32_t>(a - b) < 0;
+}
+
+void RUDTimerThread::entry()
+{
+	while (!rud->is_stopped()) {
+		usleep(RUD_TICK_US);
+		rud->timer_tick();
+	}
+}
+
+ReliableUD::ReliableUD() : stop(false)
+{
+	timer_thread = new RUDTimerThread(this);
+	timer_thread->start();
+}
+
+ReliableUD::~ReliableUD()
+{
+	stop.store(true);
+	timer_thread->join();
+	delete timer_thread;
+	timer_thread = nullptr;
+
+	for (auto& con : connections) {
+		shut(con.second.get());
+	}
+	connections.clear();
+
+	for (auto seg : free_segments) {
+		delete seg;
+	}
+	free_segments.clear();
+}
+
+RUDConnection* ReliableUD::attach(UDPeer* peer)
+{
+	std::lock_guard<std::mutex> l(con_map_mtx);
+	std::shared_ptr<RUDConnection> con = std::make_shared<RUDConnection>(peer, channel_number++);
+	connections.insert(std::make_pair(RUDKey{peer, con->channel}, con));
+	return con.get();
+}
+
+void ReliableUD::close(RUDConnection* con)
+{
+	// a receive in progress keeps its own reference until it is done
+	std::shared_ptr<RUDConnection> owner;
+	{
+		std::lock_guard<std::mutex> l(con_map_mtx);
+		auto it = connections.find(RUDKey{con->peer, con->channel});
+		if (it == connections.end())
+			return;
+		owner = it->second;
+		connections.erase(it);
+		closed.insert(RUDKey{con->peer, con->channel});
+	}
+	std::lock_guard<std::mutex> l(owner->con_mtx);
+	// no reset back to a peer that reset the channel first
+	if (owner->state == ACTIVE)
+		send_reset(owner->peer, owner->channel);
+	shut(owner.get());
+}
+
+void ReliableUD::close(UDPeer* peer)
+{
+	std::vector<std::shared_ptr<RUDConnection>> owners;
+	{
+		std::lock_guard<std::mutex> l(con_map_mtx);
+		auto it = connections.begin();
+		while (it != connections.end()) {
+			if (it->first.peer == peer) {
+				owners.push_back(it->second);
+				it = connections.erase(it);
+			} else {
+				++it;
+			}
+		}
+		auto closed_it = closed.begin();
+		while (closed_it != closed.end()) {
+			if (closed_it->peer == peer)
+				closed_it = closed.erase(closed_it);
+			else
+				++closed_it;
+		}
+	}
+	for (auto& owner : owners) {
+		std::lock_guard<std::mutex> l(owner->con_mtx);
+		if (owner->state == ACTIVE)
+			send_reset(owner->peer, owner->channel);
+		shut(owner.get());
+	}
+}
+
+std::shared_ptr<RUDConnection> ReliableUD::lookup(UDPeer* peer, uint32_t channel, bool create)
+{
+	std::lock_guard<std::mutex> l(con_map_mtx);
+	auto it = connections.find(RUDKey{peer, channel});
+	if (it != connections.end())
+		return it->second;
+	// a late segment must not bring a closed channel back
+	if (!create || closed.count(RUDKey{peer, channel}))
+		return nullptr;
+
+	std::shared_ptr<RUDConnection> con = std::make_shared<RUDConnection>(peer, channel);
+	connections.insert(std::make_pair(RUDKey{peer, channel}, con));
+	return con;
+}
+
+void ReliableUD::reset(UDPeer* peer, uint32_t channel)
+{
+	std::shared_ptr<RUDConnection> owner = lookup(peer, channel, false);
+	if (!owner)
+		return;
+	std::lock_guard<std::mutex> l(owner->con_mtx);
+	if (owner->state == ACTIVE)
+		shut(owner.get());
+}
+
+void ReliableUD::send_reset(UDPeer* peer, uint32_t channel)
+{
+	rud_header hdr = {};
+	hdr.type = RUD_RESET;
+	hdr.channel = channel;
+	peer->endpoint->async_send(peer, reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+}
+
+uint32_t ReliableUD::max_msg_size(RUDConnection* con) const
+{
+	uint32_t mtu = con->peer->endpoint->get_mtu();
+	if (mtu > RUD_SEGMENT_SIZE)
+		mtu = RUD_SEGMENT_SIZE;
+	return mtu - sizeof(rud_header);
+}
+
+void ReliableUD::async_send(RUDConnection* con, const char* raw_msg, uint32_t raw_msg_size)
+{
+	assert(raw_msg_size <= max_msg_size(con));
+	RUDSegment* seg = alloc_segment();
+	memcpy(seg->buf + sizeof(rud_header), raw_msg, raw_msg_size);
+	seg->len = raw_msg_size;
+	seg->next = nullptr;
+
+	std::lock_guard<std::mutex> l(con->con_mtx);
+	if (con->state != ACTIVE) {
+		free_segment(seg);
+		return;
+	}
+	if (con->pending_tail)
+		con->pending_tail->next = seg;
+	else
+		con->pending_head = seg;
+	con->pending_tail = seg;
+	flush(con);
+}
+
+void ReliableUD::callback_entry(void* param, void* msg)
+{
+	UDPeer* peer = static_cast<UDPeer*>(param);
+	Chunk* ck = static_cast<Chunk*>(msg);
+	if (ck->chk_size < sizeof(rud_header))
+		return;
+
+	const rud_header* hdr = reinterpret_cast<const rud_header*>(ck->chk_buf);
+	if (hdr->type == RUD_RESET) {
+		reset(peer, hdr->channel);
+		return;
+	}
+	std::shared_ptr<RUDConnection> owner = lookup(peer, hdr->channel, hdr->type == RUD_DATA);
+	if (!owner) {
+		// data of a channel closed here: the reset got lost, repeat it
+		if (hdr->type == RUD_DATA)
+			send_reset(peer, hdr->channel);
+		return;
+	}
+	RUDConnection* con = owner.get();
+
+	const char* payload = ck->chk_buf + sizeof(rud_header);
+	uint32_t len = ck->chk_size - sizeof(rud_header);
+	std::vector<RUDSegment*> deliver;
+	bool deliver_self = false;
+	{
+		std::lock_guard<std::mutex> l(con->con_mtx);
+		if (con->state != ACTIVE)
+			return;
+		handle_ack(con, hdr);
+		if (hdr->type == RUD_DATA)
+			handle_data(con, hdr, payload, len, deliver, deliver_self);
+		flush(con);
+	}
+
+	// one CQ thread serves a peer, so delivery outside the lock stays in order
+	if (read_callback) {
+		if (deliver_self) {
+			Chunk view(ck->mr, const_cast<char*>(payload), len);
+			read_callback->callback_entry(con, &view);
+		}
+		for (auto seg : deliver) {
+			Chunk view(nullptr, seg->buf + sizeof(rud_header), seg->len);
+			read_callback->callback_entry(con, &view);
+		}
+	}
+	for (auto seg : deliver) {
+		free_segment(seg);
+	}
+}
+
+void ReliableUD::handle_ack(RUDConnection* con, const rud_header* hdr)
+{
+	uint32_t ack = hdr->ack;
+	bool advanced = false;
+	uint64_t now = now_us();
+
+	while (con->inflight_head && seq_before(con->inflight_head->seq, ack)) {
+		RUDSegment* seg = con->inflight_head;
+		con->inflight_head = seg->next;
+		con->inflight_nums--;
+		// Karn: only first transmissions give a usable rtt sample
+		if (seg->retries == 0)
+			update_rtt(con, now - seg->send_ts);
+		free_segment(seg);
+		advanced = true;
+
+		if (con->cwnd < con->ssthresh) {
+			con->cwnd++;
+		} else if (++con->cwnd_acc >= con->cwnd) {
+			con->cwnd_acc = 0;
+			con->cwnd++;
+		}
+		if (con->cwnd > RUD_WINDOW_MAX)
+			con->cwnd = RUD_WINDOW_MAX;
+	}
+	if (!con->inflight_head)
+		con->inflight_tail = nullptr;
+	if (seq_before(con->una, ack))
+		con->una = ack;
+	con->peer_window = hdr->window;
+
+	bool hole = false;
+	for (RUDSegment* seg = con->inflight_head; seg; seg = seg->next) {
+		uint32_t off = seg->seq - ack - 1;
+		if (seg->seq != ack && off < RUD_WINDOW_MAX && ((hdr->sack >> off) & 1)) {
+			seg->sacked = true;
+			hole = true;
+		}
+	}
+
+	if (advanced) {
+		con->dup_acks = 0;
+		return;
+	}
+	if (hdr->type != RUD_ACK || !con->inflight_head)
+		return;
+
+	// fast retransmit of the first hole
+	RUDSegment* head = con->inflight_head;
+	if (++con->dup_acks == RUD_DUP_ACK_THRESH || (hole && head->retries == 0)) {
+		con->ssthresh = con->cwnd / 2 > 2 ? con->cwnd / 2 : 2;
+		con->cwnd = con->ssthresh;
+		con->cwnd_acc = 0;
+		head->retries++;
+		con->retransmits++;
+		transmit(con, head);
+	}
+}
+
+void ReliableUD::handle_data(RUDConnection* con, const rud_header* hdr, const char* payload, uint32_t len,
+		std::vector<RUDSegment*>& deliver, bool& deliver_self)
+{
+	uint32_t seq = hdr->seq;
+	con->ack_pending++;
+
+	if (seq == con->expected_seq) {
+		deliver_self = true;
+		con->expected_seq++;
+		con->sack >>= 1;
+		while (con->ooo_head && con->ooo_head->seq == con->expected_seq) {
+			RUDSegment* seg = con->ooo_head;
+			con->ooo_head = seg->next;
+			con->ooo_nums--;
+			deliver.push_back(seg);
+			con->expected_seq++;
+			con->sack >>= 1;
+		}
+		if (con->ack_pending >= RUD_ACK_EVERY || !deliver.empty())
+			send_ack(con);
+		else
+			arm_timer(con, now_us() + RUD_TICK_US);
+		return;
+	}
+
+	if (seq_before(seq, con->expected_seq)) {
+		// duplicate, our previous ack got lost
+		send_ack(con);
+		return;
+	}
+
+	uint32_t off = seq - con->expected_seq - 1;
+	if (off >= RUD_WINDOW_MAX)
+		return;
+
+	if (!((con->sack >> off) & 1)) {
+		RUDSegment* seg = alloc_segment();
+		seg->seq = seq;
+		seg->len = len;
+		memcpy(seg->buf + sizeof(rud_header), payload, len);
+
+		RUDSegment** pos = &con->ooo_head;
+		while (*pos && seq_before((*pos)->seq, seq))
+			pos = &(*pos)->next;
+		seg->next = *pos;
+		*pos = seg;
+
+		con->sack |= 1ULL << off;
+		con->ooo_nums++;
+	}
+	// out of order: ack at once so the sender learns about the hole
+	send_ack(con);
+}
+
+void ReliableUD::flush(RUDConnection* con)
+{
+	uint32_t limit = con->cwnd;
+	if (con->peer_window < limit)
+		limit = con->peer_window;
+	// keep one probe in flight so a closed window reopens
+	if (limit == 0)
+		limit = 1;
+
+	while (con->pending_head && con->inflight_nums < limit) {
+		RUDSegment* seg = con->pending_head;
+		con->pending_head = seg->next;
+		if (!con->pending_head)
+			con->pending_tail = nullptr;
+
+		seg->next = nullptr;
+		seg->seq = con->next_seq++;
+		seg->retries = 0;
+		seg->sacked = false;
+		if (con->inflight_tail)
+			con->inflight_tail->next = seg;
+		else
+			con->inflight_head = seg;
+		con->inflight_tail = seg;
+		con->inflight_nums++;
+		transmit(con, seg);
+	}
+}
+
+void ReliableUD::fill_header(RUDConnection* con, rud_header* hdr, uint8_t type, uint32_t seq)
+{
+	hdr->type = type;
+	hdr->window = RUD_WINDOW_MAX - con->ooo_nums;
+	hdr->reserved = 0;
+	hdr->channel = con->channel;
+	hdr->seq = seq;
+	hdr->ack = con->expected_seq;
+	hdr->sack = con->sack;
+	con->ack_pending = 0;
+}
+
+void ReliableUD::transmit(RUDConnection* con, RUDSegment* seg)
+{
+	fill_header(con, reinterpret_cast<rud_header*>(seg->buf), RUD_DATA, seg->seq);
+	seg->send_ts = now_us();
+	arm_timer(con, seg->send_ts + con->rto_us);
+	// a failed post is just a drop, the retransmission timer recovers it
+	con->peer->endpoint->async_send(con->peer, seg->buf, sizeof(rud_header) + seg->len);
+}
+
+void ReliableUD::send_ack(RUDConnection* con)
+{
+	rud_header hdr;
+	fill_header(con, &hdr, RUD_ACK, 0);
+	con->peer->endpoint->async_send(con->peer, reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+}
+
+void ReliableUD::update_rtt(RUDConnection* con, uint64_t sample_us)
+{
+	uint32_t sample = sample_us > RUD_MAX_RTO_US ? RUD_MAX_RTO_US : sample_us;
+	if (con->srtt_us == 0) {
+		con->srtt_us = sample;
+		con->rttvar_us = sample / 2;
+	} else {
+		uint32_t delta = con->srtt_us > sample ? con->srtt_us - sample : sample - con->srtt_us;
+		con->rttvar_us = (3 * con->rttvar_us + delta) / 4;
+		con->srtt_us = (7 * con->srtt_us + sample) / 8;
+	}
+	uint32_t rto = con->srtt_us + 4 * con->rttvar_us;
+	con->rto_us = rto < RUD_MIN_RTO_US ? RUD_MIN_RTO_US : rto > RUD_MAX_RTO_US ? RUD_MAX_RTO_US : rto;
+}
+
+void ReliableUD::arm_timer(RUDConnection* con, uint64_t deadline_us)
+{
+	// an earlier entry fires first and rearms for whatever is left
+	if (con->timer_deadline_us && con->timer_deadline_us <= deadline_us)
+		return;
+	con->timer_deadline_us = deadline_us;
+	std::lock_guard<std::mutex> l(timer_mtx);
+	timers.push(RUDTimer{deadline_us, con->shared_from_this()});
+}
+
+void ReliableUD::timer_tick()
+{
+	uint64_t now = now_us();
+	std::vector<RUDTimer> due;
+	{
+		std::lock_guard<std::mutex> l(timer_mtx);
+		while (!timers.empty() && timers.top().deadline_us <= now) {
+			due.push_back(timers.top());
+			timers.pop();
+		}
+	}
+
+	for (auto& timer : due) {
+		std::shared_ptr<RUDConnection> con = timer.con.lock();
+		if (!con)
+			continue;
+		std::lock_guard<std::mutex> l(con->con_mtx);
+		if (con->state != ACTIVE || con->timer_deadline_us != timer.deadline_us)
+			continue;
+		con->timer_deadline_us = 0;
+		expire(con.get(), now);
+	}
+}
+
+void ReliableUD::expire(RUDConnection* con, uint64_t now)
+{
+	bool timed_out = false;
+	for (RUDSegment* seg = con->inflight_head; seg; seg = seg->next) {
+		if (seg->sacked)
+			continue;
+		// the rto may have grown since the entry was pushed
+		if (now - seg->send_ts < con->rto_us) {
+			arm_timer(con, seg->send_ts + con->rto_us);
+			continue;
+		}
+		if (seg->retries >= RUD_MAX_RETRIES) {
+			fail(con);
+			return;
+		}
+		seg->retries++;
+		con->retransmits++;
+		timed_out = true;
+		transmit(con, seg);
+	}
+
+	if (timed_out) {
+		con->ssthresh = con->cwnd / 2 > 2 ? con->cwnd / 2 : 2;
+		con->cwnd = 1;
+		con->cwnd_acc = 0;
+		con->dup_acks = 0;
+		con->rto_us = con->rto_us * 2 > RUD_MAX_RTO_US ? RUD_MAX_RTO_US : con->rto_us * 2;
+	}
+	// delayed ack
+	if (con->ack_pending)
+		send_ack(con);
+	flush(con);
+}
+
+void ReliableUD::shut(RUDConnection* con)
+{
+	// closed on purpose, not given up
+	con->state = CLOSE;
+	fail(con);
+}
+
+void ReliableUD::fail(RUDConnection* con)
+{
+	if (con->state == ACTIVE) {
+		std::cerr << "reliable ud channel " << con->channel << " peer " << con->peer->peer_id
+			<< " gave up after " << RUD_MAX_RETRIES << " retries" << std::endl;
+	}
+	con->state = CLOSE;
+
+	RUDSegment* lists[] = {con->inflight_head, con->pending_head, con->ooo_head};
+	for (auto seg : lists) {
+		while (seg) {
+			RUDSegment* next = seg->next;
+			free_segment(seg);
+			seg = next;
+		}
+	}
+	con->inflight_head = con->inflight_tail = nullptr;
+	con->pending_head = con->pending_tail = nullptr;
+	con->ooo_head = nullptr;
+	con->inflight_nums = 0;
+	con->ooo_nums = 0;
+	// entries still in the heap no longer match and are dropped
+	con->timer_deadline_us = 0;
+}
+
+bool ReliableUD::is_stopped() const
+{
+	return stop.load();
+}
+
+void ReliableUD::set_read_callback(Callback* read_callback)
+{
+	this->read_callback = read_callback;
+}
+
+size_t ReliableUD::get_connection_nums()
+{
+	std::lock_guard<std::mutex> l(con_map_mtx);
+	return connections.size();
+}
+
+size_t ReliableUD::get_segment_nums()
+{
+	std::lock_guard<std::mutex> l(seg_mtx);
+	return segment_nums;
+}
+
+uint64_t ReliableUD::get_retransmits()
+{
+	uint64_t retransmits = 0;
+	std::lock_guard<std::mutex> l(con_map_mtx);
+	for (auto& con : connections) {
+		retransmits += con.second->retransmits;
+	}
+	return retransmits;
+}
+
+RUDSegment* ReliableUD::alloc_segment()
+{
+	std::lock_guard<std::mutex> l(seg_mtx);
+	if (free_segments.empty()) {
+		segment_nums++;
+		return new RUDSegment();
+	}
+	RUDSegment* seg = free_segments.back();
+	free_segments.pop_back();
+	return seg;
+}
+
+void ReliableUD::free_segment(RUDSegment* seg)
+{
+	std::lock_guard<std::mutex> l(seg_mtx);
+	free_segments.push_back(seg);
+}
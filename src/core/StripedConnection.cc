@@ -0,0 +1,208 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <iostream>
+
+#include "rdma_messenger/StripedConnection.h"
+
+uint64_t stripe_group_id()
+{
+	static std::atomic<uint64_t> counter(0);
+	std::random_device rd;
+	uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+	seed ^= std::chrono::steady_clock::now().time_since_epoch().count();
+	return seed ^ (static_cast<uint64_t>(getpid()) << 40) ^ counter.fetch_add(1);
+}
+
+RDMAStripedConnection::RDMAStripedConnection(uint64_t group_id, uint32_t lane_nums) :
+	group_id(group_id), lane_nums(lane_nums), lanes(lane_nums, nullptr), ready_lanes(0), rr_counter(0)
+{
+	assert(lane_nums > 0 && lane_nums <= STRIPE_LANES_MAX);
+}
+
+RDMAStripedConnection::~RDMAStripedConnection()
+{}
+
+void RDMAStripedConnection::add_lane(RDMAConnection* con, uint32_t lane)
+{
+	assert(lane < lane_nums);
+	assert(lanes[lane] == nullptr);
+	lanes[lane] = con;
+	con->set_read_callback(this);
+	ready_lanes.fetch_add(1);
+}
+
+bool RDMAStripedConnection::is_complete()
+{
+	return ready_lanes.load() == lane_nums;
+}
+
+stripe_private_data RDMAStripedConnection::private_data(uint32_t lane) const
+{
+	stripe_private_data pdata = {};
+	pdata.magic = STRIPE_MAGIC;
+	pdata.lane = lane;
+	pdata.lanes = lane_nums;
+	pdata.group_id = group_id;
+	return pdata;
+}
+
+uint32_t RDMAStripedConnection::pick_lane(uint64_t flow_key)
+{
+	if (policy == STRIPE_FLOW_HASH)
+		return std::hash<uint64_t>()(flow_key) % lane_nums;
+	return rr_counter.fetch_add(1, std::memory_order_relaxed) % lane_nums;
+}
+
+uint32_t RDMAStripedConnection::next_seq(uint64_t flow_key)
+{
+	std::lock_guard<std::mutex> l(send_mtx);
+	return send_seqs[flow_key]++;
+}
+
+void RDMAStripedConnection::async_send(const char* raw_msg, uint32_t raw_msg_size, uint64_t flow_key)
+{
+	assert(is_complete());
+	stripe_header hdr = {};
+	hdr.flow_key = flow_key;
+	// a hashed flow always rides one RC lane and is ordered by the QP itself
+	if (ordered && policy == STRIPE_ROUND_ROBIN) {
+		hdr.flags = STRIPE_ORDERED;
+		hdr.seq = next_seq(flow_key);
+	}
+	lanes[pick_lane(flow_key)]->async_send(reinterpret_cast<const char*>(&hdr), sizeof(hdr), raw_msg, raw_msg_size);
+}
+
+stripe_flow* RDMAStripedConnection::get_flow(uint64_t flow_key)
+{
+	std::lock_guard<std::mutex> l(recv_mtx);
+	std::unique_ptr<stripe_flow>& flow = recv_flows[flow_key];
+	if (!flow)
+		flow.reset(new stripe_flow());
+	return flow.get();
+}
+
+void RDMAStripedConnection::deliver(const char* buf, uint32_t len)
+{
+	if (!read_callback)
+		return;
+	Chunk view(nullptr, const_cast<char*>(buf), len);
+	read_callback->callback_entry(this, &view);
+}
+
+void RDMAStripedConnection::callback_entry(void* param, void* msg)
+{
+	Chunk* ck = static_cast<Chunk*>(msg);
+	if (ck->chk_size < sizeof(stripe_header))
+		return;
+	stripe_header hdr;
+	memcpy(&hdr, ck->chk_buf, sizeof(hdr));
+	const char* payload = ck->chk_buf + sizeof(stripe_header);
+	uint32_t len = ck->chk_size - sizeof(stripe_header);
+
+	if (!(hdr.flags & STRIPE_ORDERED)) {
+		deliver(payload, len);
+		return;
+	}
+
+	// lanes complete on different CQ threads, the flow lock serializes delivery
+	stripe_flow* flow = get_flow(hdr.flow_key);
+	std::lock_guard<std::mutex> l(flow->flow_mtx);
+	uint32_t seq = hdr.seq;
+	if (seq != flow->expected_seq) {
+		flow->parked.insert(std::make_pair(seq, std::string(payload, len)));
+		return;
+	}
+
+	deliver(payload, len);
+	flow->expected_seq++;
+	auto it = flow->parked.begin();
+	while (it != flow->parked.end() && it->first == flow->expected_seq) {
+		deliver(it->second.data(), it->second.size());
+		flow->expected_seq++;
+		it = flow->parked.erase(it);
+	}
+}
+
+void RDMAStripedConnection::set_policy(stripe_policy policy)
+{
+	this->policy = policy;
+}
+
+void RDMAStripedConnection::set_ordered(bool ordered)
+{
+	this->ordered = ordered;
+}
+
+void RDMAStripedConnection::set_read_callback(Callback* read_callback)
+{
+	this->read_callback = read_callback;
+}
+
+uint64_t RDMAStripedConnection::get_group_id() const
+{
+	return group_id;
+}
+
+uint32_t RDMAStripedConnection::get_lane_nums() const
+{
+	return lane_nums;
+}
+
+RDMAConnection* RDMAStripedConnection::get_lane(uint32_t lane) const
+{
+	return lanes[lane];
+}
+
+void StripedAcceptCallback::callback_entry(void* param, void* msg)
+{
+	RDMAConnection* con = static_cast<RDMAConnection*>(param);
+	struct rdma_conn_param* conn_param = static_cast<struct rdma_conn_param*>(msg);
+
+	stripe_private_data pdata = {};
+	if (conn_param && conn_param->private_data && conn_param->private_data_len >= sizeof(pdata))
+		memcpy(&pdata, conn_param->private_data, sizeof(pdata));
+	if (pdata.magic != STRIPE_MAGIC || pdata.lane >= pdata.lanes || pdata.lanes > STRIPE_LANES_MAX) {
+		if (plain_callback)
+			plain_callback->callback_entry(con, msg);
+		return;
+	}
+
+	uint64_t group_id = pdata.group_id;
+	RDMAStripedConnection* group = nullptr;
+	{
+		std::lock_guard<std::mutex> l(group_mtx);
+		auto it = pending_groups.find(group_id);
+		if (it == pending_groups.end()) {
+			group = new RDMAStripedConnection(group_id, pdata.lanes);
+			pending_groups.insert(std::make_pair(group_id, group));
+		} else {
+			group = it->second;
+		}
+		group->add_lane(con, pdata.lane);
+		if (!group->is_complete())
+			return;
+		pending_groups.erase(group_id);
+	}
+
+	if (striped_callback)
+		striped_callback->callback_entry(group);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/TransferProfile.h"
+
+static const struct {
+	transfer_strategy strategy;
+	const char* name;
+} strategy_names[] = {
+	{TRANSFER_INLINE, "inline"},
+	{TRANSFER_COPY, "copy"},
+	{TRANSFER_ZERO_COPY, "zero_copy"},
+	{TRANSFER_WRITE_IMM, "write_imm"},
+	{TRANSFER_READ_RENDEZVOUS, "read_rendezvous"},
+};
+
+const char* transfer_strategy_name(transfer_strategy strategy)
+{
+	for (auto& s : strategy_names) {
+		if (s.strategy == strategy)
+			return s.name;
+	}
+	return "unknown";
+}
+
+bool transfer_strategy_parse(const std::string& name, transfer_strategy* strategy)
+{
+	for (auto& s : strategy_names) {
+		if (name == s.name) {
+			*strategy = s.strategy;
+			return true;
+		}
+	}
+	return false;
+}
+
+TransferProfile::TransferProfile()
+{
+	// hand-tuned fallback when no calibrated profile exists
+	ranges.push_back({TRANSFER_INLINE_DEFAULT, TRANSFER_INLINE});
+	ranges.push_back({UINT32_MAX, TRANSFER_COPY});
+}
+
+bool TransferProfile::load(const std::string& path)
+{
+	std::ifstream in(path);
+	if (!in)
+		return false;
+
+	std::vector<transfer_range> loaded;
+	std::string line;
+	uint32_t line_nr = 0;
+	while (std::getline(in, line)) {
+		line_nr++;
+		std::stringstream ss(line);
+		std::string key, value;
+		if (!(ss >> key) || key[0] == '#')
+			continue;
+		if (!(ss >> value)) {
+			std::cerr << path << ":" << line_nr << " missing value" << std::endl;
+			return false;
+		}
+		if (key == "device") {
+			device = value;
+			continue;
+		}
+		transfer_strategy strategy;
+		if (!transfer_strategy_parse(key, &strategy)) {
+			std::cerr << path << ":" << line_nr << " unknown strategy " << key << std::endl;
+			return false;
+		}
+		uint64_t max_size = strtoull(value.c_str(), nullptr, 0);
+		if (max_size > UINT32_MAX)
+			max_size = UINT32_MAX;
+		if (!loaded.empty() && max_size <= loaded.back().max_size) {
+			std::cerr << path << ":" << line_nr << " ranges must grow" << std::endl;
+			return false;
+		}
+		loaded.push_back({static_cast<uint32_t>(max_size), strategy});
+	}
+	if (loaded.empty())
+		return false;
+	// whatever is larger than the last range stays with its strategy
+	loaded.back().max_size = UINT32_MAX;
+	ranges.swap(loaded);
+	return true;
+}
+
+bool TransferProfile::save(const std::string& path) const
+{
+	std::ofstream out(path);
+	if (!out)
+		return false;
+	out << "# transfer strategy per message size, written by rdma_calibrate" << std::endl;
+	if (!device.empty())
+		out << "device " << device << std::endl;
+	for (auto& r : ranges) {
+		out << transfer_strategy_name(r.strategy) << " " << r.max_size << std::endl;
+	}
+	return static_cast<bool>(out);
+}
+
+transfer_strategy TransferProfile::choose(uint32_t size) const
+{
+	for (auto& r : ranges) {
+		if (size <= r.max_size)
+			return r.strategy;
+	}
+	return TRANSFER_COPY;
+}
+
+void TransferProfile::set_ranges(const std::vector<transfer_range>& ranges)
+{
+	this->ranges = ranges;
+}
+
+const std::vector<transfer_range>& TransferProfile::get_ranges() const
+{
+	return ranges;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include "rdma_messenger/UDEndpoint.h"
+
+UDEndpoint::UDEndpoint(struct ibv_context* verbs, uint8_t port_num, struct ibv_cq* cq, uint64_t endpoint_id) :
+	verbs(verbs), port_num(port_num), cq(cq), endpoint_id(endpoint_id)
+{
+	pd = ibv_alloc_pd(verbs);
+	query_mtu();
+
+	recv_buf_len = UD_RECV_WQE_PER_QP * (mtu + UD_GRH_SIZE);
+	send_buf_len = UD_SEND_WQE_PER_QP * mtu;
+	recv_buf = static_cast<char*>(memalign(4096, recv_buf_len));
+	send_buf = static_cast<char*>(memalign(4096, send_buf_len));
+	register_mr();
+	construct_chunks();
+
+	create_qp();
+}
+
+UDEndpoint::~UDEndpoint()
+{
+	for (auto& p : peers) {
+		ibv_destroy_ah(p.second->ah);
+		delete p.second;
+	}
+	peers.clear();
+
+	if (qp)
+		ibv_destroy_qp(qp);
+
+	for (auto ck : recv_chunks)
+		delete ck;
+	for (auto ck : send_chunks)
+		delete ck;
+
+	if (recv_mr)
+		ibv_dereg_mr(recv_mr);
+	if (send_mr)
+		ibv_dereg_mr(send_mr);
+	free(recv_buf);
+	free(send_buf);
+
+	if (pd)
+		ibv_dealloc_pd(pd);
+}
+
+void UDEndpoint::query_mtu()
+{
+	struct ibv_port_attr port_attr = {};
+	if (ibv_query_port(verbs, port_num, &port_attr)) {
+		std::cerr << __func__ << " failed to query port " << (int)port_num << std::endl;
+		mtu = 1024;
+		return;
+	}
+	// IBV_MTU_256 is 1, IBV_MTU_4096 is 5
+	mtu = 128U << port_attr.active_mtu;
+}
+
+void UDEndpoint::create_qp()
+{
+	struct ibv_qp_init_attr init_attr;
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.cap.max_send_wr = UD_SEND_WQE_PER_QP;
+	init_attr.cap.max_recv_wr = UD_RECV_WQE_PER_QP;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.send_cq = cq;
+	init_attr.recv_cq = cq;
+	init_attr.qp_context = this;
+
+	qp = ibv_create_qp(pd, &init_attr);
+	if (!qp) {
+		std::cerr << __func__ << " failed to create ud qp " << std::endl;
+		return;
+	}
+
+	struct ibv_qp_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_INIT;
+	attr.pkey_index = 0;
+	attr.port_num = port_num;
+	attr.qkey = RDMA_UDP_QKEY;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+		std::cerr << __func__ << " failed to modify ud qp to INIT " << std::endl;
+		return;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTR;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+		std::cerr << __func__ << " failed to modify ud qp to RTR " << std::endl;
+		return;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTS;
+	attr.sq_psn = 0;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+		std::cerr << __func__ << " failed to modify ud qp to RTS " << std::endl;
+	}
+}
+
+void UDEndpoint::register_mr()
+{
+	recv_mr = ibv_reg_mr(pd, recv_buf, recv_buf_len, IBV_ACCESS_LOCAL_WRITE);
+	send_mr = ibv_reg_mr(pd, send_buf, send_buf_len, IBV_ACCESS_LOCAL_WRITE);
+}
+
+void UDEndpoint::construct_chunks()
+{
+	// the payload of a recv chunk starts right after its GRH slot
+	uint32_t recv_stride = mtu + UD_GRH_SIZE;
+	for (uint32_t offset = 0; offset < recv_buf_len; offset += recv_stride) {
+		recv_chunks.push_back(new Chunk(recv_mr, recv_buf + offset + UD_GRH_SIZE, mtu));
+	}
+
+	for (uint32_t offset = 0; offset < send_buf_len; offset += mtu) {
+		Chunk* ck = new Chunk(send_mr, send_buf + offset, mtu);
+		send_chunks.push_back(ck);
+		free_chunks.push_back(ck);
+	}
+}
+
+void UDEndpoint::post_recv_buffers()
+{
+	for (auto ck : recv_chunks) {
+		post_recv_buffer(ck);
+	}
+}
+
+void UDEndpoint::post_recv_buffer(Chunk* ck)
+{
+	struct ibv_recv_wr* bad_wr = nullptr;
+	struct ibv_sge recv_sge = {};
+	struct ibv_recv_wr recv_wr = {};
+
+	recv_sge.addr = (uintptr_t) (ck->chk_buf - UD_GRH_SIZE);
+	recv_sge.length = mtu + UD_GRH_SIZE;
+	recv_sge.lkey = ck->mr->lkey;
+
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+	recv_wr.next = nullptr;
+	recv_wr.wr_id = reinterpret_cast<uint64_t>(ck);
+
+	if (ibv_post_recv(qp, &recv_wr, &bad_wr)) {
+		std::cerr << __func__ << " failed to post recv wr " << std::endl;
+	}
+}
+
+bool UDEndpoint::async_send(UDPeer* peer, const char* raw_msg, uint32_t raw_msg_size)
+{
+	struct ibv_send_wr* bad_wr = nullptr;
+	struct ibv_sge send_sge = {};
+	struct ibv_send_wr send_wr = {};
+	Chunk* ck = nullptr;
+	assert(raw_msg_size <= mtu);
+	get_chunk(&ck);
+	if (!ck)
+		return false;
+	memcpy(ck->chk_buf, raw_msg, raw_msg_size);
+	ck->chk_size = raw_msg_size;
+
+	send_sge.addr = (uintptr_t) ck->chk_buf;
+	send_sge.length = raw_msg_size;
+	send_sge.lkey = ck->mr->lkey;
+
+	send_wr.opcode = IBV_WR_SEND;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	send_wr.wr_id = reinterpret_cast<uint64_t>(ck);
+	send_wr.wr.ud.ah = peer->ah;
+	send_wr.wr.ud.remote_qpn = peer->qp_num;
+	send_wr.wr.ud.remote_qkey = peer->qkey;
+	send_wr.next = nullptr;
+	if (ibv_post_send(qp, &send_wr, &bad_wr)) {
+		std::cerr << __func__ << " failed to post send wr " << std::endl;
+		reap_chunk(&ck);
+		return false;
+	}
+	return true;
+}
+
+UDPeer* UDEndpoint::add_peer(struct ibv_ah_attr* ah_attr, uint32_t qp_num, uint32_t qkey)
+{
+	UDPeerKey key = {};
+	if (ah_attr->is_global) {
+		key.gid_prefix = ah_attr->grh.dgid.global.subnet_prefix;
+		key.gid_guid = ah_attr->grh.dgid.global.interface_id;
+	}
+	key.lid = ah_attr->dlid;
+	key.qp_num = qp_num;
+
+	std::lock_guard<std::mutex> l(peer_mtx);
+	auto it = peers.find(key);
+	if (it != peers.end())
+		return it->second;
+
+	struct ibv_ah* ah = ibv_create_ah(pd, ah_attr);
+	if (!ah) {
+		std::cerr << __func__ << " failed to create address handle " << std::endl;
+		return nullptr;
+	}
+	return insert_peer(key, ah, qp_num, qkey);
+}
+
+UDPeer* UDEndpoint::learn_peer(struct ibv_wc* wc, Chunk* ck)
+{
+	struct ibv_grh* grh = nullptr;
+	UDPeerKey key = {};
+	if (wc->wc_flags & IBV_WC_GRH) {
+		grh = reinterpret_cast<struct ibv_grh*>(ck->chk_buf - UD_GRH_SIZE);
+		key.gid_prefix = grh->sgid.global.subnet_prefix;
+		key.gid_guid = grh->sgid.global.interface_id;
+	}
+	key.lid = wc->slid;
+	key.qp_num = wc->src_qp;
+
+	std::lock_guard<std::mutex> l(peer_mtx);
+	auto it = peers.find(key);
+	if (it != peers.end())
+		return it->second;
+
+	struct ibv_ah* ah = ibv_create_ah_from_wc(pd, wc, grh, port_num);
+	if (!ah) {
+		std::cerr << __func__ << " failed to create address handle from wc " << std::endl;
+		return nullptr;
+	}
+	return insert_peer(key, ah, wc->src_qp, RDMA_UDP_QKEY);
+}
+
+UDPeer* UDEndpoint::insert_peer(const UDPeerKey& key, struct ibv_ah* ah, uint32_t qp_num, uint32_t qkey)
+{
+	UDPeer* peer = new UDPeer(this, ah, qp_num, qkey, peer_number++);
+	peers.insert(std::pair<UDPeerKey, UDPeer*>(key, peer));
+	return peer;
+}
+
+void UDEndpoint::handle_recv(struct ibv_wc* wc)
+{
+	Chunk* ck = reinterpret_cast<Chunk*>(wc->wr_id);
+	// byte_len always accounts for the GRH slot, whether or not it is valid
+	ck->chk_size = wc->byte_len - UD_GRH_SIZE;
+
+	UDPeer* peer = learn_peer(wc, ck);
+	if (peer && read_callback) {
+		read_callback->callback_entry(peer, ck);
+	}
+	post_recv_buffer(ck);
+}
+
+void UDEndpoint::handle_send(struct ibv_wc* wc)
+{
+	Chunk* ck = reinterpret_cast<Chunk*>(wc->wr_id);
+	reap_chunk(&ck);
+}
+
+struct ibv_qp* UDEndpoint::get_qp() const
+{
+	return qp;
+}
+
+struct ibv_cq* UDEndpoint::get_cq() const
+{
+	return cq;
+}
+
+uint32_t UDEndpoint::get_mtu() const
+{
+	return mtu;
+}
+
+uint64_t UDEndpoint::get_endpoint_id() const
+{
+	return endpoint_id;
+}
+
+size_t UDEndpoint::get_peer_nums()
+{
+	std::lock_guard<std::mutex> l(peer_mtx);
+	return peers.size();
+}
+
+void UDEndpoint::set_read_callback(Callback* read_callback)
+{
+	this->read_callback = read_callback;
+}
+
+void UDEndpoint::get_chunk(Chunk** ck)
+{
+	std::lock_guard<std::mutex> l(chk_mtx);
+	if (free_chunks.size() == 0)
+		return;
+	*ck = free_chunks.back();
+	free_chunks.pop_back();
+}
+
+void UDEndpoint::reap_chunk(Chunk** ck)
+{
+	std::lock_guard<std::mutex> l(chk_mtx);
+	assert(*ck);
+	free_chunks.push_back(*ck);
+}
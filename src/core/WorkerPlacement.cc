@@ -0,0 +1,101 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "rdma_messenger/WorkerPlacement.h"
+
+void LoadStats::sample(uint64_t now_ns)
+{
+	if (last_sample_ns == 0) {
+		last_sample_ns = now_ns;
+		last_completions = completions.load(std::memory_order_relaxed);
+		last_bytes = bytes.load(std::memory_order_relaxed);
+		return;
+	}
+	uint64_t elapsed_ns = now_ns - last_sample_ns;
+	if (elapsed_ns < PLACEMENT_SAMPLE_MS * 1000000ULL)
+		return;
+
+	uint64_t cur_completions = completions.load(std::memory_order_relaxed);
+	uint64_t cur_bytes = bytes.load(std::memory_order_relaxed);
+	double seconds = elapsed_ns / 1e9;
+	double cur_completion_rate = (cur_completions - last_completions) / seconds;
+	double cur_byte_rate = (cur_bytes - last_bytes) / seconds;
+	// halve the weight of history at every sample
+	completion_rate = (completion_rate + cur_completion_rate) / 2;
+	byte_rate = (byte_rate + cur_byte_rate) / 2;
+
+	last_sample_ns = now_ns;
+	last_completions = cur_completions;
+	last_bytes = cur_bytes;
+}
+
+double LoadStats::score() const
+{
+	return completion_rate + byte_rate / PLACEMENT_BYTES_PER_COMPLETION;
+}
+
+uint32_t RoundRobinPlacement::place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id)
+{
+	return next++ % loads.size();
+}
+
+uint32_t LeastLoadedPlacement::place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id)
+{
+	uint32_t best = 0;
+	for (uint32_t i = 1; i < loads.size(); ++i) {
+		double best_score = loads[best]->score();
+		double score = loads[i]->score();
+		double slack = std::max(best_score, score) * PLACEMENT_TIE_PERCENT / 100;
+		if (score + slack < best_score) {
+			best = i;
+		} else if (score <= best_score + slack &&
+				loads[i]->connections.load() < loads[best]->connections.load()) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+uint32_t PeerHashPlacement::place(const std::vector<WorkerLoad*>& loads, struct rdma_cm_id* cm_id)
+{
+	struct sockaddr* peer = cm_id ? rdma_get_peer_addr(cm_id) : nullptr;
+	size_t hash = 0;
+	if (peer && peer->sa_family == AF_INET) {
+		hash = std::hash<uint32_t>()(reinterpret_cast<struct sockaddr_in*>(peer)->sin_addr.s_addr);
+	} else if (peer && peer->sa_family == AF_INET6) {
+		const struct in6_addr& addr = reinterpret_cast<struct sockaddr_in6*>(peer)->sin6_addr;
+		hash = std::hash<std::string>()(std::string(reinterpret_cast<const char*>(addr.s6_addr), sizeof(addr.s6_addr)));
+	}
+	return hash % loads.size();
+}
+
+PlacementPolicy* create_placement_policy(const std::string& name)
+{
+	if (name == "round_robin")
+		return new RoundRobinPlacement();
+	if (name == "least_loaded")
+		return new LeastLoadedPlacement();
+	if (name == "peer_hash")
+		return new PeerHashPlacement();
+	return nullptr;
+}
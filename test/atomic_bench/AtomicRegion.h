@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATOMICREGION_H
+#define ATOMICREGION_H
+
+#include <stdint.h>
+
+// server reply to the client's hello: where the atomic words live
+struct atomic_region_desc {
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t words;
+	// bytes between two consecutive words
+	uint32_t stride;
+} __attribute__((packed));
+
+#define ATOMIC_HELLO "hello"
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <algorithm>
+#include <unordered_map>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAClient.h"
+#include "test/common/BenchUtil.h"
+#include "test/atomic_bench/AtomicRegion.h"
+
+// One client thread per connection keeps `outstanding` atomics in flight.
+// hot: every thread targets word 0, spread: thread i owns word i.
+struct atomic_worker {
+	RDMAConnection* con = nullptr;
+	atomic_region_desc desc = {};
+	std::atomic<bool> ready{false};
+	std::atomic<uint32_t> inflight{0};
+	std::atomic<uint64_t> ops{0};
+	std::atomic<uint64_t> swapped{0};
+	// last value seen at the target word, next compare of the CAS loop
+	std::atomic<uint64_t> guess{0};
+	// only touched by the CQ thread of the connection while a step runs
+	std::vector<uint64_t> latency_ns;
+};
+
+std::mutex worker_mtx;
+std::unordered_map<RDMAConnection*, atomic_worker*> worker_map;
+std::vector<atomic_worker*> workers;
+
+atomic_worker* find_worker(RDMAConnection* con)
+{
+	std::lock_guard<std::mutex> l(worker_mtx);
+	auto it = worker_map.find(con);
+	return it == worker_map.end() ? nullptr : it->second;
+}
+
+class DescCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		atomic_worker* w = find_worker(static_cast<RDMAConnection*>(param));
+		Chunk* ck = static_cast<Chunk*>(msg);
+		if (!w || ck->chk_size != sizeof(atomic_region_desc))
+			return;
+		memcpy(&w->desc, ck->chk_buf, sizeof(w->desc));
+		w->ready.store(true);
+	}
+};
+
+class ConnectCallback : public Callback {
+	public:
+	ConnectCallback(Callback* read_callback) : read_callback(read_callback)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		RDMAConnection* con = static_cast<RDMAConnection*>(param);
+		atomic_worker* w = new atomic_worker();
+		w->con = con;
+		{
+			std::lock_guard<std::mutex> l(worker_mtx);
+			worker_map[con] = w;
+			workers.push_back(w);
+		}
+		con->set_read_callback(read_callback);
+		con->async_send(ATOMIC_HELLO, sizeof(ATOMIC_HELLO));
+	}
+	private:
+	Callback* read_callback;
+};
+
+class AtomicCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		atomic_worker* w = find_worker(static_cast<RDMAConnection*>(param));
+		AtomicOp* op = static_cast<AtomicOp*>(msg);
+		w->latency_ns.push_back(bench_now_ns() - op->user_data);
+		if (op->opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+			if (op->swapped()) {
+				w->swapped.fetch_add(1, std::memory_order_relaxed);
+				w->guess.store(op->swap, std::memory_order_relaxed);
+			} else {
+				w->guess.store(op->get_result(), std::memory_order_relaxed);
+			}
+		}
+		w->ops.fetch_add(1, std::memory_order_relaxed);
+		w->inflight.fetch_sub(1, std::memory_order_release);
+	}
+};
+
+// completes a promise with the fetched value, for the before/after check
+class FetchCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		value.set_value(static_cast<AtomicOp*>(msg)->get_result());
+	}
+	std::promise<uint64_t> value;
+};
+
+uint64_t word_addr(const atomic_worker* w, uint32_t word)
+{
+	return w->desc.addr + (uint64_t)(word % w->desc.words) * w->desc.stride;
+}
+
+uint64_t read_word(atomic_worker* w, uint32_t word)
+{
+	FetchCallback fetch;
+	std::future<uint64_t> value = fetch.value.get_future();
+	while (!w->con->async_fetch_add(word_addr(w, word), w->desc.rkey, 0, &fetch))
+		std::this_thread::yield();
+	return value.get();
+}
+
+std::atomic<bool> running(false);
+
+void issue_loop(atomic_worker* w, uint32_t word, bool cas, uint32_t outstanding, AtomicCallback* callback)
+{
+	uint64_t addr = word_addr(w, word);
+	while (running.load(std::memory_order_relaxed)) {
+		if (w->inflight.load(std::memory_order_acquire) >= outstanding)
+			continue;
+		w->inflight.fetch_add(1, std::memory_order_relaxed);
+		bool posted;
+		if (cas) {
+			uint64_t guess = w->guess.load(std::memory_order_relaxed);
+			posted = w->con->async_compare_swap(addr, w->desc.rkey, guess, guess + 1, callback, bench_now_ns());
+		} else {
+			posted = w->con->async_fetch_add(addr, w->desc.rkey, 1, callback, bench_now_ns());
+		}
+		if (!posted)
+			w->inflight.fetch_sub(1, std::memory_order_relaxed);
+	}
+	while (w->inflight.load(std::memory_order_acquire) != 0)
+		std::this_thread::yield();
+}
+
+double percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+	return sorted[idx] / 1e3;
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("remote fetch-and-add / compare-and-swap throughput and latency under contention", ' ', "0.1");
+	std::vector<std::string> ops{"faa", "cas"};
+	TCLAP::ValuesConstraint<std::string> op_constraint(ops);
+	TCLAP::ValueArg<std::string> op_arg("o", "op", "fetch-and-add or compare-and-swap", false, "faa", &op_constraint, cmd);
+	std::vector<std::string> modes{"hot", "spread"};
+	TCLAP::ValuesConstraint<std::string> mode_constraint(modes);
+	TCLAP::ValueArg<std::string> mode_arg("m", "mode", "all threads on one word or one word per thread", false, "hot", &mode_constraint, cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address", false, "127.0.0.1", "host", cmd);
+	TCLAP::ValueArg<uint16_t> port_arg("p", "port", "rdma_cm port", false, 20084, "port", cmd);
+	TCLAP::ValueArg<std::string> threads_arg("t", "threads", "comma separated client thread counts", false, "1,2,4,8,16", "list", cmd);
+	TCLAP::ValueArg<uint32_t> depth_arg("q", "outstanding", "outstanding atomics per thread", false, 1, "depth", cmd);
+	TCLAP::ValueArg<uint32_t> duration_arg("d", "duration", "milliseconds per step", false, 5000, "ms", cmd);
+	cmd.parse(argc, argv);
+
+	bool cas = op_arg.getValue() == "cas";
+	bool hot = mode_arg.getValue() == "hot";
+	std::vector<uint64_t> steps = bench_parse_list(threads_arg.getValue());
+	uint32_t outstanding = std::min(depth_arg.getValue(), ATOMIC_WQE_PER_QP);
+	uint64_t max_threads = steps.empty() ? 0 : *std::max_element(steps.begin(), steps.end());
+
+	struct addrinfo* res = bench_resolve(addr_arg.getValue(), port_arg.getValue());
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	DescCallback desc_callback;
+	ConnectCallback connect_callback(&desc_callback);
+	RDMAClient* client = new RDMAClient(res->ai_addr, max_threads);
+	client->connect(&connect_callback);
+	if (workers.size() < max_threads) {
+		std::cerr << "only " << workers.size() << " of " << max_threads << " connections established" << std::endl;
+		return 1;
+	}
+	for (auto w : workers) {
+		while (!w->ready.load())
+			std::this_thread::yield();
+	}
+	if (!hot && workers[0]->desc.words < max_threads) {
+		std::cerr << "server exposes " << workers[0]->desc.words << " words, spread mode needs " << max_threads << std::endl;
+		return 1;
+	}
+
+	AtomicCallback atomic_callback;
+	printf("%-4s %-6s %8s %10s %10s %10s %10s %10s %8s\n", "op", "mode", "threads", "Mops/s",
+			"avg_us", "p50_us", "p99_us", "p999_us", "cas_ok%");
+	for (auto threads : steps) {
+		for (uint64_t i = 0; i < threads; ++i) {
+			atomic_worker* w = workers[i];
+			w->ops.store(0);
+			w->swapped.store(0);
+			w->latency_ns.clear();
+			w->latency_ns.reserve(1 << 20);
+			w->guess.store(read_word(w, hot ? 0 : i));
+		}
+		uint64_t before = read_word(workers[0], 0);
+
+		running.store(true);
+		uint64_t start = bench_now_ns();
+		std::vector<std::thread> issuers;
+		for (uint64_t i = 0; i < threads; ++i) {
+			issuers.emplace_back(issue_loop, workers[i], hot ? 0 : i, cas, outstanding, &atomic_callback);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(duration_arg.getValue()));
+		running.store(false);
+		for (auto& t : issuers) {
+			t.join();
+		}
+		uint64_t end = bench_now_ns();
+
+		uint64_t total = 0, swapped = 0, word0_updates = 0;
+		std::vector<uint64_t> latency;
+		for (uint64_t i = 0; i < threads; ++i) {
+			atomic_worker* w = workers[i];
+			total += w->ops.load();
+			swapped += w->swapped.load();
+			if (hot || i == 0)
+				word0_updates += cas ? w->swapped.load() : w->ops.load();
+			latency.insert(latency.end(), w->latency_ns.begin(), w->latency_ns.end());
+		}
+		std::sort(latency.begin(), latency.end());
+		double sum = 0;
+		for (auto ns : latency) {
+			sum += ns;
+		}
+
+		printf("%-4s %-6s %8lu %10.3f %10.2f %10.2f %10.2f %10.2f %8.1f\n", op_arg.getValue().c_str(),
+				mode_arg.getValue().c_str(), threads, total / ((end - start) / 1e3),
+				latency.empty() ? 0 : sum / latency.size() / 1e3, percentile_us(latency, 0.5),
+				percentile_us(latency, 0.99), percentile_us(latency, 0.999),
+				cas ? (total ? 100.0 * swapped / total : 0) : 100.0);
+
+		// with this client as the only writer, word 0 moved exactly once per update
+		uint64_t after = read_word(workers[0], 0);
+		if (after - before != word0_updates) {
+			printf("     word 0 moved by %lu, expected %lu (other clients running?)\n", after - before, word0_updates);
+		}
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAServer.h"
+#include "test/atomic_bench/AtomicRegion.h"
+
+// every word sits on its own cache line so spread mode never shares one
+#define WORD_STRIDE 64U
+
+uint64_t* words = nullptr;
+uint32_t word_nums = 0;
+
+// a hello is answered with the region, registered on the connection's PD
+class HelloCallback : public Callback {
+	public:
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		Chunk *ck = static_cast<Chunk*>(msg);
+		if (ck->chk_size != sizeof(ATOMIC_HELLO) || memcmp(ck->chk_buf, ATOMIC_HELLO, ck->chk_size))
+			return;
+		struct ibv_mr *mr = con->register_atomic_region(words, (size_t)word_nums * WORD_STRIDE);
+		if (!mr)
+			return;
+		atomic_region_desc desc = {};
+		desc.addr = reinterpret_cast<uint64_t>(words);
+		desc.rkey = mr->rkey;
+		desc.words = word_nums;
+		desc.stride = WORD_STRIDE;
+		con->async_send(reinterpret_cast<const char*>(&desc), sizeof(desc));
+		printf("connection %lu joined, hot word is %lu\n", con->get_con_id(), words[0]);
+	}
+};
+
+class AcceptCallback : public Callback {
+	public:
+	AcceptCallback(Callback *read_callback) : read_callback(read_callback)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		static_cast<RDMAConnection*>(param)->set_read_callback(read_callback);
+	}
+	private:
+	Callback *read_callback;
+};
+
+int main(int argc, char** argv) {
+	TCLAP::CmdLine cmd("remote atomics benchmark server", ' ', "0.1");
+	TCLAP::ValueArg<uint16_t> port_arg("p", "port", "rdma_cm port", false, 20084, "port", cmd);
+	TCLAP::ValueArg<uint32_t> words_arg("w", "words", "number of exposed 8-byte words", false, 1024, "words", cmd);
+	cmd.parse(argc, argv);
+
+	word_nums = words_arg.getValue();
+	words = static_cast<uint64_t*>(memalign(4096, (size_t)word_nums * WORD_STRIDE));
+	memset(words, 0, (size_t)word_nums * WORD_STRIDE);
+
+	struct sockaddr_in sin;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port_arg.getValue());
+	sin.sin_addr.s_addr = INADDR_ANY;
+
+	HelloCallback *read_callback = new HelloCallback();
+	RDMAServer *server = new RDMAServer((struct sockaddr*)&sin);
+	AcceptCallback *accept_callback = new AcceptCallback(read_callback);
+	server->start(accept_callback);
+	server->wait();
+
+	delete accept_callback;
+	delete server;
+	delete read_callback;
+	free(words);
+	return 0;
+}
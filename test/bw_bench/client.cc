@@ -0,0 +1,230 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAClient.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+#include "test/common/HdrHistogram.h"
+
+// one connection driven by one thread: up to window messages are unacked
+struct bw_connection {
+	RDMAConnection* con = nullptr;
+	std::atomic<uint64_t> acked{0};
+	uint64_t sent = 0;
+	uint64_t start_ns = 0;
+	uint64_t end_ns = 0;
+	// send time of every unacked message, acks come back in send order
+	uint64_t sent_ns[SEND_WQE_PER_QP];
+	HdrHistogram hist;
+};
+
+// every ack the server returns releases one message of the window
+class AckCallback : public Callback {
+	public:
+	AckCallback(bw_connection* bw_con) : bw_con(bw_con)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		uint64_t acked = bw_con->acked.load(std::memory_order_relaxed);
+		bw_con->hist.record(bench_now_ns() - bw_con->sent_ns[acked % SEND_WQE_PER_QP]);
+		bw_con->acked.store(acked + 1, std::memory_order_release);
+	}
+	private:
+	bw_connection* bw_con;
+};
+
+class ConnectCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		bw_connection* bw_con = new bw_connection();
+		bw_con->con = static_cast<RDMAConnection*>(param);
+		bw_con->con->set_read_callback(new AckCallback(bw_con));
+		std::lock_guard<std::mutex> l(mtx);
+		cons.push_back(bw_con);
+	}
+
+	std::mutex mtx;
+	std::vector<bw_connection*> cons;
+};
+
+// until limit_msgs are acked or the deadline passes, whichever comes first;
+// the window is drained before returning so the next step starts clean
+void send_loop(bw_connection* bw_con, const std::vector<char>* payload, uint32_t window,
+		uint64_t limit_msgs, uint64_t deadline_ns)
+{
+	bw_con->start_ns = bench_now_ns();
+	while (true) {
+		uint64_t acked = bw_con->acked.load(std::memory_order_acquire);
+		if (acked >= limit_msgs || bench_now_ns() >= deadline_ns)
+			break;
+		if (bw_con->sent < limit_msgs && bw_con->sent - acked < window) {
+			bw_con->sent_ns[bw_con->sent % SEND_WQE_PER_QP] = bench_now_ns();
+			if (bw_con->con->async_send(payload->data(), payload->size())) {
+				bw_con->sent++;
+				continue;
+			}
+		}
+		std::this_thread::yield();
+	}
+	bw_con->end_ns = bench_now_ns();
+	while (bw_con->acked.load(std::memory_order_acquire) < bw_con->sent) {
+		std::this_thread::yield();
+	}
+}
+
+struct step_result {
+	uint64_t msgs;
+	double seconds;
+	HdrHistogram hist;
+};
+
+// one message size over all connections, per connection rows when verbose
+step_result run_step(std::vector<bw_connection*>& cons, uint32_t size, uint32_t window,
+		uint64_t bytes, uint64_t duration_ms, bool verbose)
+{
+	std::vector<char> payload(size, 'x');
+	uint64_t limit_msgs = bytes ? (bytes + size - 1) / size : UINT64_MAX;
+	for (auto bw_con : cons) {
+		bw_con->acked.store(0);
+		bw_con->sent = 0;
+		bw_con->hist.reset();
+	}
+
+	uint64_t deadline = duration_ms ? bench_now_ns() + duration_ms * 1000000 : UINT64_MAX;
+	std::vector<std::thread> senders;
+	for (auto bw_con : cons) {
+		senders.emplace_back(send_loop, bw_con, &payload, window, limit_msgs, deadline);
+	}
+	for (auto& t : senders) {
+		t.join();
+	}
+
+	step_result rst;
+	rst.msgs = 0;
+	uint64_t first = UINT64_MAX, last = 0;
+	if (verbose)
+		printf("%-6s %14s %12s %10s %10s\n", "con", "messages", "seconds", "Gbit/s", "Mmsg/s");
+	for (uint64_t i = 0; i < cons.size(); ++i) {
+		bw_connection* bw_con = cons[i];
+		uint64_t acked = bw_con->acked.load();
+		double seconds = (bw_con->end_ns - bw_con->start_ns) / 1e9;
+		if (verbose)
+			printf("%-6lu %14lu %12.3f %10.3f %10.3f\n", i, acked, seconds,
+					acked * size * 8 / seconds / 1e9, acked / seconds / 1e6);
+		first = std::min(first, bw_con->start_ns);
+		last = std::max(last, bw_con->end_ns);
+		rst.msgs += acked;
+		rst.hist.merge(bw_con->hist);
+	}
+	rst.seconds = (last - first) / 1e9;
+	return rst;
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("send bandwidth benchmark client, defaults from the yaml config", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address, server.server_ip_addr by default", false, "", "host", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	TCLAP::ValueArg<uint32_t> threads_arg("n", "threads", "threads and connections, client.client_threads by default", false, 0, "threads", cmd);
+	TCLAP::ValueArg<uint64_t> bytes_arg("b", "bytes", "bytes per thread, client.data_per_thread by default, 0: no limit", false, UINT64_MAX, "bytes", cmd);
+	TCLAP::ValueArg<uint64_t> duration_arg("d", "duration", "milliseconds, test.time_duration by default, 0: no limit", false, UINT64_MAX, "ms", cmd);
+	TCLAP::ValueArg<uint32_t> size_arg("s", "size", "message size, sge.sge_length by default", false, 0, "bytes", cmd);
+	TCLAP::ValueArg<std::string> sweep_arg("S", "sweep", "message sizes, a list like 64,4K,1M or powers of two like 1:4M", false, "", "sizes", cmd);
+	TCLAP::ValueArg<uint32_t> depth_arg("o", "outstanding", "unacked messages per connection", false, 16, "depth", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	std::string addr = addr_arg.getValue().empty() ? config->server_config.server_ip_addr : addr_arg.getValue();
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+	uint32_t threads = threads_arg.getValue() ? threads_arg.getValue() : config->client_config.client_threads;
+	uint64_t bytes = bytes_arg.isSet() ? bytes_arg.getValue() : config->client_config.data_per_thread;
+	uint64_t duration_ms = duration_arg.isSet() ? duration_arg.getValue() : config->test_config.time_duration;
+	uint32_t window = std::min(std::max(depth_arg.getValue(), 1U), SEND_WQE_PER_QP);
+	std::vector<uint64_t> sizes;
+	if (sweep_arg.isSet())
+		sizes = bench_size_steps(sweep_arg.getValue());
+	else
+		sizes.push_back(size_arg.getValue() ? size_arg.getValue() : config->sge_config.sge_length);
+	if (!bytes && !duration_ms) {
+		std::cerr << "neither a byte nor a time limit" << std::endl;
+		return 1;
+	}
+	for (auto size : sizes) {
+		if (!size || size > SGE_MSG_SIZE) {
+			std::cerr << "message size must be within 1.." << SGE_MSG_SIZE << std::endl;
+			return 1;
+		}
+	}
+	if (sizes.empty()) {
+		std::cerr << "no message size to run" << std::endl;
+		return 1;
+	}
+
+	struct addrinfo* res = bench_resolve(addr, port);
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	ConnectCallback connect_callback;
+	RDMAClient* client = new RDMAClient(res->ai_addr, threads);
+	bench_apply_worker_config(client->get_stack(), config->worker_config);
+	client->connect(&connect_callback);
+	std::vector<bw_connection*>& cons = connect_callback.cons;
+	if (cons.empty()) {
+		std::cerr << "no connection established" << std::endl;
+		return 1;
+	}
+
+	// every step reuses the same connections and registered buffers
+	printf("%lu connections, window %u, %lu bytes or %lu ms per thread and size\n",
+			cons.size(), window, bytes, duration_ms);
+	bool verbose = sizes.size() == 1;
+	if (!verbose)
+		printf("%10s %10s %10s %10s %10s %10s %10s  (us)\n", "size", "Gbit/s", "Mmsg/s",
+				"p50", "p99", "p99.9", "max");
+	for (auto size : sizes) {
+		step_result rst = run_step(cons, size, window, bytes, duration_ms, verbose);
+		double gbit = rst.msgs * size * 8 / rst.seconds / 1e9;
+		double mmsg = rst.msgs / rst.seconds / 1e6;
+		if (verbose) {
+			printf("%-6s %14lu %12.3f %10.3f %10.3f\n", "total", rst.msgs, rst.seconds, gbit, mmsg);
+			printf("ack latency p50 %.3f p99 %.3f p99.9 %.3f max %.3f us\n", rst.hist.percentile(50) / 1e3,
+					rst.hist.percentile(99) / 1e3, rst.hist.percentile(99.9) / 1e3, rst.hist.get_max() / 1e3);
+		} else {
+			printf("%10lu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", size, gbit, mmsg,
+					rst.hist.percentile(50) / 1e3, rst.hist.percentile(99) / 1e3,
+					rst.hist.percentile(99.9) / 1e3, rst.hist.get_max() / 1e3);
+		}
+		fflush(stdout);
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
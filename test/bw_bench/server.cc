@@ -0,0 +1,150 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAServer.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+
+// acknowledgement of one received message, the client's window moves on it
+#define BW_ACK "a"
+
+std::atomic<uint64_t> rx_msgs(0);
+std::atomic<uint64_t> rx_bytes(0);
+
+// Acks a connection still owes. Send chunks are freed only when their
+// completion is polled, which can lag the client's next message, so an ack
+// that finds no chunk waits here for the next send completion.
+struct ack_queue {
+	std::atomic<uint64_t> owed{0};
+	std::atomic<bool> busy{false};
+	std::atomic<bool> retry{false};
+};
+
+// read callbacks on an executor race the CQ thread: one thread sends at a
+// time, the others leave retry set for it
+void flush_acks(RDMAConnection *con, ack_queue *acks)
+{
+	while (acks->owed.load()) {
+		acks->retry.store(true);
+		if (acks->busy.exchange(true))
+			return;
+		acks->retry.store(false);
+		bool full = false;
+		while (!full && acks->owed.load()) {
+			if (con->async_send(BW_ACK, sizeof(BW_ACK)))
+				acks->owed.fetch_sub(1);
+			else
+				full = true;
+		}
+		acks->busy.store(false);
+		// no chunk freed meanwhile: the next send completion comes back here
+		if (full && !acks->retry.load())
+			return;
+	}
+}
+
+class CountCallback : public Callback {
+	public:
+	CountCallback(ack_queue *acks) : acks(acks)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		Chunk *ck = static_cast<Chunk*>(msg);
+		rx_msgs.fetch_add(1, std::memory_order_relaxed);
+		rx_bytes.fetch_add(ck->chk_size, std::memory_order_relaxed);
+		acks->owed.fetch_add(1);
+		flush_acks(static_cast<RDMAConnection*>(param), acks);
+	}
+	private:
+	ack_queue *acks;
+};
+
+class AckRetryCallback : public Callback {
+	public:
+	AckRetryCallback(ack_queue *acks) : acks(acks)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		if (acks->owed.load())
+			flush_acks(static_cast<RDMAConnection*>(param), acks);
+	}
+	private:
+	ack_queue *acks;
+};
+
+// per connection ack queue, kept for the life of the server
+class AcceptCallback : public Callback {
+	public:
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		ack_queue *acks = new ack_queue();
+		con->set_read_callback(new CountCallback(acks));
+		con->set_send_callback(new AckRetryCallback(acks));
+	}
+};
+
+int main(int argc, char** argv) {
+	TCLAP::CmdLine cmd("send bandwidth benchmark server", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+
+	struct sockaddr_in sin;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = INADDR_ANY;
+
+	RDMAServer *server = new RDMAServer((struct sockaddr*)&sin);
+	bench_apply_worker_config(server->get_stack(), config->worker_config);
+	server->get_stack()->set_qp_pool(config->server_config.qp_pool_size);
+	server->set_accept_threads(config->server_config.server_threads);
+	server->set_listen_backlog(config->server_config.listen_backlog);
+	AcceptCallback *accept_callback = new AcceptCallback();
+	server->start(accept_callback);
+	printf("listening on port %u\n", port);
+
+	// one line per second while data flows
+	uint64_t last_msgs = 0, last_bytes = 0;
+	uint64_t last = bench_now_ns();
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		uint64_t now = bench_now_ns();
+		uint64_t msgs = rx_msgs.load(), bytes = rx_bytes.load();
+		if (msgs != last_msgs) {
+			double seconds = (now - last) / 1e9;
+			printf("rx %10.3f Gbit/s %10.3f Mmsg/s\n", (bytes - last_bytes) * 8 / seconds / 1e9,
+					(msgs - last_msgs) / seconds / 1e6);
+			fflush(stdout);
+		}
+		last_msgs = msgs;
+		last_bytes = bytes;
+		last = now;
+	}
+
+	delete accept_callback;
+	delete server;
+	return 0;
+}
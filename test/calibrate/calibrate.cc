@@ -0,0 +1,339 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <infiniband/verbs.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/rdma_config.h"
+#include "rdma_messenger/TransferProfile.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/VerbsUtil.h"
+
+// Loopback microbenchmarks of every transfer strategy on one local device:
+// qp[0] sends to qp[1] over the HCA, one message in flight, and the cost
+// per message includes the receiver seeing its data. The cheapest strategy
+// per size becomes a range of the profile RDMAStack loads at startup.
+struct loopback {
+	struct ibv_context* ctx = nullptr;
+	struct ibv_pd* pd = nullptr;
+	struct ibv_cq* cq = nullptr;
+	struct ibv_qp* qp[2] = {};
+	uint32_t max_inline = 0;
+	uint32_t max_size = 0;
+
+	// application memory, never registered by the copy strategies
+	char* user = nullptr;
+	struct ibv_mr* user_mr = nullptr;
+	// sender chunk, receiver chunk and rendezvous control words
+	char* staging = nullptr;
+	struct ibv_mr* staging_mr = nullptr;
+	char* target = nullptr;
+	struct ibv_mr* target_mr = nullptr;
+	char* ctrl = nullptr;
+	struct ibv_mr* ctrl_mr = nullptr;
+};
+
+struct rndv_ctrl {
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t len;
+};
+
+static bool wait_wc(loopback& lb, int n)
+{
+	struct ibv_wc wc[4];
+	while (n > 0) {
+		int got = ibv_poll_cq(lb.cq, std::min(n, 4), wc);
+		if (got < 0)
+			return false;
+		for (int i = 0; i < got; ++i) {
+			if (wc[i].status) {
+				std::cerr << "loopback wc error: " << ibv_wc_status_str(wc[i].status) << std::endl;
+				return false;
+			}
+		}
+		n -= got;
+	}
+	return true;
+}
+
+static bool post_recv(struct ibv_qp* qp, void* buf, uint32_t len, uint32_t lkey)
+{
+	struct ibv_sge sge = {};
+	sge.addr = (uintptr_t) buf;
+	sge.length = len;
+	sge.lkey = lkey;
+	struct ibv_recv_wr wr = {};
+	struct ibv_recv_wr* bad_wr = nullptr;
+	wr.sg_list = &sge;
+	wr.num_sge = len ? 1 : 0;
+	return ibv_post_recv(qp, &wr, &bad_wr) == 0;
+}
+
+static bool post_send(struct ibv_qp* qp, enum ibv_wr_opcode opcode, void* buf, uint32_t len, uint32_t lkey,
+		int flags = 0, uint64_t remote_addr = 0, uint32_t rkey = 0)
+{
+	struct ibv_sge sge = {};
+	sge.addr = (uintptr_t) buf;
+	sge.length = len;
+	sge.lkey = lkey;
+	struct ibv_send_wr wr = {};
+	struct ibv_send_wr* bad_wr = nullptr;
+	wr.opcode = opcode;
+	wr.send_flags = IBV_SEND_SIGNALED | flags;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.rdma.remote_addr = remote_addr;
+	wr.wr.rdma.rkey = rkey;
+	wr.imm_data = htonl(len);
+	return ibv_post_send(qp, &wr, &bad_wr) == 0;
+}
+
+static bool setup(loopback& lb, const std::string& dev_name, uint8_t port, int gid_index, uint32_t max_size)
+{
+	lb.ctx = verbs_open_device(dev_name);
+	if (!lb.ctx)
+		return false;
+
+	struct ibv_port_attr port_attr = {};
+	union ibv_gid gid = {};
+	if (ibv_query_port(lb.ctx, port, &port_attr) || ibv_query_gid(lb.ctx, port, gid_index, &gid))
+		return false;
+
+	lb.pd = ibv_alloc_pd(lb.ctx);
+	lb.cq = ibv_create_cq(lb.ctx, 64, nullptr, nullptr, 0);
+	if (!lb.pd || !lb.cq)
+		return false;
+
+	struct ibv_qp_init_attr init_attr = {};
+	init_attr.send_cq = lb.cq;
+	init_attr.recv_cq = lb.cq;
+	init_attr.qp_type = IBV_QPT_RC;
+	init_attr.cap.max_send_wr = 16;
+	init_attr.cap.max_recv_wr = 16;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_inline_data = INLINE_DATA_MAX;
+	for (int i = 0; i < 2; ++i) {
+		struct ibv_qp_init_attr attr = init_attr;
+		lb.qp[i] = ibv_create_qp(lb.pd, &attr);
+		if (!lb.qp[i]) {
+			attr = init_attr;
+			attr.cap.max_inline_data = 0;
+			lb.qp[i] = ibv_create_qp(lb.pd, &attr);
+		}
+		if (!lb.qp[i])
+			return false;
+		lb.max_inline = attr.cap.max_inline_data;
+	}
+	if (!verbs_connect_qp(lb.qp[0], lb.qp[1]->qp_num, port, port_attr, gid, gid_index) ||
+	    !verbs_connect_qp(lb.qp[1], lb.qp[0]->qp_num, port, port_attr, gid, gid_index))
+		return false;
+
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	lb.max_size = max_size;
+	lb.user = static_cast<char*>(memalign(4096, max_size));
+	lb.staging = static_cast<char*>(memalign(4096, max_size));
+	lb.target = static_cast<char*>(memalign(4096, max_size));
+	lb.ctrl = static_cast<char*>(memalign(4096, 4096));
+	memset(lb.user, 'u', max_size);
+	lb.staging_mr = ibv_reg_mr(lb.pd, lb.staging, max_size, access);
+	lb.target_mr = ibv_reg_mr(lb.pd, lb.target, max_size, access);
+	lb.ctrl_mr = ibv_reg_mr(lb.pd, lb.ctrl, 4096, access);
+	return lb.staging_mr && lb.target_mr && lb.ctrl_mr;
+}
+
+static void teardown(loopback& lb)
+{
+	if (lb.user_mr)
+		ibv_dereg_mr(lb.user_mr);
+	if (lb.staging_mr)
+		ibv_dereg_mr(lb.staging_mr);
+	if (lb.target_mr)
+		ibv_dereg_mr(lb.target_mr);
+	if (lb.ctrl_mr)
+		ibv_dereg_mr(lb.ctrl_mr);
+	for (int i = 0; i < 2; ++i) {
+		if (lb.qp[i])
+			ibv_destroy_qp(lb.qp[i]);
+	}
+	if (lb.cq)
+		ibv_destroy_cq(lb.cq);
+	if (lb.pd)
+		ibv_dealloc_pd(lb.pd);
+	if (lb.ctx)
+		ibv_close_device(lb.ctx);
+	free(lb.user);
+	free(lb.staging);
+	free(lb.target);
+	free(lb.ctrl);
+}
+
+// one message of `size` bytes from lb.user into lb.target
+static bool transfer_once(loopback& lb, transfer_strategy strategy, uint32_t size)
+{
+	switch (strategy) {
+	case TRANSFER_INLINE:
+		return post_recv(lb.qp[1], lb.target, size, lb.target_mr->lkey) &&
+			post_send(lb.qp[0], IBV_WR_SEND, lb.user, size, 0, IBV_SEND_INLINE) &&
+			wait_wc(lb, 2);
+	case TRANSFER_COPY:
+		memcpy(lb.staging, lb.user, size);
+		return post_recv(lb.qp[1], lb.target, size, lb.target_mr->lkey) &&
+			post_send(lb.qp[0], IBV_WR_SEND, lb.staging, size, lb.staging_mr->lkey) &&
+			wait_wc(lb, 2);
+	case TRANSFER_ZERO_COPY: {
+		// pinning the caller's buffer is part of the price
+		struct ibv_mr* mr = ibv_reg_mr(lb.pd, lb.user, size, IBV_ACCESS_LOCAL_WRITE);
+		if (!mr)
+			return false;
+		bool ok = post_recv(lb.qp[1], lb.target, size, lb.target_mr->lkey) &&
+			post_send(lb.qp[0], IBV_WR_SEND, lb.user, size, mr->lkey) &&
+			wait_wc(lb, 2);
+		ibv_dereg_mr(mr);
+		return ok;
+	}
+	case TRANSFER_WRITE_IMM:
+		memcpy(lb.staging, lb.user, size);
+		return post_recv(lb.qp[1], nullptr, 0, 0) &&
+			post_send(lb.qp[0], IBV_WR_RDMA_WRITE_WITH_IMM, lb.staging, size, lb.staging_mr->lkey, 0,
+					(uintptr_t) lb.target, lb.target_mr->rkey) &&
+			wait_wc(lb, 2);
+	case TRANSFER_READ_RENDEZVOUS: {
+		// advertise the (cached) source registration, receiver reads, then acks
+		if (!lb.user_mr)
+			lb.user_mr = ibv_reg_mr(lb.pd, lb.user, lb.max_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+		if (!lb.user_mr)
+			return false;
+		rndv_ctrl* adv = reinterpret_cast<rndv_ctrl*>(lb.ctrl);
+		adv->addr = (uintptr_t) lb.user;
+		adv->rkey = lb.user_mr->rkey;
+		adv->len = size;
+		char* adv_recv = lb.ctrl + 1024;
+		char* fin_recv = lb.ctrl + 2048;
+		char* fin = lb.ctrl + 3072;
+		if (!post_recv(lb.qp[1], adv_recv, sizeof(rndv_ctrl), lb.ctrl_mr->lkey) ||
+		    !post_recv(lb.qp[0], fin_recv, sizeof(uint32_t), lb.ctrl_mr->lkey) ||
+		    !post_send(lb.qp[0], IBV_WR_SEND, adv, sizeof(rndv_ctrl), lb.ctrl_mr->lkey) ||
+		    !wait_wc(lb, 2))
+			return false;
+		const rndv_ctrl* got = reinterpret_cast<const rndv_ctrl*>(adv_recv);
+		if (!post_send(lb.qp[1], IBV_WR_RDMA_READ, lb.target, got->len, lb.target_mr->lkey, 0, got->addr, got->rkey) ||
+		    !wait_wc(lb, 1))
+			return false;
+		return post_send(lb.qp[1], IBV_WR_SEND, fin, sizeof(uint32_t), lb.ctrl_mr->lkey) && wait_wc(lb, 2);
+	}
+	}
+	return false;
+}
+
+// nanoseconds per message, 0 when the strategy is not usable at this size
+static double measure(loopback& lb, transfer_strategy strategy, uint32_t size, uint32_t iterations)
+{
+	if (strategy == TRANSFER_INLINE && size > lb.max_inline)
+		return 0;
+	for (uint32_t i = 0; i < iterations / 10 + 1; ++i) {
+		if (!transfer_once(lb, strategy, size))
+			return 0;
+	}
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < iterations; ++i) {
+		if (!transfer_once(lb, strategy, size))
+			return 0;
+	}
+	return static_cast<double>(bench_now_ns() - start) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("measure transfer strategy crossover sizes and write a transfer profile", ' ', "0.1");
+	TCLAP::ValueArg<std::string> dev_arg("d", "device", "RDMA device, first one when empty", false, "", "name", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("i", "ib-port", "device port", false, 1, "port", cmd);
+	TCLAP::ValueArg<int> gid_arg("g", "gid-index", "source GID index", false, 0, "index", cmd);
+	TCLAP::ValueArg<uint32_t> max_arg("m", "max-size", "largest message size", false, 8 * 1024 * 1024, "bytes", cmd);
+	TCLAP::ValueArg<uint32_t> iter_arg("n", "iterations", "messages per size and strategy at 4 KiB and below", false, 2000, "count", cmd);
+	TCLAP::ValueArg<std::string> out_arg("o", "output", "profile file", false, TRANSFER_PROFILE_PATH, "path", cmd);
+	cmd.parse(argc, argv);
+
+	uint32_t max_size = std::min(max_arg.getValue(), SGE_MSG_SIZE);
+	loopback lb;
+	if (!setup(lb, dev_arg.getValue(), port_arg.getValue(), gid_arg.getValue(), max_size)) {
+		std::cerr << "failed to set up the loopback QPs" << std::endl;
+		teardown(lb);
+		return 1;
+	}
+
+	const transfer_strategy strategies[] = {TRANSFER_INLINE, TRANSFER_COPY, TRANSFER_ZERO_COPY,
+		TRANSFER_WRITE_IMM, TRANSFER_READ_RENDEZVOUS};
+	std::string device = ibv_get_device_name(lb.ctx->device);
+	printf("device %s, max inline %u bytes, ns per message\n", device.c_str(), lb.max_inline);
+	printf("%10s", "size");
+	for (auto s : strategies) {
+		printf(" %16s", transfer_strategy_name(s));
+	}
+	printf("\n");
+
+	std::vector<transfer_range> ranges;
+	for (uint64_t size = 1; size <= max_size; size *= 2) {
+		// keep large sizes from dominating the run time
+		uint32_t iterations = std::max<uint64_t>(20, iter_arg.getValue() * 4096 / std::max<uint64_t>(size, 4096));
+		transfer_strategy best = TRANSFER_COPY;
+		double best_ns = 0;
+		printf("%10lu", size);
+		for (auto s : strategies) {
+			double ns = measure(lb, s, size, iterations);
+			if (ns > 0)
+				printf(" %16.0f", ns);
+			else
+				printf(" %16s", "-");
+			if (ns > 0 && (best_ns == 0 || ns < best_ns)) {
+				best_ns = ns;
+				best = s;
+			}
+		}
+		printf("   %s\n", transfer_strategy_name(best));
+
+		if (!ranges.empty() && ranges.back().strategy == best)
+			ranges.back().max_size = size;
+		else
+			ranges.push_back({static_cast<uint32_t>(size), best});
+	}
+	teardown(lb);
+	if (ranges.empty())
+		return 1;
+	ranges.back().max_size = UINT32_MAX;
+
+	TransferProfile profile;
+	profile.device = device;
+	profile.set_ranges(ranges);
+	if (!profile.save(out_arg.getValue())) {
+		std::cerr << "failed to write " << out_arg.getValue() << std::endl;
+		return 1;
+	}
+	printf("profile written to %s\n", out_arg.getValue().c_str());
+	return 0;
+}
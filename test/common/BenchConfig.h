@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCHCONFIG_H
+#define BENCHCONFIG_H
+
+#include <iostream>
+
+#include "common/ConfigParameter.h"
+#include "rdma_messenger/RDMAStack.h"
+#include "rdma_messenger/RNICAffinity.h"
+#include "rdma_messenger/WorkerPlacement.h"
+
+// values of the yaml named by -c/--conf, config.yaml without one;
+// nullptr when it is missing or malformed
+inline ConfigParameter::ConfigValue* bench_load_config(int argc, char** argv)
+{
+	ConfigParameter* config = ConfigParameter::CreateConfigObj(argc, const_cast<const char**>(argv));
+	try {
+		config->ConfigParse();
+	} catch (const YAML::Exception& e) {
+		std::cerr << "failed to parse config: " << e.what() << std::endl;
+		return nullptr;
+	}
+	return &config->configs;
+}
+
+// worker: section onto a stack, before its first listen/connect
+inline void bench_apply_worker_config(RDMAStack* stack, const worker_config_value& worker)
+{
+	stack->set_worker_nums(worker.cq_workers);
+	if (worker.worker_cpus[0])
+		stack->set_worker_cpus(RNICAffinity::parse_cpu_list(worker.worker_cpus));
+	if (worker.app_cpus[0])
+		stack->set_app_cpus(RNICAffinity::parse_cpu_list(worker.app_cpus));
+	PlacementPolicy* placement = create_placement_policy(worker.placement);
+	if (placement)
+		stack->set_placement_policy(placement);
+	else
+		std::cerr << "unknown placement " << worker.placement << ", keeping least_loaded" << std::endl;
+	stack->set_rebalance(worker.rebalance_spread);
+	stack->set_thread_per_core(worker.thread_per_core);
+	if (worker.executor_threads)
+		stack->set_executor(worker.executor_threads);
+}
+
+#endif
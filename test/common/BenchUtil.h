@@ -0,0 +1,132 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+inline uint64_t bench_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t bench_rss_bytes()
+{
+	uint64_t size = 0, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	if (statm)
+		statm >> size >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// memory pinned by the process: ibv_reg_mr is accounted in VmPin, kernels
+// before 3.2 charged it to VmLck instead
+inline uint64_t bench_pinned_bytes()
+{
+	uint64_t pin_kb = 0, lck_kb = 0;
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmPin:") == 0)
+			pin_kb = strtoull(line.c_str() + 6, nullptr, 10);
+		else if (line.compare(0, 6, "VmLck:") == 0)
+			lck_kb = strtoull(line.c_str() + 6, nullptr, 10);
+	}
+	return std::max(pin_kb, lck_kb) << 10;
+}
+
+inline uint64_t bench_phys_bytes()
+{
+	return static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+}
+
+// "1,100,10000" -> {1, 100, 10000}
+inline std::vector<uint64_t> bench_parse_list(const std::string& list)
+{
+	std::vector<uint64_t> values;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty())
+			values.push_back(strtoull(item.c_str(), nullptr, 0));
+	}
+	return values;
+}
+
+// "4096", "64K", "4M" -> bytes
+inline uint64_t bench_parse_size(const std::string& size)
+{
+	char* end = nullptr;
+	uint64_t value = strtoull(size.c_str(), &end, 0);
+	switch (*end) {
+	case 'k': case 'K': return value << 10;
+	case 'm': case 'M': return value << 20;
+	case 'g': case 'G': return value << 30;
+	default: return value;
+	}
+}
+
+// "1,4K,1M" -> those sizes, "1:4M" -> every power of two from 1 to 4M
+inline std::vector<uint64_t> bench_size_steps(const std::string& spec)
+{
+	std::vector<uint64_t> sizes;
+	size_t colon = spec.find(':');
+	if (colon != std::string::npos) {
+		uint64_t first = bench_parse_size(spec.substr(0, colon));
+		uint64_t last = bench_parse_size(spec.substr(colon + 1));
+		for (uint64_t size = first ? first : 1; size <= last; size <<= 1) {
+			sizes.push_back(size);
+		}
+		return sizes;
+	}
+	std::stringstream ss(spec);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty())
+			sizes.push_back(bench_parse_size(item));
+	}
+	return sizes;
+}
+
+// caller frees the result with freeaddrinfo
+inline struct addrinfo* bench_resolve(const std::string& host, uint16_t port)
+{
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* res = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res))
+		return nullptr;
+	return res;
+}
+
+#endif
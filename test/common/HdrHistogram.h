@@ -0,0 +1,130 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDRHISTOGRAM_H
+#define HDRHISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// 2^sub_bits get a bucket each, every power of two above is cut into
+// 2^(sub_bits - 1) equal buckets. A value keeps a relative precision of
+// 2^(1 - sub_bits), 1.6% with the default 7 bits, over the whole uint64_t
+// range at a fixed size of a few thousand counters.
+class HdrHistogram {
+	public:
+	HdrHistogram(uint32_t sub_bits = 7) :
+		sub_bits(sub_bits), half(1ULL << (sub_bits - 1)),
+		counts((64 - sub_bits) * half + (1ULL << sub_bits), 0)
+	{}
+
+	void record(uint64_t value)
+	{
+		counts[index_of(value)]++;
+		total++;
+		sum += value;
+		min_value = std::min(min_value, value);
+		max_value = std::max(max_value, value);
+	}
+
+	// both built with the same sub_bits
+	void merge(const HdrHistogram& other)
+	{
+		for (size_t i = 0; i < counts.size(); ++i) {
+			counts[i] += other.counts[i];
+		}
+		total += other.total;
+		sum += other.sum;
+		min_value = std::min(min_value, other.min_value);
+		max_value = std::max(max_value, other.max_value);
+	}
+
+	void reset()
+	{
+		std::fill(counts.begin(), counts.end(), 0);
+		total = 0;
+		sum = 0;
+		min_value = UINT64_MAX;
+		max_value = 0;
+	}
+
+	// highest value of the bucket holding percent of all samples, 0 when empty
+	uint64_t percentile(double percent) const
+	{
+		if (!total)
+			return 0;
+		uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+		rank = std::max<uint64_t>(std::min(rank, total), 1);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); ++i) {
+			seen += counts[i];
+			if (seen >= rank)
+				return std::min(highest_of(i), max_value);
+		}
+		return max_value;
+	}
+
+	uint64_t get_count() const
+	{
+		return total;
+	}
+	uint64_t get_min() const
+	{
+		return total ? min_value : 0;
+	}
+	uint64_t get_max() const
+	{
+		return max_value;
+	}
+	double get_mean() const
+	{
+		return total ? static_cast<double>(sum) / total : 0;
+	}
+
+	private:
+	size_t index_of(uint64_t value) const
+	{
+		if (value < 2 * half)
+			return value;
+		uint32_t shift = 64 - __builtin_clzll(value) - sub_bits;
+		return shift * half + (value >> shift);
+	}
+
+	uint64_t highest_of(size_t index) const
+	{
+		if (index < 2 * half)
+			return index;
+		uint32_t shift = index / half - 1;
+		uint64_t sub = index - shift * half;
+		return ((sub + 1) << shift) - 1;
+	}
+
+	private:
+	uint32_t sub_bits;
+	uint64_t half;
+	std::vector<uint64_t> counts;
+	uint64_t total = 0;
+	uint64_t sum = 0;
+	uint64_t min_value = UINT64_MAX;
+	uint64_t max_value = 0;
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VERBSUTIL_H
+#define VERBSUTIL_H
+
+#include <stdint.h>
+
+#include <infiniband/verbs.h>
+
+#include <string>
+
+// first device when name is empty, nullptr when there is none
+inline struct ibv_context* verbs_open_device(const std::string& name)
+{
+	int dev_nums = 0;
+	struct ibv_device** devs = ibv_get_device_list(&dev_nums);
+	if (!devs)
+		return nullptr;
+	struct ibv_context* ctx = nullptr;
+	for (int i = 0; i < dev_nums; ++i) {
+		if (name.empty() || name == ibv_get_device_name(devs[i])) {
+			ctx = ibv_open_device(devs[i]);
+			break;
+		}
+	}
+	ibv_free_device_list(devs);
+	return ctx;
+}
+
+inline bool verbs_qp_to_init(struct ibv_qp* qp, uint8_t port)
+{
+	struct ibv_qp_attr attr = {};
+	attr.qp_state = IBV_QPS_INIT;
+	attr.port_num = port;
+	attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS) == 0;
+}
+
+// GRH for RoCE and soft-RoCE, or whenever the port has no LID
+inline bool verbs_qp_to_rtr(struct ibv_qp* qp, uint32_t dest_qpn, uint8_t port,
+		const struct ibv_port_attr& port_attr, const union ibv_gid& gid, int gid_index)
+{
+	struct ibv_qp_attr attr = {};
+	attr.qp_state = IBV_QPS_RTR;
+	attr.path_mtu = port_attr.active_mtu;
+	attr.dest_qp_num = dest_qpn;
+	attr.max_dest_rd_atomic = 1;
+	attr.min_rnr_timer = 12;
+	attr.ah_attr.dlid = port_attr.lid;
+	attr.ah_attr.port_num = port;
+	if (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET || port_attr.lid == 0) {
+		attr.ah_attr.is_global = 1;
+		attr.ah_attr.grh.dgid = gid;
+		attr.ah_attr.grh.sgid_index = gid_index;
+		attr.ah_attr.grh.hop_limit = 1;
+	}
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER) == 0;
+}
+
+inline bool verbs_qp_to_rts(struct ibv_qp* qp)
+{
+	struct ibv_qp_attr attr = {};
+	attr.qp_state = IBV_QPS_RTS;
+	attr.timeout = 14;
+	attr.retry_cnt = 7;
+	attr.rnr_retry = 7;
+	attr.max_rd_atomic = 1;
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+			IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC) == 0;
+}
+
+// RESET to RTS against dest_qpn on the same port
+inline bool verbs_connect_qp(struct ibv_qp* qp, uint32_t dest_qpn, uint8_t port,
+		const struct ibv_port_attr& port_attr, const union ibv_gid& gid, int gid_index)
+{
+	return verbs_qp_to_init(qp, port) &&
+		verbs_qp_to_rtr(qp, dest_qpn, port, port_attr, gid, gid_index) &&
+		verbs_qp_to_rts(qp);
+}
+
+#endif
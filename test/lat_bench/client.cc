@@ -0,0 +1,382 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAClient.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+#include "test/common/HdrHistogram.h"
+
+// every message is a sequence number followed by this
+std::vector<char> payload;
+uint64_t warmup = 0;
+uint64_t iterations = 0;
+// closed loop: echoes in flight per connection
+uint64_t window = 1;
+bool keep_samples = false;
+std::atomic<uint64_t> finished(0);
+// open loop: requests go out on a schedule, not in reply to an echo, and
+// only those intended for record_after_ns or later are timed
+bool open_loop = false;
+uint64_t record_after_ns = 0;
+
+struct lat_connection {
+	RDMAConnection* con = nullptr;
+	std::atomic<uint64_t> sent{0};
+	std::atomic<uint64_t> replies{0};
+	// per message in flight the time it was sent, in open loop the time it
+	// was meant to be sent, indexed by its sequence number
+	uint64_t sent_ns[SEND_WQE_PER_QP];
+	HdrHistogram hist;
+	std::vector<uint64_t> samples;
+};
+
+// only one thread sends on a connection at a time
+bool send_one(lat_connection* lat_con, uint64_t stamp_ns)
+{
+	uint64_t seq = lat_con->sent.load(std::memory_order_relaxed);
+	lat_con->sent_ns[seq % SEND_WQE_PER_QP] = stamp_ns;
+	if (!lat_con->con->async_send(reinterpret_cast<const char*>(&seq), sizeof(seq), payload.data(), payload.size()))
+		return false;
+	lat_con->sent.store(seq + 1, std::memory_order_release);
+	return true;
+}
+
+class EchoCallback : public Callback {
+	public:
+	EchoCallback(lat_connection* lat_con) : lat_con(lat_con)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		uint64_t now = bench_now_ns();
+		// the echo names the request it answers, a lost one cannot shift the rest
+		uint64_t seq = 0;
+		memcpy(&seq, static_cast<Chunk*>(msg)->chk_buf, sizeof(seq));
+		uint64_t replies = lat_con->replies.load(std::memory_order_relaxed);
+		uint64_t stamp = lat_con->sent_ns[seq % SEND_WQE_PER_QP];
+		lat_con->replies.store(replies + 1, std::memory_order_release);
+		bool timed = open_loop ? stamp >= record_after_ns : seq >= warmup;
+		if (timed) {
+			lat_con->hist.record(now - stamp);
+			if (keep_samples)
+				lat_con->samples.push_back(now - stamp);
+		}
+		if (open_loop)
+			return;
+
+		// closed loop: every echo refills the window, the first one opens it
+		uint64_t total = warmup + iterations;
+		if (replies + 1 >= total) {
+			finished.fetch_add(1);
+			return;
+		}
+		uint64_t sent = lat_con->sent.load(std::memory_order_relaxed);
+		while (sent < total && sent - (replies + 1) < window) {
+			// send chunks of finished round trips may not be reaped yet
+			if (!send_one(lat_con, bench_now_ns()))
+				break;
+			sent++;
+		}
+		if (sent == replies + 1 && sent < total) {
+			std::cerr << "send failed on connection " << lat_con->con->get_con_id() << std::endl;
+			finished.fetch_add(1);
+		}
+	}
+
+	static void send_next(lat_connection* lat_con)
+	{
+		if (!send_one(lat_con, bench_now_ns())) {
+			std::cerr << "send failed on connection " << lat_con->con->get_con_id() << std::endl;
+			finished.fetch_add(1);
+		}
+	}
+
+	private:
+	lat_connection* lat_con;
+};
+
+class ConnectCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		lat_connection* lat_con = new lat_connection();
+		lat_con->con = static_cast<RDMAConnection*>(param);
+		lat_con->con->set_read_callback(new EchoCallback(lat_con));
+		std::lock_guard<std::mutex> l(mtx);
+		cons.push_back(lat_con);
+	}
+
+	std::mutex mtx;
+	std::vector<lat_connection*> cons;
+};
+
+void reset(std::vector<lat_connection*>& cons)
+{
+	for (auto lat_con : cons) {
+		lat_con->sent.store(0);
+		lat_con->replies.store(0);
+		lat_con->hist.reset();
+		lat_con->samples.clear();
+	}
+}
+
+// Requests fall due at rate per second, evenly spaced or with exponential
+// gaps, until end_ns. A request that finds the send window full waits in
+// line and keeps its due time, so the wait counts against its latency
+// instead of silently slowing the schedule down (coordinated omission).
+void open_loop_sender(lat_connection* lat_con, double rate, bool poisson, uint64_t start_ns,
+		uint64_t end_ns, uint64_t seed, uint64_t* unsent)
+{
+	std::mt19937_64 rng(seed);
+	std::exponential_distribution<double> poisson_gap(rate / 1e9);
+	double gap_ns = 1e9 / rate;
+	double next_ns = start_ns + (poisson ? poisson_gap(rng) : gap_ns);
+	// due requests keep being sent for a moment after the schedule ends
+	uint64_t drain_ns = end_ns + 1000000000ULL;
+	std::deque<uint64_t> due;
+	while (true) {
+		uint64_t now = bench_now_ns();
+		while (next_ns <= now && next_ns < end_ns) {
+			due.push_back(static_cast<uint64_t>(next_ns));
+			next_ns += poisson ? poisson_gap(rng) : gap_ns;
+		}
+		if (now >= end_ns && (due.empty() || now >= drain_ns))
+			break;
+		uint64_t in_flight = lat_con->sent.load(std::memory_order_relaxed) -
+			lat_con->replies.load(std::memory_order_acquire);
+		if (!due.empty() && in_flight < SEND_WQE_PER_QP && send_one(lat_con, due.front())) {
+			due.pop_front();
+			continue;
+		}
+		std::this_thread::yield();
+	}
+	*unsent = due.size();
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("round trip latency benchmark client", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address, server.server_ip_addr by default", false, "", "host", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	TCLAP::ValueArg<uint32_t> cons_arg("n", "connections", "connections", false, 1, "connections", cmd);
+	TCLAP::ValueArg<uint32_t> size_arg("s", "size", "message size in bytes, the first 8 carry a sequence number", false, 64, "bytes", cmd);
+	TCLAP::ValueArg<std::string> sweep_arg("S", "sweep", "message sizes, a list like 64,4K,1M or powers of two like 1:4M", false, "", "sizes", cmd);
+	TCLAP::ValueArg<uint64_t> iters_arg("i", "iterations", "timed round trips per connection, size and window", false, 1000000, "count", cmd);
+	TCLAP::ValueArg<std::string> window_arg("k", "window", "closed loop: echoes in flight per connection, a list like 1,4,16 or doubling like 1:64", false, "1", "depths", cmd);
+	TCLAP::ValueArg<uint64_t> warmup_arg("w", "warmup", "untimed round trips per connection before each size and window", false, 10000, "count", cmd);
+	TCLAP::ValueArg<std::string> rates_arg("R", "rates", "open loop: total requests per second, a list like 10K,100K or doubling like 10K:2M", false, "", "rates", cmd);
+	std::vector<std::string> arrivals{"constant", "poisson"};
+	TCLAP::ValuesConstraint<std::string> arrival_constraint(arrivals);
+	TCLAP::ValueArg<std::string> arrival_arg("A", "arrival", "open loop: gaps between requests", false, "poisson", &arrival_constraint, cmd);
+	TCLAP::ValueArg<uint32_t> duration_arg("d", "duration", "open loop: milliseconds per rate", false, 5000, "ms", cmd);
+	TCLAP::ValueArg<uint32_t> warmup_ms_arg("W", "warmup-ms", "open loop: untimed milliseconds at the start of each rate", false, 1000, "ms", cmd);
+	TCLAP::ValueArg<std::string> raw_arg("r", "raw", "write every sample in ns to this file", false, "", "file", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	std::string addr = addr_arg.getValue().empty() ? config->server_config.server_ip_addr : addr_arg.getValue();
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+	std::vector<uint64_t> sizes;
+	if (sweep_arg.isSet())
+		sizes = bench_size_steps(sweep_arg.getValue());
+	else
+		sizes.push_back(size_arg.getValue());
+	if (sizes.empty()) {
+		std::cerr << "no message size to run" << std::endl;
+		return 1;
+	}
+	for (auto size : sizes) {
+		if (size < sizeof(uint64_t) || size > SGE_MSG_SIZE) {
+			std::cerr << "message size must be within " << sizeof(uint64_t) << ".." << SGE_MSG_SIZE << std::endl;
+			return 1;
+		}
+	}
+	if (!iters_arg.getValue()) {
+		std::cerr << "at least one iteration" << std::endl;
+		return 1;
+	}
+	std::vector<uint64_t> rates;
+	open_loop = rates_arg.isSet();
+	if (open_loop) {
+		rates = bench_size_steps(rates_arg.getValue());
+		if (rates.empty() || sizes.size() > 1) {
+			std::cerr << "open loop takes at least one rate and a single message size" << std::endl;
+			return 1;
+		}
+	}
+	std::vector<uint64_t> windows = bench_size_steps(window_arg.getValue());
+	for (auto depth : windows) {
+		// the send queue of a connection holds SEND_WQE_PER_QP messages
+		if (!depth || depth > SEND_WQE_PER_QP) {
+			std::cerr << "window must be within 1.." << SEND_WQE_PER_QP << std::endl;
+			return 1;
+		}
+	}
+	if (windows.empty()) {
+		std::cerr << "no window to run" << std::endl;
+		return 1;
+	}
+	warmup = warmup_arg.getValue();
+	iterations = iters_arg.getValue();
+	keep_samples = !raw_arg.getValue().empty();
+
+	struct addrinfo* res = bench_resolve(addr, port);
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	ConnectCallback connect_callback;
+	RDMAClient* client = new RDMAClient(res->ai_addr, cons_arg.getValue());
+	bench_apply_worker_config(client->get_stack(), config->worker_config);
+	client->connect(&connect_callback);
+	std::vector<lat_connection*>& cons = connect_callback.cons;
+	if (cons.empty()) {
+		std::cerr << "no connection established" << std::endl;
+		return 1;
+	}
+	for (auto lat_con : cons) {
+		if (keep_samples && !open_loop)
+			lat_con->samples.reserve(iterations);
+	}
+
+	std::ofstream raw;
+	if (keep_samples) {
+		raw.open(raw_arg.getValue());
+		if (!raw) {
+			std::cerr << "failed to open " << raw_arg.getValue() << std::endl;
+			return 1;
+		}
+		raw << (open_loop ? "rate connection latency_ns\n" : "size window connection latency_ns\n");
+	}
+
+	if (open_loop) {
+		// latency from the intended send time, one row per rate up to saturation
+		bool poisson = arrival_arg.getValue() == "poisson";
+		payload.assign(sizes[0] - sizeof(uint64_t), 'x');
+		printf("open loop, %lu connections, %lu B messages, %s arrivals, %u ms per rate\n", cons.size(),
+				sizes[0], arrival_arg.getValue().c_str(), duration_arg.getValue());
+		printf("%12s %12s %10s %10s %10s %10s %10s %10s %10s  (us)\n", "target/s", "achieved/s", "mean",
+				"p50", "p90", "p99", "p99.9", "p99.99", "max");
+		for (auto rate : rates) {
+			reset(cons);
+			uint64_t start = bench_now_ns();
+			uint64_t end = start + duration_arg.getValue() * 1000000ULL;
+			record_after_ns = start + warmup_ms_arg.getValue() * 1000000ULL;
+			std::vector<uint64_t> unsent(cons.size(), 0);
+			std::vector<std::thread> senders;
+			for (uint64_t i = 0; i < cons.size(); ++i) {
+				senders.emplace_back(open_loop_sender, cons[i], static_cast<double>(rate) / cons.size(),
+						poisson, start, end, start + i, &unsent[i]);
+			}
+			for (auto& t : senders) {
+				t.join();
+			}
+			uint64_t drain_deadline = bench_now_ns() + 1000000000ULL;
+			HdrHistogram total;
+			uint64_t replies = 0, backlog = 0;
+			for (uint64_t i = 0; i < cons.size(); ++i) {
+				while (cons[i]->replies.load() < cons[i]->sent.load() && bench_now_ns() < drain_deadline) {
+					std::this_thread::yield();
+				}
+				replies += cons[i]->replies.load();
+				backlog += unsent[i];
+				total.merge(cons[i]->hist);
+			}
+
+			double achieved = replies / ((end - start) / 1e9);
+			printf("%12lu %12.0f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f", rate, achieved,
+					total.get_mean() / 1e3, total.percentile(50) / 1e3, total.percentile(90) / 1e3,
+					total.percentile(99) / 1e3, total.percentile(99.9) / 1e3, total.percentile(99.99) / 1e3,
+					total.get_max() / 1e3);
+			if (backlog)
+				printf("  saturated, %lu requests never sent", backlog);
+			printf("\n");
+			fflush(stdout);
+
+			if (keep_samples) {
+				for (uint64_t i = 0; i < cons.size(); ++i) {
+					for (auto sample : cons[i]->samples) {
+						raw << rate << " " << i << " " << sample << "\n";
+					}
+				}
+			}
+		}
+		freeaddrinfo(res);
+		return 0;
+	}
+
+	// every step reuses the same connections and registered buffers
+	printf("%lu connections, %lu warmup and %lu timed round trips each per size and window\n",
+			cons.size(), warmup, iterations);
+	printf("%10s %8s %10s %10s %10s %10s %10s %10s %10s %10s %10s  (us)\n", "size", "window", "Gbit/s",
+			"Mmsg/s", "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+	for (auto size : sizes) {
+		payload.assign(size - sizeof(uint64_t), 'x');
+		for (auto depth : windows) {
+			window = depth;
+			finished.store(0);
+			reset(cons);
+
+			// one message each, the first echo fills the window
+			uint64_t start = bench_now_ns();
+			for (auto lat_con : cons) {
+				EchoCallback::send_next(lat_con);
+			}
+			while (finished.load() < cons.size()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			double seconds = (bench_now_ns() - start) / 1e9;
+
+			HdrHistogram total;
+			for (auto lat_con : cons) {
+				total.merge(lat_con->hist);
+			}
+			// both directions carry the payload
+			double msgs = 2.0 * (warmup + iterations) * cons.size();
+			printf("%10lu %8lu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", size,
+					depth, msgs * size * 8 / seconds / 1e9, msgs / seconds / 1e6, total.get_mean() / 1e3,
+					total.percentile(50) / 1e3, total.percentile(90) / 1e3, total.percentile(99) / 1e3,
+					total.percentile(99.9) / 1e3, total.percentile(99.99) / 1e3, total.get_max() / 1e3);
+			fflush(stdout);
+
+			if (keep_samples) {
+				for (uint64_t i = 0; i < cons.size(); ++i) {
+					for (auto sample : cons[i]->samples) {
+						raw << size << " " << depth << " " << i << " " << sample << "\n";
+					}
+				}
+			}
+		}
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAServer.h"
+#include "test/common/BenchConfig.h"
+
+// Echoes that found no free send chunk, in arrival order. Send chunks are
+// freed only when their completion is polled, the next one sends them.
+struct echo_queue {
+	std::deque<std::string> echoes;
+	std::mutex mtx;
+};
+
+// echo_queue::mtx held
+void flush_echoes(RDMAConnection *con, echo_queue *queue)
+{
+	while (!queue->echoes.empty()) {
+		const std::string& echo = queue->echoes.front();
+		if (!con->async_send(echo.data(), echo.size()))
+			return;
+		queue->echoes.pop_front();
+	}
+}
+
+// send every message straight back, the client times the round trip
+class EchoCallback : public Callback {
+	public:
+	EchoCallback(echo_queue *queue) : queue(queue)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		Chunk *ck = static_cast<Chunk*>(msg);
+		std::lock_guard<std::mutex> l(queue->mtx);
+		flush_echoes(con, queue);
+		if (queue->echoes.empty() && con->async_send(ck->chk_buf, ck->chk_size))
+			return;
+		queue->echoes.emplace_back(ck->chk_buf, ck->chk_size);
+	}
+	private:
+	echo_queue *queue;
+};
+
+// a send completion freed a chunk, the oldest queued echo takes it
+class EchoRetryCallback : public Callback {
+	public:
+	EchoRetryCallback(echo_queue *queue) : queue(queue)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		std::lock_guard<std::mutex> l(queue->mtx);
+		flush_echoes(static_cast<RDMAConnection*>(param), queue);
+	}
+	private:
+	echo_queue *queue;
+};
+
+// per connection echo queue, kept for the life of the server
+class AcceptCallback : public Callback {
+	public:
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		echo_queue *queue = new echo_queue();
+		con->set_read_callback(new EchoCallback(queue));
+		con->set_send_callback(new EchoRetryCallback(queue));
+	}
+};
+
+int main(int argc, char** argv) {
+	TCLAP::CmdLine cmd("latency benchmark echo server", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+
+	struct sockaddr_in sin;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = INADDR_ANY;
+
+	RDMAServer *server = new RDMAServer((struct sockaddr*)&sin);
+	bench_apply_worker_config(server->get_stack(), config->worker_config);
+	server->get_stack()->set_qp_pool(config->server_config.qp_pool_size);
+	server->set_accept_threads(config->server_config.server_threads);
+	server->set_listen_backlog(config->server_config.listen_backlog);
+	AcceptCallback *accept_callback = new AcceptCallback();
+	server->start(accept_callback);
+	printf("listening on port %u\n", port);
+	server->wait();
+
+	delete accept_callback;
+	delete server;
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAClient.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+#include "test/common/HdrHistogram.h"
+
+// Small request/response traffic on some connections, alone and then next
+// to bulk streams on the others, all of one client and so of the same
+// device and CQ workers. Run against lat_server, which echoes both classes.
+std::vector<char> small_payload;
+std::vector<char> bulk_payload;
+std::atomic<bool> probing(false);
+std::atomic<bool> streaming(false);
+
+// one request in flight, timed from send to echo
+struct probe_connection {
+	RDMAConnection* con = nullptr;
+	uint64_t sent_ns = 0;
+	std::atomic<bool> idle{true};
+	HdrHistogram hist;
+};
+
+// up to window bulk messages unechoed
+struct bulk_connection {
+	RDMAConnection* con = nullptr;
+	uint64_t sent = 0;
+	std::atomic<uint64_t> echoed{0};
+};
+
+void probe_send(probe_connection* probe)
+{
+	probe->idle.store(false);
+	probe->sent_ns = bench_now_ns();
+	if (!probe->con->async_send(small_payload.data(), small_payload.size()))
+		probe->idle.store(true);
+}
+
+class ProbeCallback : public Callback {
+	public:
+	ProbeCallback(probe_connection* probe) : probe(probe)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		probe->hist.record(bench_now_ns() - probe->sent_ns);
+		if (probing.load(std::memory_order_relaxed))
+			probe_send(probe);
+		else
+			probe->idle.store(true);
+	}
+	private:
+	probe_connection* probe;
+};
+
+class BulkCallback : public Callback {
+	public:
+	BulkCallback(bulk_connection* bulk) : bulk(bulk)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		bulk->echoed.fetch_add(1, std::memory_order_release);
+	}
+	private:
+	bulk_connection* bulk;
+};
+
+class ConnectCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		cons.push_back(static_cast<RDMAConnection*>(param));
+	}
+
+	std::mutex mtx;
+	std::vector<RDMAConnection*> cons;
+};
+
+void bulk_loop(bulk_connection* bulk, uint32_t window)
+{
+	while (streaming.load(std::memory_order_relaxed)) {
+		if (bulk->sent - bulk->echoed.load(std::memory_order_acquire) < window &&
+				bulk->con->async_send(bulk_payload.data(), bulk_payload.size())) {
+			bulk->sent++;
+			continue;
+		}
+		std::this_thread::yield();
+	}
+}
+
+// closed-loop probes on every probe connection for duration_ms
+HdrHistogram probe_round(std::vector<probe_connection*>& probes, uint32_t duration_ms)
+{
+	for (auto probe : probes) {
+		probe->hist.reset();
+	}
+	probing.store(true);
+	for (auto probe : probes) {
+		probe_send(probe);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+	probing.store(false);
+
+	HdrHistogram total;
+	uint64_t deadline = bench_now_ns() + 1000000000ULL;
+	for (auto probe : probes) {
+		while (!probe->idle.load() && bench_now_ns() < deadline) {
+			std::this_thread::yield();
+		}
+		total.merge(probe->hist);
+	}
+	return total;
+}
+
+void print_row(const char* name, const HdrHistogram& h, uint32_t duration_ms, double bulk_gbit)
+{
+	printf("%-10s %10.0f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+			h.get_count() / (duration_ms / 1e3), h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+			h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.percentile(99.99) / 1e3,
+			h.get_max() / 1e3, bulk_gbit);
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("small message latency with and without bulk streams, run against lat_server", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address, server.server_ip_addr by default", false, "", "host", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	TCLAP::ValueArg<uint32_t> probes_arg("n", "probes", "connections with small request/response traffic", false, 1, "connections", cmd);
+	TCLAP::ValueArg<uint32_t> bulks_arg("b", "bulks", "connections streaming large messages", false, 4, "connections", cmd);
+	TCLAP::ValueArg<uint32_t> small_arg("s", "size", "request size", false, 64, "bytes", cmd);
+	TCLAP::ValueArg<std::string> bulk_size_arg("B", "bulk-size", "bulk message size", false, "1M", "bytes", cmd);
+	TCLAP::ValueArg<uint32_t> depth_arg("o", "outstanding", "unechoed bulk messages per connection", false, 16, "depth", cmd);
+	TCLAP::ValueArg<uint32_t> duration_arg("d", "duration", "milliseconds per round", false, 5000, "ms", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	std::string addr = addr_arg.getValue().empty() ? config->server_config.server_ip_addr : addr_arg.getValue();
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+	uint64_t bulk_size = bench_parse_size(bulk_size_arg.getValue());
+	uint32_t window = std::min(std::max(depth_arg.getValue(), 1U), SEND_WQE_PER_QP);
+	uint32_t duration_ms = std::max(duration_arg.getValue(), 1U);
+	if (!small_arg.getValue() || small_arg.getValue() > SGE_MSG_SIZE || !bulk_size || bulk_size > SGE_MSG_SIZE) {
+		std::cerr << "message sizes must be within 1.." << SGE_MSG_SIZE << std::endl;
+		return 1;
+	}
+	if (!probes_arg.getValue()) {
+		std::cerr << "at least one probe connection" << std::endl;
+		return 1;
+	}
+	small_payload.assign(small_arg.getValue(), 'x');
+	bulk_payload.assign(bulk_size, 'x');
+
+	struct addrinfo* res = bench_resolve(addr, port);
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	ConnectCallback connect_callback;
+	RDMAClient* client = new RDMAClient(res->ai_addr, probes_arg.getValue() + bulks_arg.getValue());
+	bench_apply_worker_config(client->get_stack(), config->worker_config);
+	client->connect(&connect_callback);
+	std::vector<RDMAConnection*>& cons = connect_callback.cons;
+	if (cons.size() < probes_arg.getValue() + bulks_arg.getValue()) {
+		std::cerr << "only " << cons.size() << " connections established" << std::endl;
+		return 1;
+	}
+
+	std::vector<probe_connection*> probes;
+	std::vector<bulk_connection*> bulks;
+	for (uint64_t i = 0; i < cons.size(); ++i) {
+		if (i < probes_arg.getValue()) {
+			probe_connection* probe = new probe_connection();
+			probe->con = cons[i];
+			probe->con->set_read_callback(new ProbeCallback(probe));
+			probes.push_back(probe);
+		} else {
+			bulk_connection* bulk = new bulk_connection();
+			bulk->con = cons[i];
+			bulk->con->set_read_callback(new BulkCallback(bulk));
+			bulks.push_back(bulk);
+		}
+	}
+
+	printf("%lu probe connections of %u B, %lu bulk connections of %lu B with window %u\n", probes.size(),
+			small_arg.getValue(), bulks.size(), bulk_size, window);
+	printf("%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "round", "probes/s", "p50", "p90", "p99",
+			"p99.9", "p99.99", "max", "bulk_Gbit/s");
+
+	HdrHistogram idle = probe_round(probes, duration_ms);
+	print_row("alone", idle, duration_ms, 0);
+	fflush(stdout);
+
+	streaming.store(true);
+	std::vector<std::thread> streams;
+	for (auto bulk : bulks) {
+		streams.emplace_back(bulk_loop, bulk, window);
+	}
+	// let the streams reach their window before probing
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	uint64_t echoed_before = 0;
+	for (auto bulk : bulks) {
+		echoed_before += bulk->echoed.load();
+	}
+	uint64_t start = bench_now_ns();
+	HdrHistogram loaded = probe_round(probes, duration_ms);
+	uint64_t end = bench_now_ns();
+	uint64_t echoed_after = 0;
+	for (auto bulk : bulks) {
+		echoed_after += bulk->echoed.load();
+	}
+	streaming.store(false);
+	for (auto& t : streams) {
+		t.join();
+	}
+
+	// one way of the bulk traffic, the echoes double it on the wire
+	double bulk_gbit = (echoed_after - echoed_before) * bulk_size * 8 / ((end - start) / 1e9) / 1e9;
+	print_row("bulk", loaded, duration_ms, bulk_gbit);
+	if (idle.get_count() && loaded.get_count())
+		printf("p99 x%.2f, p99.9 x%.2f under bulk load\n",
+				(double)loaded.percentile(99) / std::max<uint64_t>(idle.percentile(99), 1),
+				(double)loaded.percentile(99.9) / std::max<uint64_t>(idle.percentile(99.9), 1));
+
+	freeaddrinfo(res);
+	return 0;
+}
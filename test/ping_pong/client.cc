@@ -37,7 +37,7 @@ class ReadCallback : public Callback {
 		std::unique_lock<std::mutex> lk(mtx);
 		if (sum == 0) {
 			std::cout << "chunk buf is " << ck->chk_buf << ", chunk size is " << ck->chk_size << std::endl;
-			start == timestamp_now();
+			start = timestamp_now();
 		}
 		sum++;
 		if (sum >= 1000000) {
@@ -0,0 +1,224 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAClient.h"
+#include "rdma_messenger/ReliableUD.h"
+#include "test/common/BenchUtil.h"
+
+// Closed-loop echo over N peers: every reply immediately triggers the next
+// request on the same connection, `outstanding` requests per connection.
+std::atomic<bool> running(false);
+std::atomic<uint64_t> replies(0);
+std::vector<char> payload;
+
+class RCReadCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		replies.fetch_add(1, std::memory_order_relaxed);
+		if (running.load(std::memory_order_relaxed))
+			con->async_send(payload.data(), payload.size());
+	}
+};
+
+class RUDReadCallback : public Callback {
+	public:
+	RUDReadCallback(ReliableUD* rud) : rud(rud)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		RUDConnection *con = static_cast<RUDConnection*>(param);
+		replies.fetch_add(1, std::memory_order_relaxed);
+		if (running.load(std::memory_order_relaxed))
+			rud->async_send(con, payload.data(), payload.size());
+	}
+	private:
+	ReliableUD* rud;
+};
+
+// collects whatever the stack hands to the connect callback
+class ConnectCallback : public Callback {
+	public:
+	ConnectCallback(ibv_qp_type qp_type, Callback* read_callback) :
+		qp_type(qp_type), read_callback(read_callback)
+	{}
+
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		if (qp_type == IBV_QPT_UD) {
+			UDPeer* peer = static_cast<UDPeer*>(param);
+			peer->endpoint->set_read_callback(read_callback);
+			ud_peers.push_back(peer);
+		} else {
+			RDMAConnection* con = static_cast<RDMAConnection*>(param);
+			con->set_read_callback(read_callback);
+			rc_cons.push_back(con);
+		}
+	}
+
+	std::mutex mtx;
+	std::vector<RDMAConnection*> rc_cons;
+	std::vector<UDPeer*> ud_peers;
+
+	private:
+	ibv_qp_type qp_type;
+	Callback* read_callback;
+};
+
+struct step_result {
+	double mmsg_per_sec;
+	double gbit_per_sec;
+};
+
+template <typename SendFn>
+step_result run_step(uint64_t peers, uint32_t outstanding, uint32_t duration_ms, SendFn send)
+{
+	replies.store(0);
+	running.store(true);
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < peers; ++i) {
+		for (uint32_t k = 0; k < outstanding; ++k) {
+			send(i);
+		}
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+	uint64_t done = replies.load();
+	uint64_t end = bench_now_ns();
+	running.store(false);
+	// let in-flight echoes drain before the next step
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	double seconds = (end - start) / 1e9;
+	step_result rst;
+	rst.mmsg_per_sec = done / seconds / 1e6;
+	rst.gbit_per_sec = done * payload.size() * 8 / seconds / 1e9;
+	return rst;
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("RC vs reliable UD: memory footprint and throughput per peer count", ' ', "0.1");
+	std::vector<std::string> transports{"rc", "ud"};
+	TCLAP::ValuesConstraint<std::string> transport_constraint(transports);
+	TCLAP::ValueArg<std::string> transport_arg("t", "transport", "rc or reliable ud", false, "rc", &transport_constraint, cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address", false, "127.0.0.1", "host", cmd);
+	TCLAP::ValueArg<uint16_t> port_arg("p", "port", "rdma_cm port", false, 20083, "port", cmd);
+	TCLAP::ValueArg<std::string> peers_arg("n", "peers", "comma separated peer counts", false, "1,100,10000", "list", cmd);
+	TCLAP::ValueArg<uint32_t> size_arg("s", "size", "message size in bytes", false, 64, "bytes", cmd);
+	TCLAP::ValueArg<uint32_t> depth_arg("o", "outstanding", "outstanding messages per connection", false, 1, "depth", cmd);
+	TCLAP::ValueArg<uint32_t> duration_arg("d", "duration", "milliseconds per step", false, 5000, "ms", cmd);
+	cmd.parse(argc, argv);
+
+	ibv_qp_type qp_type = transport_arg.getValue() == "ud" ? IBV_QPT_UD : IBV_QPT_RC;
+	std::vector<uint64_t> steps = bench_parse_list(peers_arg.getValue());
+	uint32_t outstanding = depth_arg.getValue();
+	payload.assign(size_arg.getValue(), 'x');
+
+	struct addrinfo* res = bench_resolve(addr_arg.getValue(), port_arg.getValue());
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	ReliableUD* rud = nullptr;
+	Callback* read_callback = nullptr;
+	if (qp_type == IBV_QPT_UD) {
+		rud = new ReliableUD();
+		rud->set_read_callback(new RUDReadCallback(rud));
+		read_callback = rud;
+	} else {
+		read_callback = new RCReadCallback();
+	}
+	ConnectCallback connect_callback(qp_type, read_callback);
+
+	uint64_t base_rss = bench_rss_bytes();
+	uint64_t rc_pinned_per_con = (uint64_t)RECV_WQE_PER_QP * SGE_MSG_SIZE + (uint64_t)SEND_WQE_PER_QP * SGE_MSG_SIZE;
+	std::vector<RDMAClient*> clients;
+	std::vector<RUDConnection*> rud_cons;
+
+	printf("%-9s %8s %10s %10s %12s %14s %12s\n", "transport", "peers", "Mmsg/s", "Gbit/s",
+			"rss_MiB", "pinned_MiB", "state_B/con");
+	for (auto peers : steps) {
+		step_result rst = {};
+		uint64_t pinned = 0;
+		uint64_t state_per_con = 0;
+
+		if (qp_type == IBV_QPT_RC) {
+			if (peers * rc_pinned_per_con > bench_phys_bytes()) {
+				printf("%-9s %8lu skipped: needs %lu MiB pinned for RC buffers\n", "rc", peers,
+						peers * rc_pinned_per_con >> 20);
+				continue;
+			}
+			uint64_t have = connect_callback.rc_cons.size();
+			if (peers > have) {
+				RDMAClient* client = new RDMAClient(res->ai_addr, peers - have);
+				client->connect(&connect_callback);
+				clients.push_back(client);
+			}
+			std::vector<RDMAConnection*>& cons = connect_callback.rc_cons;
+			rst = run_step(peers, outstanding, duration_arg.getValue(), [&](uint64_t i) {
+				cons[i]->async_send(payload.data(), payload.size());
+			});
+			pinned = cons.size() * rc_pinned_per_con;
+			state_per_con = sizeof(RDMAConnection) + rc_pinned_per_con;
+		} else {
+			// a handful of SIDR resolutions give the UD peers, channels make the connections
+			if (connect_callback.ud_peers.empty()) {
+				RDMAClient* client = new RDMAClient(res->ai_addr, IO_WORKER_NUMS, IBV_QPT_UD);
+				client->connect(&connect_callback);
+				clients.push_back(client);
+			}
+			std::vector<UDPeer*>& ud_peers = connect_callback.ud_peers;
+			while (rud_cons.size() < peers) {
+				rud_cons.push_back(rud->attach(ud_peers[rud_cons.size() % ud_peers.size()]));
+			}
+			assert(payload.size() <= rud->max_msg_size(rud_cons[0]));
+			rst = run_step(peers, outstanding, duration_arg.getValue(), [&](uint64_t i) {
+				rud->async_send(rud_cons[i], payload.data(), payload.size());
+			});
+			uint32_t mtu = ud_peers[0]->endpoint->get_mtu();
+			uint64_t endpoint_pinned = (uint64_t)UD_RECV_WQE_PER_QP * (mtu + UD_GRH_SIZE) + (uint64_t)UD_SEND_WQE_PER_QP * mtu;
+			std::set<UDEndpoint*> endpoints;
+			for (auto peer : ud_peers) {
+				endpoints.insert(peer->endpoint);
+			}
+			pinned = endpoints.size() * endpoint_pinned;
+			state_per_con = sizeof(RUDConnection);
+		}
+
+		printf("%-9s %8lu %10.3f %10.3f %12.1f %14.1f %12lu\n", transport_arg.getValue().c_str(), peers,
+				rst.mmsg_per_sec, rst.gbit_per_sec, (bench_rss_bytes() - base_rss) / 1048576.0,
+				pinned / 1048576.0, state_per_con);
+		if (rud) {
+			printf("          reliable ud: %lu segments allocated, %lu retransmits\n",
+					rud->get_segment_nums(), rud->get_retransmits());
+		}
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
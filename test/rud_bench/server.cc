@@ -0,0 +1,97 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAServer.h"
+#include "rdma_messenger/ReliableUD.h"
+
+// RC: echo every message back on the same connection
+class RCEchoCallback : public Callback {
+	public:
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RDMAConnection *con = static_cast<RDMAConnection*>(param);
+		Chunk *ck = static_cast<Chunk*>(msg);
+		con->async_send(ck->chk_buf, ck->chk_size);
+	}
+};
+
+// reliable UD: echo every message back on the same logical channel
+class RUDEchoCallback : public Callback {
+	public:
+	RUDEchoCallback(ReliableUD *rud) : rud(rud)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		RUDConnection *con = static_cast<RUDConnection*>(param);
+		Chunk *ck = static_cast<Chunk*>(msg);
+		rud->async_send(con, ck->chk_buf, ck->chk_size);
+	}
+	private:
+	ReliableUD *rud;
+};
+
+class AcceptCallback : public Callback {
+	public:
+	AcceptCallback(ibv_qp_type qp_type, Callback *read_callback) :
+		qp_type(qp_type), read_callback(read_callback)
+	{}
+	virtual void callback_entry(void *param, void *msg = nullptr) override {
+		if (qp_type == IBV_QPT_UD) {
+			// every SIDR request hands out one of the shared worker endpoints
+			static_cast<UDEndpoint*>(param)->set_read_callback(read_callback);
+		} else {
+			static_cast<RDMAConnection*>(param)->set_read_callback(read_callback);
+		}
+	}
+	private:
+	ibv_qp_type qp_type;
+	Callback *read_callback;
+};
+
+int main(int argc, char** argv) {
+	TCLAP::CmdLine cmd("RC vs reliable UD benchmark server", ' ', "0.1");
+	std::vector<std::string> transports{"rc", "ud"};
+	TCLAP::ValuesConstraint<std::string> transport_constraint(transports);
+	TCLAP::ValueArg<std::string> transport_arg("t", "transport", "rc or reliable ud", false, "rc", &transport_constraint, cmd);
+	TCLAP::ValueArg<uint16_t> port_arg("p", "port", "rdma_cm port", false, 20083, "port", cmd);
+	cmd.parse(argc, argv);
+
+	ibv_qp_type qp_type = transport_arg.getValue() == "ud" ? IBV_QPT_UD : IBV_QPT_RC;
+
+	struct sockaddr_in sin;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port_arg.getValue());
+	sin.sin_addr.s_addr = INADDR_ANY;
+
+	ReliableUD *rud = nullptr;
+	Callback *read_callback = nullptr;
+	if (qp_type == IBV_QPT_UD) {
+		rud = new ReliableUD();
+		rud->set_read_callback(new RUDEchoCallback(rud));
+		read_callback = rud;
+	} else {
+		read_callback = new RCEchoCallback();
+	}
+
+	RDMAServer *server = new RDMAServer((struct sockaddr*)&sin, qp_type);
+	AcceptCallback *accept_callback = new AcceptCallback(qp_type, read_callback);
+	server->start(accept_callback);
+	server->wait();
+
+	delete accept_callback;
+	delete server;
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <numeric>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/RDMAStack.h"
+#include "rdma_messenger/Connector.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+#include "test/common/HdrHistogram.h"
+
+// Connection count scaling against lat_server: every step opens the missing
+// connections on the same stack, then keeps `outstanding` echoes in flight on each of them.
+std::vector<char> payload;
+std::atomic<bool> running(false);
+
+struct scale_connection {
+	RDMAConnection* con = nullptr;
+	std::atomic<uint64_t> sent{0};
+	std::atomic<uint64_t> replies{0};
+	// send time of every message in flight, echoes come back in send order
+	uint64_t sent_ns[SEND_WQE_PER_QP];
+	HdrHistogram hist;
+};
+
+void send_one(scale_connection* scale_con)
+{
+	uint64_t slot = scale_con->sent.fetch_add(1);
+	scale_con->sent_ns[slot % SEND_WQE_PER_QP] = bench_now_ns();
+	if (!scale_con->con->async_send(payload.data(), payload.size()))
+		scale_con->sent.fetch_sub(1);
+}
+
+class EchoCallback : public Callback {
+	public:
+	EchoCallback(scale_connection* scale_con) : scale_con(scale_con)
+	{}
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		uint64_t replies = scale_con->replies.load(std::memory_order_relaxed);
+		scale_con->hist.record(bench_now_ns() - scale_con->sent_ns[replies % SEND_WQE_PER_QP]);
+		scale_con->replies.store(replies + 1, std::memory_order_release);
+		if (running.load(std::memory_order_relaxed))
+			send_one(scale_con);
+	}
+	private:
+	scale_connection* scale_con;
+};
+
+class ConnectCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		scale_connection* scale_con = new scale_connection();
+		scale_con->con = static_cast<RDMAConnection*>(param);
+		scale_con->con->set_read_callback(new EchoCallback(scale_con));
+		std::lock_guard<std::mutex> l(mtx);
+		cons.push_back(scale_con);
+	}
+
+	std::mutex mtx;
+	std::vector<scale_connection*> cons;
+};
+
+uint64_t worker_cpu_ns(RDMAStack* stack)
+{
+	std::vector<uint64_t> workers = stack->get_worker_cpu_ns();
+	return std::accumulate(workers.begin(), workers.end(), (uint64_t)0);
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("RC connection count scaling, run against lat_server", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address, server.server_ip_addr by default", false, "", "host", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	TCLAP::ValueArg<std::string> steps_arg("n", "connections", "comma separated connection counts", false, "1,10,100,1000,10000", "list", cmd);
+	TCLAP::ValueArg<uint32_t> size_arg("s", "size", "message size in bytes", false, 64, "bytes", cmd);
+	TCLAP::ValueArg<uint32_t> depth_arg("o", "outstanding", "messages in flight per connection", false, 1, "depth", cmd);
+	TCLAP::ValueArg<uint32_t> duration_arg("d", "duration", "milliseconds per step", false, 5000, "ms", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	std::string addr = addr_arg.getValue().empty() ? config->server_config.server_ip_addr : addr_arg.getValue();
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+	std::vector<uint64_t> steps = bench_parse_list(steps_arg.getValue());
+	uint32_t outstanding = std::min(std::max(depth_arg.getValue(), 1U), SEND_WQE_PER_QP);
+	if (!size_arg.getValue() || size_arg.getValue() > SGE_MSG_SIZE) {
+		std::cerr << "message size must be within 1.." << SGE_MSG_SIZE << std::endl;
+		return 1;
+	}
+	payload.assign(size_arg.getValue(), 'x');
+
+	struct addrinfo* res = bench_resolve(addr, port);
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	ConnectCallback connect_callback;
+	std::vector<scale_connection*>& cons = connect_callback.cons;
+	RDMAStack* stack = new RDMAStack(false);
+	bench_apply_worker_config(stack, config->worker_config);
+	Connector* connector = new Connector(res->ai_addr);
+	connector->set_network_stack(stack);
+	uint64_t base_rss = bench_rss_bytes();
+	uint64_t base_pinned = bench_pinned_bytes();
+	// upper bound of the connection buffers, only used to skip steps that cannot fit
+	uint64_t pinned_per_con = (uint64_t)RECV_WQE_PER_QP * SGE_MSG_SIZE + (uint64_t)SEND_WQE_PER_QP * SGE_MSG_SIZE;
+
+	printf("%8s %10s %10s %10s %10s %10s %10s %10s %10s %12s %12s\n", "cons", "setup_ms", "cons/s",
+			"Mmsg/s", "Gbit/s", "p50_us", "p99_us", "p99.9_us", "cq_cpu%", "rss_MiB", "pinned_MiB");
+	for (auto step : steps) {
+		if (step * pinned_per_con > bench_phys_bytes()) {
+			printf("%8lu skipped: needs %lu MiB pinned for connection buffers\n", step,
+					step * pinned_per_con >> 20);
+			continue;
+		}
+
+		uint64_t have = cons.size();
+		double setup_ms = 0;
+		if (step > have) {
+			uint64_t start = bench_now_ns();
+			ConnectWaiter waiter(&connect_callback, step - have);
+			for (uint64_t i = have; i < step; ++i) {
+				connector->async_connect(&waiter);
+			}
+			waiter.wait();
+			setup_ms = (bench_now_ns() - start) / 1e6;
+		}
+		if (cons.size() < step) {
+			printf("%8lu only %lu connections established, stopping\n", step, cons.size());
+			break;
+		}
+
+		for (uint64_t i = 0; i < step; ++i) {
+			cons[i]->sent.store(0);
+			cons[i]->replies.store(0);
+			cons[i]->hist.reset();
+		}
+		uint64_t cpu_before = worker_cpu_ns(stack);
+		running.store(true);
+		uint64_t start = bench_now_ns();
+		for (uint64_t i = 0; i < step; ++i) {
+			for (uint32_t k = 0; k < outstanding; ++k) {
+				send_one(cons[i]);
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(duration_arg.getValue()));
+		running.store(false);
+		uint64_t end = bench_now_ns();
+		uint64_t cpu_after = worker_cpu_ns(stack);
+		uint64_t msgs = 0;
+		for (uint64_t i = 0; i < step; ++i) {
+			msgs += cons[i]->replies.load();
+		}
+
+		// in-flight echoes land before the counters are read and reset
+		uint64_t drain_deadline = bench_now_ns() + 1000000000ULL;
+		HdrHistogram total;
+		for (uint64_t i = 0; i < step; ++i) {
+			while (cons[i]->replies.load(std::memory_order_acquire) < cons[i]->sent.load() &&
+					bench_now_ns() < drain_deadline) {
+				std::this_thread::yield();
+			}
+			total.merge(cons[i]->hist);
+		}
+
+		double seconds = (end - start) / 1e9;
+		uint64_t workers = std::max<uint64_t>(stack->get_worker_cpu_ns().size(), 1);
+		printf("%8lu %10.1f %10.1f %10.3f %10.3f %10.3f %10.3f %10.3f %10.1f %12.1f %12.1f\n", step,
+				setup_ms, setup_ms ? (step - have) / setup_ms * 1e3 : 0.0, msgs / seconds / 1e6,
+				msgs * payload.size() * 8 / seconds / 1e9, total.percentile(50) / 1e3,
+				total.percentile(99) / 1e3, total.percentile(99.9) / 1e3,
+				100.0 * (cpu_after - cpu_before) / (end - start) / workers,
+				(bench_rss_bytes() - base_rss) / 1048576.0, (bench_pinned_bytes() - base_pinned) / 1048576.0);
+		fflush(stdout);
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
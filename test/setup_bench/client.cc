@@ -0,0 +1,145 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include <mutex>
+#include <thread>
+
+#include "tclap/CmdLine.h"
+#include "rdma_messenger/Connector.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/BenchConfig.h"
+#include "test/common/HdrHistogram.h"
+
+// Connection setup rate against lat_server: every cycle connects a batch in
+// parallel, takes the phase timestamps of each connect and disconnects again.
+enum setup_phase {
+	PHASE_RESOLVE_ADDR = 0,
+	PHASE_RESOLVE_ROUTE,
+	PHASE_CREATE,
+	PHASE_CONNECT_CALL,
+	PHASE_HANDSHAKE,
+	PHASE_TOTAL,
+	PHASE_DISCONNECT_CALL,
+	PHASE_NUMS,
+};
+
+const char* phase_names[PHASE_NUMS] = {
+	"resolve_addr", "resolve_route", "pd_cq_mr_qp", "rdma_connect", "established", "total", "rdma_disconnect",
+};
+
+class CollectCallback : public Callback {
+	public:
+	virtual void callback_entry(void* param, void* msg = nullptr) override
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		cons.push_back(static_cast<RDMAConnection*>(param));
+	}
+
+	std::mutex mtx;
+	std::vector<RDMAConnection*> cons;
+};
+
+void record_phases(const connect_timing& t, std::vector<HdrHistogram>& phases)
+{
+	phases[PHASE_RESOLVE_ADDR].record(t.addr_resolved_ns - t.start_ns);
+	phases[PHASE_RESOLVE_ROUTE].record(t.route_resolved_ns - t.addr_resolved_ns);
+	phases[PHASE_CREATE].record(t.qp_created_ns - t.route_resolved_ns);
+	phases[PHASE_CONNECT_CALL].record(t.connect_sent_ns - t.qp_created_ns);
+	phases[PHASE_HANDSHAKE].record(t.established_ns - t.connect_sent_ns);
+	phases[PHASE_TOTAL].record(t.established_ns - t.start_ns);
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("RC connection setup rate with a per-phase breakdown, run against lat_server", ' ', "0.1");
+	TCLAP::ValueArg<std::string> conf_arg("c", "conf", "yaml config", false, "config.yaml", "file", cmd);
+	TCLAP::ValueArg<std::string> addr_arg("a", "addr", "server address, server.server_ip_addr by default", false, "", "host", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("p", "port", "rdma_cm port, server.server_cm_port by default", false, 0, "port", cmd);
+	TCLAP::ValueArg<uint32_t> cycles_arg("n", "cycles", "connect and disconnect cycles", false, 100, "count", cmd);
+	TCLAP::ValueArg<uint32_t> batch_arg("b", "batch", "connects in flight per cycle", false, 1, "connections", cmd);
+	TCLAP::ValueArg<uint32_t> warmup_arg("w", "warmup", "untimed cycles first, the first one starts the CQ workers", false, 1, "count", cmd);
+	TCLAP::ValueArg<uint32_t> gap_arg("g", "gap", "milliseconds between a disconnect and the next cycle", false, 10, "ms", cmd);
+	cmd.parse(argc, argv);
+
+	ConfigParameter::ConfigValue* config = bench_load_config(argc, argv);
+	if (!config)
+		return 1;
+	std::string addr = addr_arg.getValue().empty() ? config->server_config.server_ip_addr : addr_arg.getValue();
+	uint32_t port = port_arg.getValue() ? port_arg.getValue() : config->server_config.server_cm_port;
+	uint32_t batch = std::max(batch_arg.getValue(), 1U);
+
+	struct addrinfo* res = bench_resolve(addr, port);
+	if (!res) {
+		std::cerr << "failed to get addr info" << std::endl;
+		return 1;
+	}
+
+	RDMAStack* stack = new RDMAStack(false);
+	bench_apply_worker_config(stack, config->worker_config);
+	Connector* connector = new Connector(res->ai_addr);
+	connector->set_network_stack(stack);
+
+	std::vector<HdrHistogram> phases(PHASE_NUMS);
+	uint64_t established = 0, failed = 0, busy_ns = 0;
+	uint32_t cycles = warmup_arg.getValue() + cycles_arg.getValue();
+	for (uint32_t cycle = 0; cycle < cycles; ++cycle) {
+		bool timed = cycle >= warmup_arg.getValue();
+		std::vector<connect_timing> timings(batch);
+		CollectCallback collect;
+		ConnectWaiter waiter(&collect, batch);
+
+		uint64_t start = bench_now_ns();
+		for (uint32_t i = 0; i < batch; ++i) {
+			connector->async_connect(&waiter, nullptr, 0, &timings[i]);
+		}
+		uint32_t cycle_failed = waiter.wait();
+		for (auto con : collect.cons) {
+			uint64_t call = bench_now_ns();
+			stack->disconnect(con);
+			if (timed)
+				phases[PHASE_DISCONNECT_CALL].record(bench_now_ns() - call);
+		}
+		uint64_t end = bench_now_ns();
+
+		if (timed) {
+			for (auto& t : timings) {
+				if (t.established_ns)
+					record_phases(t, phases);
+			}
+			established += collect.cons.size();
+			failed += cycle_failed;
+			busy_ns += end - start;
+		}
+		// the stack releases both ends on RDMA_CM_EVENT_DISCONNECTED meanwhile
+		std::this_thread::sleep_for(std::chrono::milliseconds(gap_arg.getValue()));
+	}
+
+	printf("%lu connections established, %lu failed, batch %u\n", established, failed, batch);
+	printf("%.1f connections/s while connecting, gaps excluded\n", busy_ns ? established / (busy_ns / 1e9) : 0.0);
+	printf("%-16s %10s %10s %10s %10s %10s %10s  (us)\n", "phase", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (uint32_t i = 0; i < PHASE_NUMS; ++i) {
+		HdrHistogram& h = phases[i];
+		printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], h.get_mean() / 1e3,
+				h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+				h.percentile(99.9) / 1e3, h.get_max() / 1e3);
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
@@ -0,0 +1,608 @@
+/*
+ * Copyright 2019 Liu Changcheng <changcheng.liu@aliyun.com>
+ * Author: Liu Changcheng <changcheng.liu@aliyun.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include <infiniband/verbs.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "tclap/CmdLine.h"
+#include "test/common/BenchUtil.h"
+#include "test/common/HdrHistogram.h"
+#include "test/common/VerbsUtil.h"
+
+// Cost of the verbs primitives the library is built on, measured on one
+// local device (a real HCA or soft-RoCE) with a loopback RC pair: qp[0]
+// writes or sends to qp[1]. Every library level optimization competes
+// against these floors. Times are per call of the primitive, not per byte.
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define VERBS_QUEUE_DEPTH 64
+#define VERBS_SLOT_SIZE 8
+
+struct verbs_env {
+	struct ibv_context* ctx = nullptr;
+	struct ibv_pd* pd = nullptr;
+	struct ibv_comp_channel* channel = nullptr;
+	struct ibv_cq* cq = nullptr;
+	struct ibv_qp* qp[2] = {};
+	struct ibv_qp_init_attr init_attr = {};
+	struct ibv_port_attr port_attr = {};
+	union ibv_gid gid = {};
+	uint8_t port = 1;
+	int gid_index = 0;
+	bool inline_write = false;
+
+	// source slots on the sending side, write target on the receiving side
+	char* src = nullptr;
+	struct ibv_mr* src_mr = nullptr;
+	char* dst = nullptr;
+	struct ibv_mr* dst_mr = nullptr;
+};
+
+static bool wait_wc(verbs_env& env, int n)
+{
+	struct ibv_wc wc[16];
+	while (n > 0) {
+		int got = ibv_poll_cq(env.cq, std::min(n, 16), wc);
+		if (got < 0)
+			return false;
+		for (int i = 0; i < got; ++i) {
+			if (wc[i].status) {
+				std::cerr << "loopback wc error: " << ibv_wc_status_str(wc[i].status) << std::endl;
+				return false;
+			}
+		}
+		n -= got;
+	}
+	return true;
+}
+
+static bool setup(verbs_env& env, const std::string& dev_name, uint8_t port, int gid_index)
+{
+	env.ctx = verbs_open_device(dev_name);
+	if (!env.ctx)
+		return false;
+	env.port = port;
+	env.gid_index = gid_index;
+	if (ibv_query_port(env.ctx, port, &env.port_attr) || ibv_query_gid(env.ctx, port, gid_index, &env.gid))
+		return false;
+
+	env.pd = ibv_alloc_pd(env.ctx);
+	env.channel = ibv_create_comp_channel(env.ctx);
+	if (!env.pd || !env.channel)
+		return false;
+	env.cq = ibv_create_cq(env.ctx, 4 * VERBS_QUEUE_DEPTH, nullptr, env.channel, 0);
+	if (!env.cq)
+		return false;
+
+	env.init_attr.send_cq = env.cq;
+	env.init_attr.recv_cq = env.cq;
+	env.init_attr.qp_type = IBV_QPT_RC;
+	env.init_attr.cap.max_send_wr = VERBS_QUEUE_DEPTH;
+	env.init_attr.cap.max_recv_wr = VERBS_QUEUE_DEPTH;
+	env.init_attr.cap.max_send_sge = 1;
+	env.init_attr.cap.max_recv_sge = 1;
+	env.init_attr.cap.max_inline_data = VERBS_SLOT_SIZE;
+	for (int i = 0; i < 2; ++i) {
+		struct ibv_qp_init_attr attr = env.init_attr;
+		env.qp[i] = ibv_create_qp(env.pd, &attr);
+		if (!env.qp[i]) {
+			env.init_attr.cap.max_inline_data = 0;
+			attr = env.init_attr;
+			env.qp[i] = ibv_create_qp(env.pd, &attr);
+		}
+		if (!env.qp[i])
+			return false;
+	}
+	env.inline_write = env.init_attr.cap.max_inline_data >= VERBS_SLOT_SIZE;
+	if (!verbs_connect_qp(env.qp[0], env.qp[1]->qp_num, port, env.port_attr, env.gid, gid_index) ||
+	    !verbs_connect_qp(env.qp[1], env.qp[0]->qp_num, port, env.port_attr, env.gid, gid_index))
+		return false;
+
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	uint32_t len = VERBS_QUEUE_DEPTH * VERBS_SLOT_SIZE;
+	env.src = static_cast<char*>(memalign(4096, len));
+	env.dst = static_cast<char*>(memalign(4096, len));
+	memset(env.src, 0, len);
+	memset(env.dst, 0, len);
+	env.src_mr = ibv_reg_mr(env.pd, env.src, len, access);
+	env.dst_mr = ibv_reg_mr(env.pd, env.dst, len, access);
+	return env.src_mr && env.dst_mr;
+}
+
+static void teardown(verbs_env& env)
+{
+	if (env.src_mr)
+		ibv_dereg_mr(env.src_mr);
+	if (env.dst_mr)
+		ibv_dereg_mr(env.dst_mr);
+	for (int i = 0; i < 2; ++i) {
+		if (env.qp[i])
+			ibv_destroy_qp(env.qp[i]);
+	}
+	if (env.cq)
+		ibv_destroy_cq(env.cq);
+	if (env.channel)
+		ibv_destroy_comp_channel(env.channel);
+	if (env.pd)
+		ibv_dealloc_pd(env.pd);
+	if (env.ctx)
+		ibv_close_device(env.ctx);
+	free(env.src);
+	free(env.dst);
+}
+
+// `nums` chained RDMA writes of one slot each, only the last one signaled;
+// the last write lands in slot 0 so its arrival implies all the others
+static void build_writes(verbs_env& env, std::vector<struct ibv_send_wr>& wrs,
+		std::vector<struct ibv_sge>& sges, uint32_t nums)
+{
+	wrs.assign(nums, ibv_send_wr());
+	sges.assign(nums, ibv_sge());
+	for (uint32_t i = 0; i < nums; ++i) {
+		uint32_t slot = i + 1 == nums ? 0 : i + 1;
+		sges[i].addr = (uintptr_t) (env.src + slot * VERBS_SLOT_SIZE);
+		sges[i].length = VERBS_SLOT_SIZE;
+		sges[i].lkey = env.src_mr->lkey;
+		wrs[i].wr_id = i;
+		wrs[i].opcode = IBV_WR_RDMA_WRITE;
+		wrs[i].sg_list = &sges[i];
+		wrs[i].num_sge = 1;
+		wrs[i].send_flags = env.inline_write ? IBV_SEND_INLINE : 0;
+		wrs[i].wr.rdma.remote_addr = (uintptr_t) (env.dst + slot * VERBS_SLOT_SIZE);
+		wrs[i].wr.rdma.rkey = env.dst_mr->rkey;
+		wrs[i].next = i + 1 < nums ? &wrs[i + 1] : nullptr;
+	}
+	wrs[nums - 1].send_flags |= IBV_SEND_SIGNALED;
+}
+
+static void print_header(const char* first)
+{
+	printf("%-22s %10s %10s %10s %10s\n", first, "mean_ns", "p50_ns", "p99_ns", "p99.9_ns");
+}
+
+static void print_row(const std::string& name, const HdrHistogram& hist)
+{
+	printf("%-22s %10.0f %10lu %10lu %10lu\n", name.c_str(), hist.get_mean(),
+			hist.percentile(50), hist.percentile(99), hist.percentile(99.9));
+}
+
+enum page_kind {
+	PAGE_SMALL = 0,
+	PAGE_THP,
+	PAGE_HUGETLB,
+	PAGE_KIND_NUMS,
+};
+
+static const char* page_kind_name(page_kind kind)
+{
+	switch (kind) {
+	case PAGE_SMALL:
+		return "4k";
+	case PAGE_THP:
+		return "thp";
+	case PAGE_HUGETLB:
+		return "hugetlb";
+	default:
+		return "unknown";
+	}
+}
+
+// faulted in memory of the given page kind, nullptr when the kernel has none
+static char* map_pages(page_kind kind, uint64_t len)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (kind == PAGE_HUGETLB)
+		flags |= MAP_HUGETLB;
+	void* buf = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (buf == MAP_FAILED)
+		return nullptr;
+	if (kind == PAGE_THP)
+		madvise(buf, len, MADV_HUGEPAGE);
+	else if (kind == PAGE_SMALL)
+		madvise(buf, len, MADV_NOHUGEPAGE);
+	memset(buf, 0, len);
+	return static_cast<char*>(buf);
+}
+
+// ibv_reg_mr and ibv_dereg_mr of already resident memory, so page faults
+// stay out of the numbers and only pinning and translation setup is left
+static bool bench_reg_mr(verbs_env& env, const std::vector<uint64_t>& sizes, uint32_t iterations)
+{
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	printf("\nibv_reg_mr / ibv_dereg_mr, p50 us per call\n");
+	printf("%10s", "size");
+	for (int k = 0; k < PAGE_KIND_NUMS; ++k) {
+		std::string kind = page_kind_name(static_cast<page_kind>(k));
+		printf(" %12s %12s", (kind + "_reg").c_str(), (kind + "_dereg").c_str());
+	}
+	printf("\n");
+
+	for (auto size : sizes) {
+		printf("%10lu", size);
+		uint32_t reps = std::max<uint64_t>(5, std::min<uint64_t>(iterations, (256ULL << 20) / size));
+		for (int k = 0; k < PAGE_KIND_NUMS; ++k) {
+			page_kind kind = static_cast<page_kind>(k);
+			uint64_t len = kind == PAGE_SMALL ? size : (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+			char* buf = map_pages(kind, len);
+			if (!buf) {
+				printf(" %12s %12s", "-", "-");
+				continue;
+			}
+			HdrHistogram reg_hist;
+			HdrHistogram dereg_hist;
+			for (uint32_t i = 0; i < reps; ++i) {
+				uint64_t t0 = bench_now_ns();
+				struct ibv_mr* mr = ibv_reg_mr(env.pd, buf, size, access);
+				uint64_t t1 = bench_now_ns();
+				if (!mr) {
+					std::cerr << "ibv_reg_mr of " << size << " bytes failed: " << strerror(errno) << std::endl;
+					munmap(buf, len);
+					return false;
+				}
+				ibv_dereg_mr(mr);
+				uint64_t t2 = bench_now_ns();
+				reg_hist.record(t1 - t0);
+				dereg_hist.record(t2 - t1);
+			}
+			munmap(buf, len);
+			printf(" %12.1f %12.1f", reg_hist.percentile(50) / 1e3, dereg_hist.percentile(50) / 1e3);
+		}
+		printf("\n");
+	}
+	return true;
+}
+
+// each step of bringing an RC QP up and tearing it down, pointed at qp[1]
+static bool bench_qp_lifecycle(verbs_env& env, uint32_t iterations)
+{
+	enum { CREATE, INIT, RTR, RTS, DESTROY, STEP_NUMS };
+	const char* names[STEP_NUMS] = {"ibv_create_qp", "modify RESET->INIT", "modify INIT->RTR",
+		"modify RTR->RTS", "ibv_destroy_qp"};
+	std::vector<HdrHistogram> hists(STEP_NUMS);
+
+	for (uint32_t i = 0; i < iterations; ++i) {
+		uint64_t t[STEP_NUMS + 1];
+		struct ibv_qp_init_attr attr = env.init_attr;
+		t[0] = bench_now_ns();
+		struct ibv_qp* qp = ibv_create_qp(env.pd, &attr);
+		t[1] = bench_now_ns();
+		if (!qp) {
+			std::cerr << "ibv_create_qp failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+		bool ok = verbs_qp_to_init(qp, env.port);
+		t[2] = bench_now_ns();
+		ok = ok && verbs_qp_to_rtr(qp, env.qp[1]->qp_num, env.port, env.port_attr, env.gid, env.gid_index);
+		t[3] = bench_now_ns();
+		ok = ok && verbs_qp_to_rts(qp);
+		t[4] = bench_now_ns();
+		ibv_destroy_qp(qp);
+		t[5] = bench_now_ns();
+		if (!ok) {
+			std::cerr << "ibv_modify_qp failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+		for (int s = 0; s < STEP_NUMS; ++s) {
+			hists[s].record(t[s + 1] - t[s]);
+		}
+	}
+
+	printf("\nRC QP lifecycle, %u QPs\n", iterations);
+	print_header("step");
+	for (int s = 0; s < STEP_NUMS; ++s) {
+		print_row(names[s], hists[s]);
+	}
+	return true;
+}
+
+// one ibv_post_send of a chain of `batch` writes against `batch` calls of
+// one write each; the gap is what one doorbell per batch saves
+static bool bench_post_send(verbs_env& env, const std::vector<uint64_t>& batches, uint32_t iterations)
+{
+	printf("\nibv_post_send of %u byte RDMA writes%s, ns per WR\n", VERBS_SLOT_SIZE,
+			env.inline_write ? " (inline)" : "");
+	printf("%8s %12s %12s %12s %12s\n", "batch", "chain_p50", "chain_p99", "single_p50", "single_p99");
+
+	std::vector<struct ibv_send_wr> wrs;
+	std::vector<struct ibv_sge> sges;
+	struct ibv_send_wr* bad_wr = nullptr;
+	for (auto batch : batches) {
+		build_writes(env, wrs, sges, batch);
+		HdrHistogram chain_hist;
+		HdrHistogram single_hist;
+		for (uint32_t i = 0; i < iterations; ++i) {
+			uint64_t t0 = bench_now_ns();
+			int ret = ibv_post_send(env.qp[0], &wrs[0], &bad_wr);
+			uint64_t t1 = bench_now_ns();
+			if (ret || !wait_wc(env, 1))
+				return false;
+			chain_hist.record(t1 - t0);
+
+			uint64_t elapsed = 0;
+			for (uint32_t k = 0; k < batch; ++k) {
+				struct ibv_send_wr* next = wrs[k].next;
+				wrs[k].next = nullptr;
+				t0 = bench_now_ns();
+				ret = ibv_post_send(env.qp[0], &wrs[k], &bad_wr);
+				elapsed += bench_now_ns() - t0;
+				wrs[k].next = next;
+				if (ret)
+					return false;
+			}
+			if (!wait_wc(env, 1))
+				return false;
+			single_hist.record(elapsed);
+		}
+		printf("%8lu %12.1f %12.1f %12.1f %12.1f\n", batch,
+				(double) chain_hist.percentile(50) / batch, (double) chain_hist.percentile(99) / batch,
+				(double) single_hist.percentile(50) / batch, (double) single_hist.percentile(99) / batch);
+	}
+	return true;
+}
+
+// ibv_post_recv of zero length receives, consumed between samples by as
+// many empty sends from qp[0]
+static bool bench_post_recv(verbs_env& env, const std::vector<uint64_t>& batches, uint32_t iterations)
+{
+	printf("\nibv_post_recv, ns per WR\n");
+	printf("%8s %12s %12s %12s %12s\n", "batch", "chain_p50", "chain_p99", "single_p50", "single_p99");
+
+	std::vector<struct ibv_recv_wr> recv_wrs;
+	std::vector<struct ibv_send_wr> send_wrs;
+	struct ibv_recv_wr* bad_recv_wr = nullptr;
+	struct ibv_send_wr* bad_send_wr = nullptr;
+	for (auto batch : batches) {
+		recv_wrs.assign(batch, ibv_recv_wr());
+		send_wrs.assign(batch, ibv_send_wr());
+		for (uint32_t k = 0; k < batch; ++k) {
+			recv_wrs[k].wr_id = k;
+			recv_wrs[k].next = k + 1 < batch ? &recv_wrs[k + 1] : nullptr;
+			send_wrs[k].wr_id = k;
+			send_wrs[k].opcode = IBV_WR_SEND;
+			send_wrs[k].next = k + 1 < batch ? &send_wrs[k + 1] : nullptr;
+		}
+		send_wrs[batch - 1].send_flags = IBV_SEND_SIGNALED;
+
+		HdrHistogram chain_hist;
+		HdrHistogram single_hist;
+		for (uint32_t i = 0; i < iterations; ++i) {
+			uint64_t t0 = bench_now_ns();
+			int ret = ibv_post_recv(env.qp[1], &recv_wrs[0], &bad_recv_wr);
+			uint64_t t1 = bench_now_ns();
+			if (ret || ibv_post_send(env.qp[0], &send_wrs[0], &bad_send_wr) || !wait_wc(env, batch + 1))
+				return false;
+			chain_hist.record(t1 - t0);
+
+			uint64_t elapsed = 0;
+			for (uint32_t k = 0; k < batch; ++k) {
+				struct ibv_recv_wr* next = recv_wrs[k].next;
+				recv_wrs[k].next = nullptr;
+				t0 = bench_now_ns();
+				ret = ibv_post_recv(env.qp[1], &recv_wrs[k], &bad_recv_wr);
+				elapsed += bench_now_ns() - t0;
+				recv_wrs[k].next = next;
+				if (ret)
+					return false;
+			}
+			if (ibv_post_send(env.qp[0], &send_wrs[0], &bad_send_wr) || !wait_wc(env, batch + 1))
+				return false;
+			single_hist.record(elapsed);
+		}
+		printf("%8lu %12.1f %12.1f %12.1f %12.1f\n", batch,
+				(double) chain_hist.percentile(50) / batch, (double) chain_hist.percentile(99) / batch,
+				(double) single_hist.percentile(50) / batch, (double) single_hist.percentile(99) / batch);
+	}
+	return true;
+}
+
+// one ibv_poll_cq asking for `batch` entries with `batch` signaled writes
+// already completed; a sample is dropped when some were still in flight
+static bool bench_poll_cq(verbs_env& env, const std::vector<uint64_t>& batches, uint32_t iterations)
+{
+	printf("\nibv_poll_cq\n");
+	printf("%8s %12s %12s %12s %10s\n", "batch", "call_p50", "call_p99", "per_wc_p50", "dropped");
+
+	struct ibv_wc wc[VERBS_QUEUE_DEPTH];
+	HdrHistogram empty_hist;
+	for (uint32_t i = 0; i < iterations; ++i) {
+		uint64_t t0 = bench_now_ns();
+		int got = ibv_poll_cq(env.cq, 1, wc);
+		uint64_t t1 = bench_now_ns();
+		if (got != 0)
+			return false;
+		empty_hist.record(t1 - t0);
+	}
+	printf("%8s %12lu %12lu %12s %10s\n", "empty", empty_hist.percentile(50), empty_hist.percentile(99), "-", "-");
+
+	std::vector<struct ibv_send_wr> wrs;
+	std::vector<struct ibv_sge> sges;
+	struct ibv_send_wr* bad_wr = nullptr;
+	volatile uint64_t* marker = reinterpret_cast<volatile uint64_t*>(env.dst);
+	uint64_t seq = *marker;
+	for (auto batch : batches) {
+		build_writes(env, wrs, sges, batch);
+		for (uint32_t k = 0; k < batch; ++k) {
+			wrs[k].send_flags |= IBV_SEND_SIGNALED;
+		}
+		HdrHistogram call_hist;
+		uint64_t dropped = 0;
+		for (uint32_t i = 0; i < iterations; ++i) {
+			memcpy(env.src, &++seq, sizeof(seq));
+			if (ibv_post_send(env.qp[0], &wrs[0], &bad_wr))
+				return false;
+			while (*marker != seq);
+			// the acks trail the data by a round trip on the loopback
+			uint64_t settle = bench_now_ns() + 20000;
+			while (bench_now_ns() < settle);
+
+			uint64_t t0 = bench_now_ns();
+			int got = ibv_poll_cq(env.cq, batch, wc);
+			uint64_t t1 = bench_now_ns();
+			if (got < 0 || !wait_wc(env, batch - got))
+				return false;
+			for (int k = 0; k < got; ++k) {
+				if (wc[k].status)
+					return false;
+			}
+			if ((uint64_t) got == batch)
+				call_hist.record(t1 - t0);
+			else
+				dropped++;
+		}
+		printf("%8lu %12lu %12lu %12.1f %10lu\n", batch, call_hist.percentile(50), call_hist.percentile(99),
+				(double) call_hist.percentile(50) / batch, dropped);
+	}
+	return true;
+}
+
+// time from ibv_post_send to a thread blocked in ibv_get_cq_event waking up,
+// against the same post seen by a busy polling ibv_poll_cq
+static bool bench_wakeup(verbs_env& env, uint32_t iterations)
+{
+	std::vector<struct ibv_send_wr> wrs;
+	std::vector<struct ibv_sge> sges;
+	struct ibv_send_wr* bad_wr = nullptr;
+	build_writes(env, wrs, sges, 1);
+
+	HdrHistogram poll_hist;
+	for (uint32_t i = 0; i < iterations; ++i) {
+		uint64_t t0 = bench_now_ns();
+		if (ibv_post_send(env.qp[0], &wrs[0], &bad_wr) || !wait_wc(env, 1))
+			return false;
+		poll_hist.record(bench_now_ns() - t0);
+	}
+
+	std::atomic<bool> armed(false);
+	std::atomic<bool> failed(false);
+	std::atomic<uint64_t> woken_ns(0);
+	std::thread waiter([&]() {
+		for (uint32_t i = 0; i < iterations; ++i) {
+			if (ibv_req_notify_cq(env.cq, 0)) {
+				failed.store(true);
+				return;
+			}
+			armed.store(true);
+			struct ibv_cq* ev_cq = nullptr;
+			void* ev_ctx = nullptr;
+			if (ibv_get_cq_event(env.channel, &ev_cq, &ev_ctx)) {
+				failed.store(true);
+				return;
+			}
+			uint64_t now = bench_now_ns();
+			ibv_ack_cq_events(ev_cq, 1);
+			if (!wait_wc(env, 1)) {
+				failed.store(true);
+				return;
+			}
+			woken_ns.store(now);
+		}
+	});
+
+	HdrHistogram wake_hist;
+	for (uint32_t i = 0; i < iterations && !failed.load(); ++i) {
+		while (!armed.load() && !failed.load());
+		armed.store(false);
+		// make sure the waiter is asleep in the kernel, not on its way there
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		woken_ns.store(0);
+		uint64_t t0 = bench_now_ns();
+		if (ibv_post_send(env.qp[0], &wrs[0], &bad_wr)) {
+			failed.store(true);
+			break;
+		}
+		uint64_t now = 0;
+		while (!(now = woken_ns.load()) && !failed.load());
+		if (now)
+			wake_hist.record(now - t0);
+	}
+	waiter.join();
+	if (failed.load())
+		return false;
+
+	printf("\ncompletion of one signaled write, %u samples\n", iterations);
+	print_header("post to");
+	print_row("busy ibv_poll_cq", poll_hist);
+	print_row("ibv_get_cq_event", wake_hist);
+	printf("wake-up cost over busy polling, p50 %.0f ns\n", (double) wake_hist.percentile(50) - (double) poll_hist.percentile(50));
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	TCLAP::CmdLine cmd("cost of the verbs primitives under the library on a local device or soft-RoCE", ' ', "0.1");
+	TCLAP::ValueArg<std::string> dev_arg("d", "device", "RDMA device, first one when empty", false, "", "name", cmd);
+	TCLAP::ValueArg<uint32_t> port_arg("i", "ib-port", "device port", false, 1, "port", cmd);
+	TCLAP::ValueArg<int> gid_arg("g", "gid-index", "source GID index", false, 0, "index", cmd);
+	TCLAP::ValueArg<uint32_t> iter_arg("n", "iterations", "samples per measurement", false, 2000, "count", cmd);
+	TCLAP::ValueArg<uint32_t> qp_arg("q", "qp-iterations", "QPs created for the lifecycle measurement", false, 200, "count", cmd);
+	TCLAP::ValueArg<std::string> size_arg("s", "sizes", "ibv_reg_mr sizes, list a,b,c or power of two range a:b", false, "4K:256M", "sizes", cmd);
+	TCLAP::ValueArg<std::string> batch_arg("b", "batches", "WR batch sizes, list or power of two range", false, "1:32", "batches", cmd);
+	std::vector<std::string> sections{"all", "mr", "qp", "send", "recv", "poll", "wakeup"};
+	TCLAP::ValuesConstraint<std::string> section_constraint(sections);
+	TCLAP::ValueArg<std::string> only_arg("o", "only", "run a single section", false, "all", &section_constraint, cmd);
+	cmd.parse(argc, argv);
+
+	std::vector<uint64_t> sizes = bench_size_steps(size_arg.getValue());
+	std::vector<uint64_t> batches = bench_size_steps(batch_arg.getValue());
+	uint32_t iterations = iter_arg.getValue();
+	if (sizes.empty() || batches.empty() || iterations == 0 ||
+	    std::any_of(batches.begin(), batches.end(), [](uint64_t b) { return b == 0 || b > VERBS_QUEUE_DEPTH / 2; })) {
+		std::cerr << "need sizes, iterations and batches of 1 to " << VERBS_QUEUE_DEPTH / 2 << std::endl;
+		return 1;
+	}
+
+	verbs_env env;
+	if (!setup(env, dev_arg.getValue(), port_arg.getValue(), gid_arg.getValue())) {
+		std::cerr << "failed to set up the loopback QPs: " << strerror(errno) << std::endl;
+		teardown(env);
+		return 1;
+	}
+	printf("device %s, port %u, %s link\n", ibv_get_device_name(env.ctx->device), env.port,
+			env.port_attr.link_layer == IBV_LINK_LAYER_ETHERNET ? "ethernet" : "infiniband");
+
+	const std::string& only = only_arg.getValue();
+	bool ok = true;
+	if (ok && (only == "all" || only == "mr"))
+		ok = bench_reg_mr(env, sizes, iterations);
+	if (ok && (only == "all" || only == "qp"))
+		ok = bench_qp_lifecycle(env, qp_arg.getValue());
+	if (ok && (only == "all" || only == "send"))
+		ok = bench_post_send(env, batches, iterations);
+	if (ok && (only == "all" || only == "recv"))
+		ok = bench_post_recv(env, batches, iterations);
+	if (ok && (only == "all" || only == "poll"))
+		ok = bench_poll_cq(env, batches, iterations);
+	if (ok && (only == "all" || only == "wakeup"))
+		ok = bench_wakeup(env, iterations);
+	if (!ok)
+		std::cerr << "benchmark aborted" << std::endl;
+
+	teardown(env);
+	return ok ? 0 : 1;
+}